@@ -37,6 +37,8 @@ class scene:
             emissive=material.get("Ke", [0, 0, 0]),
         )
         box.visual.material.name = material_name
+        # kept so export_primitive_scene can write the box as one analytic primitive
+        box.metadata["box"] = {"min": box.bounds[0].tolist(), "max": box.bounds[1].tolist(), "material": material_name}
         return box
 
     def export_scene(self, output_file="cornell_box.obj"):
@@ -44,6 +46,36 @@ class scene:
         self._scene.export(output_file)
 
 
+    def export_primitive_scene(self, output_file="cornell_box.scene"):
+        """
+        Exports the scene as a .scene description for the simulation: boxes from
+        create_box_with_material become analytic box primitives, every other
+        geometry goes to <stem>_mesh.obj, referenced by an obj line.
+        """
+        stem = output_file[:-len(".scene")] if output_file.endswith(".scene") else output_file
+        base = stem.split("/")[-1]
+        lines = [f"mtllib {base}.mtl"]
+        meshes = trimesh.Scene()
+        for name, geom in self._scene.geometry.items():
+            box = geom.metadata.get("box")
+            if box is None:
+                meshes.add_geometry(geom, node_name=name)
+                continue
+            lines.append("box " + " ".join(f"{v:.6f}" for v in box["min"] + box["max"]) + f" {box['material']}")
+        if meshes.geometry:
+            meshes.export(f"{stem}_mesh.obj")
+            lines.insert(1, f"obj {base}_mesh.obj")
+
+        with open(f"{stem}.mtl", "w") as mtl:
+            for name, material in self._materials.items():
+                mtl.write(f"newmtl {name}\n")
+                for key in ("Ka", "Kd", "Ks"):
+                    mtl.write(f"{key} " + " ".join(str(v) for v in material.get(key, [0, 0, 0])) + "\n")
+                mtl.write("\n")
+        with open(output_file if output_file.endswith(".scene") else f"{stem}.scene", "w") as description:
+            description.write("\n".join(lines) + "\n")
+
+
     def remove_geometry_by_name(self, name: str):
         """
         Removes a geometry by its name from the scene.
@@ -12,6 +12,7 @@ if __name__ == "__main__":
     parser.add_argument("--camera_location", nargs=3, type=float, help="Camera location coordinates (x y z)")
     parser.add_argument("--look_at", nargs=3, type=float, help="Camera look-at coordinates (x y z)")
     parser.add_argument("--camera_file", type=str, help="Path to generated camera JSON file")    
+    parser.add_argument("--primitives", action="store_true", help="Also write a .scene description with the boxes as analytic primitives")
     output_file = "cornell_box.obj"
     detector_distance = 1000
     args = parser.parse_args()
@@ -113,6 +114,8 @@ if __name__ == "__main__":
 
     # Export the scene
     scene_obj.export_scene(output_file)
+    if args.primitives:
+        scene_obj.export_primitive_scene(output_file.rsplit(".", 1)[0] + ".scene")
 
 
 
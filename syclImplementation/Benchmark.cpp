@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <math.h>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <tiny_obj_loader.h>
+#include <sycl/sycl.hpp>
+#include "Vec.hpp"
+#include "Camera.hpp"
+#include "common.hpp"
+#include "FileProcessor.hpp"
+#include "syclScene.hpp"
+
+// Traversal throughput of every BVH configuration on a set of scenes.
+// Each work-item casts one ray from a random point inside the scene bounds
+// in a uniformly random direction, so the rays are as incoherent as the
+// secondary bounces of doRendering.
+
+struct BenchmarkCase
+{
+    std::string _name;
+    BVHBuildConfig _bvhConfig;
+    bool _instanced = false;    // shapes repeated up to a translation become instances of one mesh
+};
+
+std::vector<BenchmarkCase> traversalCases()
+{
+    std::vector<BenchmarkCase> cases;
+
+    BenchmarkCase middle{"middle/binary", BVHBuildConfig()};
+    middle._bvhConfig._method = BVHBuildMethod::MIDDLE;
+    cases.push_back(middle);
+
+    // Leaf tests through Object -> Geometry* -> Triangle instead of the flat
+    // triangle array. Flattened / indirect throughput on the host runtime,
+    // median of 2-5 runs:
+    //   cornell (36 tris)              +7%
+    //   static_obj_1                   -1%
+    //   city_small (4.8k tris)         +1%
+    //   city_large (480k tris, 46 MB)  +13%
+    //   soup (300k tris, 29 MB)        +7%
+    // Scenes that fit in cache are within noise; scenes that spill out of it
+    // gain 7-13%. Cache misses were not counted (no PMU), so rerun this case
+    // on the device with benchmark.sh.
+    BenchmarkCase indirect{"sah/binary/geom", BVHBuildConfig()};
+    indirect._bvhConfig._flattenPrimitives = false;
+    cases.push_back(indirect);
+
+    cases.push_back({"sah/binary", BVHBuildConfig()});
+
+    BenchmarkCase unordered{"sah/unordered", BVHBuildConfig()};
+    unordered._bvhConfig._layout = BVHLayout::BINARY_UNORDERED;
+    cases.push_back(unordered);
+
+    BenchmarkCase linear{"lbvh/binary", BVHBuildConfig()};
+    linear._bvhConfig._method = BVHBuildMethod::LBVH;
+    cases.push_back(linear);
+
+    BenchmarkCase spatial{"sbvh/binary", BVHBuildConfig()};
+    spatial._bvhConfig._method = BVHBuildMethod::SBVH;
+    cases.push_back(spatial);
+
+    BenchmarkCase spatialCompact{"sbvh/compact", BVHBuildConfig()};
+    spatialCompact._bvhConfig._method = BVHBuildMethod::SBVH;
+    spatialCompact._bvhConfig._layout = BVHLayout::COMPACT;
+    cases.push_back(spatialCompact);
+
+    BenchmarkCase wide4{"sah/bvh4", BVHBuildConfig()};
+    wide4._bvhConfig._layout = BVHLayout::WIDE4;
+    cases.push_back(wide4);
+
+    BenchmarkCase wide8{"sah/bvh8", BVHBuildConfig()};
+    wide8._bvhConfig._layout = BVHLayout::WIDE8;
+    cases.push_back(wide8);
+
+    BenchmarkCase compact{"sah/compact", BVHBuildConfig()};
+    compact._bvhConfig._layout = BVHLayout::COMPACT;
+    cases.push_back(compact);
+
+    BenchmarkCase quantized8{"sah/quant8", BVHBuildConfig()};
+    quantized8._bvhConfig._layout = BVHLayout::QUANTIZED8;
+    cases.push_back(quantized8);
+
+    BenchmarkCase quantized16{"sah/quant16", BVHBuildConfig()};
+    quantized16._bvhConfig._layout = BVHLayout::QUANTIZED16;
+    cases.push_back(quantized16);
+
+    BenchmarkCase block8{"sah/block8", BVHBuildConfig()};
+    block8._bvhConfig._layout = BVHLayout::BLOCK8;
+    block8._bvhConfig._maxLeafSize = 8;
+    cases.push_back(block8);
+
+    BenchmarkCase instanced{"sah/instanced", BVHBuildConfig()};
+    instanced._instanced = true;
+    cases.push_back(instanced);
+
+    return cases;
+}
+
+
+double benchmarkTraversal(sycl::queue& myQueue, Triangle_OBJ_result& scene, const BenchmarkCase& benchCase, ScenePlacement placement,
+                          size_t rayCount, int repeat, unsigned int seed, int& hitCount)
+{
+    Bounds3 sceneBounds;
+    for (auto& tri : scene.Triangles)
+    {
+        sceneBounds = Union(sceneBounds, tri.getBounds_virtual());
+    }
+    Vec3 boundsMin = sceneBounds.pMin;
+    Vec3 boundsExtent = sceneBounds.Diagonal();
+
+    ObjectListContent content(myQueue);
+    if (benchCase._instanced)
+    {
+        std::vector<MeshInfo> meshes;
+        std::vector<InstanceInfo> instances;
+        findTranslatedInstances(scene.Triangles, scene.materialIDs, scene.shapeOffsets, meshes, instances);
+        content.addInstancedObject(meshes, instances, scene.MaterialsInfoList, benchCase._bvhConfig);
+    }
+    else
+    {
+        content.addObject(scene.Triangles, scene.MaterialsInfoList, scene.materialIDs, benchCase._bvhConfig);
+    }
+    if (placement == ScenePlacement::DEVICE)
+    {
+        content.toDevice();
+    }
+    ObjectList sceneObject;
+    sceneObject.setObjects(content);
+    syclScene benchScene(sceneObject);
+    sycl::buffer<syclScene, 1> scenebuf(&benchScene, sycl::range<1>(1));
+
+    double bestSeconds = std::numeric_limits<double>::max();
+    for (int r = 0; r < repeat; r++)
+    {
+        hitCount = 0;
+        {
+            sycl::buffer<int, 1> counter_buf(&hitCount, sycl::range<1>(1));
+            auto startTime = std::chrono::high_resolution_clock::now();
+            myQueue.submit([&](sycl::handler& cgh) {
+                auto sceneAcc = scenebuf.template get_access<sycl::access::mode::read>(cgh);
+                sycl::accessor counter_acc(counter_buf, cgh, sycl::read_write);
+                cgh.parallel_for(sycl::range<1>(rayCount), [=](sycl::id<1> index) {
+                    RNG rng(seed + index[0]);
+                    Vec3 origin = boundsMin + boundsExtent * Vec3(get_random_float(rng), get_random_float(rng), get_random_float(rng));
+                    myComputeType z = 1.0f - 2.0f * get_random_float(rng);
+                    myComputeType r = sycl::sqrt(sycl::fmax((myComputeType)0.0f, 1.0f - z * z));
+                    myComputeType phi = 2.0f * M_PI * get_random_float(rng);
+                    Ray ray(origin, Vec3(r * sycl::cos(phi), r * sycl::sin(phi), z));
+
+                    Intersection intersection = sceneAcc[0].castRay(ray);
+                    if (intersection._hit)
+                    {
+                        auto v_counter = sycl::atomic_ref<
+                            int,
+                            sycl::ext::oneapi::detail::memory_order::relaxed,
+                            sycl::ext::oneapi::detail::memory_scope::device,
+                            sycl::access::address_space::global_space>(counter_acc[0]);
+                        v_counter.fetch_add(1);
+                    }
+                });
+            });
+            myQueue.wait_and_throw();
+            auto endTime = std::chrono::high_resolution_clock::now();
+            bestSeconds = std::min(bestSeconds, std::chrono::duration<double>(endTime - startTime).count());
+        }
+    }
+    return bestSeconds;
+}
+
+
+// Steps through a keyframed sequence the way an animation run would: the
+// first frame is built once, every later frame only moves the vertices and
+// refits. A from-scratch build of the same frame is timed for comparison.
+int benchmarkSequence(sycl::queue& myQueue, const std::vector<std::string>& frames, const BVHBuildConfig& bvhConfig)
+{
+    std::vector<Triangle_OBJ_result> scenes;
+    for (auto& frame : frames)
+    {
+        size_t pos = frame.find_last_of('/');
+        OBJ_Loader loader;
+        loader.addTriangleObjectFile(frame.substr(0, pos), frame.substr(pos));
+        scenes.push_back(loader.outputTrangleResult());
+    }
+
+    ObjectListContent content(myQueue);
+    content.addObject(scenes[0].Triangles, scenes[0].MaterialsInfoList, scenes[0].materialIDs, bvhConfig);
+
+    std::vector<std::string> report;
+    for (size_t f = 1; f < scenes.size(); f++)
+    {
+        if (scenes[f].Triangles.size() != scenes[0].Triangles.size())
+        {
+            std::cerr << frames[f] << " does not have the triangle count of the first frame" << std::endl;
+            return 1;
+        }
+
+        auto refitStart = std::chrono::high_resolution_clock::now();
+        bool rebuilt = content.updateTriangles(scenes[f].Triangles);
+        auto refitEnd = std::chrono::high_resolution_clock::now();
+
+        ObjectListContent rebuild(myQueue);
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        rebuild.addObject(scenes[f].Triangles, scenes[f].MaterialsInfoList, scenes[f].materialIDs, bvhConfig);
+        auto buildEnd = std::chrono::high_resolution_clock::now();
+
+        std::ostringstream line;
+        line << std::left << std::setw(48) << frames[f] << std::right << std::fixed << std::setprecision(2)
+             << std::setw(10) << std::chrono::duration<double, std::milli>(refitEnd - refitStart).count() << " ms update"
+             << std::setw(10) << std::chrono::duration<double, std::milli>(buildEnd - buildStart).count() << " ms rebuild"
+             << (rebuilt ? "  (threshold hit, rebuilt)" : "");
+        report.push_back(line.str());
+    }
+
+    std::cout << std::endl;
+    for (auto& line : report)
+    {
+        std::cout << line << std::endl;
+    }
+    return 0;
+}
+
+
+// Load time of the tinyobjloader path against the parallel parser. The
+// outputs are compared so a parser difference shows up next to the timing.
+int benchmarkLoad(const std::vector<std::string>& models, int threadCount)
+{
+    std::vector<std::string> report;
+    for (auto& model : models)
+    {
+        size_t pos = model.find_last_of('/');
+        std::string ModelDir = model.substr(0, pos);
+        std::string ModelName = model.substr(pos);
+
+        OBJ_Loader serialLoader;
+        auto serialStart = std::chrono::high_resolution_clock::now();
+        serialLoader.addTriangleObjectFile(ModelDir, ModelName);
+        auto serialEnd = std::chrono::high_resolution_clock::now();
+        Triangle_OBJ_result serial = serialLoader.outputTrangleResult();
+
+        OBJ_Loader parallelLoader;
+        auto parallelStart = std::chrono::high_resolution_clock::now();
+        parallelLoader.addTriangleObjectFileParallel(ModelDir, ModelName, threadCount);
+        auto parallelEnd = std::chrono::high_resolution_clock::now();
+        Triangle_OBJ_result parallel = parallelLoader.outputTrangleResult();
+
+        bool same = serial.Triangles.size() == parallel.Triangles.size() && serial.materialIDs == parallel.materialIDs
+                 && serial.MaterialsInfoList.size() == parallel.MaterialsInfoList.size();
+        for (size_t i = 0; same && i < serial.Triangles.size(); i++)
+        {
+            same = (serial.Triangles[i]._v1 - parallel.Triangles[i]._v1).length() <= 1e-5f * (1 + serial.Triangles[i]._v1.length())
+                && (serial.Triangles[i]._v2 - parallel.Triangles[i]._v2).length() <= 1e-5f * (1 + serial.Triangles[i]._v2.length())
+                && (serial.Triangles[i]._v3 - parallel.Triangles[i]._v3).length() <= 1e-5f * (1 + serial.Triangles[i]._v3.length());
+        }
+
+        double millionTriangles = std::max(serial.Triangles.size(), size_t(1)) / 1e6;
+        std::ostringstream line;
+        line << std::left << std::setw(48) << model << std::right << std::fixed << std::setprecision(1)
+             << std::setw(12) << std::chrono::duration<double, std::milli>(serialEnd - serialStart).count() / millionTriangles << " ms/Mtri tinyobj"
+             << std::setw(12) << std::chrono::duration<double, std::milli>(parallelEnd - parallelStart).count() / millionTriangles << " ms/Mtri parallel"
+             << (same ? "" : "  (outputs differ)");
+        report.push_back(line.str());
+    }
+
+    std::cout << std::endl;
+    for (auto& line : report)
+    {
+        std::cout << line << std::endl;
+    }
+    return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> models = {
+        "./Model/cornell_box.obj",
+        "./ADS_calibration/model/static_obj_1.obj",
+        "./ADS_calibration/model/static_obj_3.obj",
+        "./ADS_calibration/model/static_obj_4.obj",
+        "./ADS_calibration/model/static_obj_5.obj",
+        "./ADS_calibration/model/static_obj_6.obj"};
+    size_t rayCount = 1 << 22;
+    int repeat = 3;
+    unsigned int seed = 123;
+
+    auto args = parseFlags(argc, argv);
+    if (args.count("--model") && !args["--model"].empty()) models = args["--model"];
+    if (args.count("--rays") && !args["--rays"].empty()) rayCount = std::stoul(args["--rays"][0]);
+    if (args.count("--repeat") && !args["--repeat"].empty()) repeat = std::stoi(args["--repeat"][0]);
+    if (args.count("--seed") && !args["--seed"].empty()) seed = std::stoi(args["--seed"][0]);
+    // --case <names...> runs only the named cases, e.g. sah/binary sah/quant8
+    std::vector<std::string> caseNames;
+    if (args.count("--case")) caseNames = args["--case"];
+    ScenePlacement placement = ScenePlacement::SHARED;
+    if (args.count("--placement") && !args["--placement"].empty() && args["--placement"][0] == "device") placement = ScenePlacement::DEVICE;
+
+    sycl::queue myQueue(sycl::default_selector_v);
+    std::cout << "Running on " << myQueue.get_device().get_info<sycl::info::device::name>() << std::endl;
+
+    if (args.count("--load"))
+    {
+        int loadThreads = 0;
+        if (args.count("--load_threads") && !args["--load_threads"].empty()) loadThreads = std::stoi(args["--load_threads"][0]);
+        return benchmarkLoad(models, loadThreads);
+    }
+
+    if (args.count("--sequence") && args["--sequence"].size() > 1)
+    {
+        BVHBuildConfig sequenceConfig;
+        if (args.count("--refit_threshold") && !args["--refit_threshold"].empty()) sequenceConfig._refitRebuildThreshold = std::stof(args["--refit_threshold"][0]);
+        return benchmarkSequence(myQueue, args["--sequence"], sequenceConfig);
+    }
+
+    std::vector<std::string> report;
+    for (auto& model : models)
+    {
+        size_t pos = model.find_last_of('/');
+        std::string ModelDir = model.substr(0, pos);
+        std::string ModelName = model.substr(pos);
+
+        OBJ_Loader loader;
+        loader.addTriangleObjectFile(ModelDir, ModelName);
+        Triangle_OBJ_result scene = loader.outputTrangleResult();
+
+        for (auto& benchCase : traversalCases())
+        {
+            if (!caseNames.empty() && std::find(caseNames.begin(), caseNames.end(), benchCase._name) == caseNames.end())
+            {
+                continue;
+            }
+            int hitCount = 0;
+            double seconds = benchmarkTraversal(myQueue, scene, benchCase, placement, rayCount, repeat, seed, hitCount);
+
+            std::ostringstream line;
+            line << std::left << std::setw(48) << model << std::setw(16) << benchCase._name
+                 << std::right << std::setw(12) << std::fixed << std::setprecision(2) << rayCount / seconds / 1e6 << " Mrays/s"
+                 << std::setw(10) << std::setprecision(3) << static_cast<double>(hitCount) / rayCount << " hit ratio";
+            report.push_back(line.str());
+        }
+    }
+
+    std::cout << "\n" << std::left << std::setw(48) << "scene" << std::setw(16) << "bvh" << "throughput" << std::endl;
+    for (auto& line : report)
+    {
+        std::cout << line << std::endl;
+    }
+
+    return 0;
+}
@@ -13,7 +13,13 @@
 #include <chrono>
 #include <sycl/sycl.hpp>
 #include "syclScene.hpp" 
+#include "SceneBuilder.hpp"
+#include "WavefrontRenderer.hpp"
+#include "SampleScheduler.hpp"
+#include "DeviceSelection.hpp"
+#include "PersistentWorkers.hpp"
 #include <filesystem>
+#include <mutex>
 
 
 int main(int argc, char* argv[]){
@@ -63,6 +69,77 @@ int main(int argc, char* argv[]){
   
   if (args.count("--delay_mean") && !args["--delay_mean"].empty()) delay_mean= std::stof(args["--delay_mean"][0]);
   if (args.count("--delay_std") && !args["--delay_std"].empty()) delay_std= std::stof(args["--delay_std"][0]);
+
+  BVHBuildConfig bvhConfig;
+  if (args.count("--bvh") && !args["--bvh"].empty())
+  {
+    const std::string& method = args["--bvh"][0];
+    if (method == "middle") bvhConfig._method = BVHBuildMethod::MIDDLE;
+    else if (method == "sbvh") bvhConfig._method = BVHBuildMethod::SBVH;
+    else if (method == "lbvh") bvhConfig._method = BVHBuildMethod::LBVH;
+    else bvhConfig._method = BVHBuildMethod::SAH;
+  }
+  if (args.count("--sbvh_budget") && !args["--sbvh_budget"].empty()) bvhConfig._spatialSplitBudget = std::stof(args["--sbvh_budget"][0]);
+  if (args.count("--sah_bins") && !args["--sah_bins"].empty()) bvhConfig._binCount = std::stoi(args["--sah_bins"][0]);
+  if (args.count("--sah_leaf_cost") && !args["--sah_leaf_cost"].empty()) bvhConfig._leafCost = std::stof(args["--sah_leaf_cost"][0]);
+  if (args.count("--sah_traversal_cost") && !args["--sah_traversal_cost"].empty()) bvhConfig._traversalCost = std::stof(args["--sah_traversal_cost"][0]);
+  if (args.count("--bvh_width") && !args["--bvh_width"].empty())
+  {
+    int bvhWidth = std::stoi(args["--bvh_width"][0]);
+    bvhConfig._layout = bvhWidth == 8 ? BVHLayout::WIDE8 : (bvhWidth == 4 ? BVHLayout::WIDE4 : BVHLayout::BINARY);
+  }
+  if (args.count("--bvh_compact")) bvhConfig._layout = BVHLayout::COMPACT;
+  if (args.count("--bvh_quantize") && !args["--bvh_quantize"].empty()) bvhConfig._layout = (args["--bvh_quantize"][0] == "16") ? BVHLayout::QUANTIZED16 : BVHLayout::QUANTIZED8;
+  // 8-wide blocks only: 4-wide blocks were no faster than the compact layout
+  if (args.count("--triangle_block")) bvhConfig._layout = BVHLayout::BLOCK8;
+  // the binary BVH with the traversal it had before closest-hit pruning, for comparison
+  if (args.count("--bvh_traversal") && !args["--bvh_traversal"].empty() && args["--bvh_traversal"][0] == "unordered") bvhConfig._layout = BVHLayout::BINARY_UNORDERED;
+  if (args.count("--max_leaf_size") && !args["--max_leaf_size"].empty()) bvhConfig._maxLeafSize = std::stoi(args["--max_leaf_size"][0]);
+  if (args.count("--bvh_threads") && !args["--bvh_threads"].empty()) bvhConfig._threadCount = std::stoi(args["--bvh_threads"][0]);
+  if (args.count("--flat_primitives") && !args["--flat_primitives"].empty()) bvhConfig._flattenPrimitives = std::stoi(args["--flat_primitives"][0]) != 0;
+  // a .scene description and a generated scene bring analytic primitives,
+  // which have neither an instanced nor a cached form
+  bool sceneDescription = inputFile.size() > 6 && inputFile.compare(inputFile.size() - 6, 6, ".scene") == 0;
+  // --generate_scene <seed> builds the randomized Cornell box of scenGen.py in
+  // memory instead of loading --model
+  bool generatedScene = args.count("--generate_scene") && !args["--generate_scene"].empty();
+  uint32_t generatedSceneSeed = generatedScene ? static_cast<uint32_t>(std::stoul(args["--generate_scene"][0])) : 0;
+  bool instancing = args.count("--instancing") > 0 && !sceneDescription && !generatedScene;
+  // indexed triangles are 24 instead of 80 bytes; the flattened primitive copy
+  // would add 48 bytes back, so it is off unless asked for
+  bool indexedMesh = args.count("--indexed_mesh") > 0 && !instancing && !generatedScene;
+  if (indexedMesh && !args.count("--flat_primitives")) bvhConfig._flattenPrimitives = false;
+  bool parallelObjParser = args.count("--obj_parser") && !args["--obj_parser"].empty() && args["--obj_parser"][0] == "parallel";
+  std::string sceneCache;
+  if (args.count("--scene_cache") && !args["--scene_cache"].empty()) sceneCache = args["--scene_cache"][0];
+  ScenePlacement placement = ScenePlacement::SHARED;
+  if (args.count("--placement") && !args["--placement"].empty() && args["--placement"][0] == "device") placement = ScenePlacement::DEVICE;
+  bool hugePages = args.count("--huge_pages") > 0;
+  // the wavefront engine splits every bounce into queue-driven kernels, see WavefrontRenderer.hpp
+  bool wavefront = args.count("--engine") && !args["--engine"].empty() && args["--engine"][0] == "wavefront";
+  size_t wavefrontPaths = 1 << 20;
+  if (args.count("--wavefront_paths") && !args["--wavefront_paths"].empty()) wavefrontPaths = std::stoul(args["--wavefront_paths"][0]);
+  // sort secondary rays by direction octant and origin cell before each extend
+  bool reorderRays = args.count("--reorder_rays") > 0;
+  int reorderBits = 10;
+  if (args.count("--reorder_rays") && !args["--reorder_rays"].empty()) reorderBits = std::stoi(args["--reorder_rays"][0]);
+  bool wavefrontProfile = args.count("--wavefront_profile") > 0;
+  // the megakernel runs as tile x sample-range chunks, see SampleScheduler.hpp
+  SampleChunkConfig chunkConfig;
+  if (args.count("--tile_size") && !args["--tile_size"].empty()) chunkConfig._tileWidth = chunkConfig._tileHeight = std::stoi(args["--tile_size"][0]);
+  if (args.count("--chunk_samples") && !args["--chunk_samples"].empty()) chunkConfig._samplesPerChunk = std::stoi(args["--chunk_samples"][0]);
+  if (args.count("--chunks_in_flight") && !args["--chunks_in_flight"].empty()) chunkConfig._chunksInFlight = std::stoi(args["--chunks_in_flight"][0]);
+  if (args.count("--progress_interval") && !args["--progress_interval"].empty()) chunkConfig._progressSeconds = std::stod(args["--progress_interval"][0]);
+  // gpu, cpu, all or part of a device name; several devices share the chunks, see DeviceSelection.hpp
+  std::string deviceSelection = "gpu";
+  if (args.count("--device") && !args["--device"].empty()) deviceSelection = args["--device"][0];
+  bool splitNuma = args.count("--split_numa") > 0;
+  // --engine persistent: resident work-groups pull path batches from an atomic counter, see PersistentWorkers.hpp
+  bool persistent = args.count("--engine") && !args["--engine"].empty() && args["--engine"][0] == "persistent";
+  PersistentConfig persistentConfig;
+  if (args.count("--persistent_groups") && !args["--persistent_groups"].empty()) persistentConfig._groups = std::stoi(args["--persistent_groups"][0]);
+  if (args.count("--persistent_group_size") && !args["--persistent_group_size"].empty()) persistentConfig._groupSize = std::stoi(args["--persistent_group_size"][0]);
+  if (args.count("--persistent_batch") && !args["--persistent_batch"].empty()) persistentConfig._batchSize = std::stoi(args["--persistent_batch"][0]);
   Vec3 cameraPosition(0.0f, 330.0f, 250 + detectorDistance + 10); // Example camera position
   Vec3 lookAt(0.0f, 274.0f, 0.0f); // Look at the center of the Cornell Box
 
@@ -104,17 +181,99 @@ int main(int argc, char* argv[]){
 
   std::cout << widthUnit << " " << heightUnit << std::endl;
 
-  OBJ_Loader loader;
-  loader.addTriangleObjectFile(ModelDir, ModelName);  
   Camera camera(imageWidth, imageHeight, fov, cameraPosition, lookAt, up, detectorWidth, detectorHeight);
-  loader.addCamera(&camera);
- 
-Triangle_OBJ_result TriangleResult = loader.outputTrangleResult();
+
 std::cout << "hello from GPGPU\n" <<std::endl;
-sycl::queue myQueue(sycl::gpu_selector_v);
+std::vector<sycl::device> devices = selectDevices(deviceSelection, splitNuma);
+sycl::queue myQueue(devices[0]);
 
 ObjectListContent sceneObjListContent(myQueue);
-sceneObjListContent.addObject(TriangleResult.Triangles, TriangleResult.MaterialsInfoList, TriangleResult.materialIDs);
+sceneObjListContent._hugePages = hugePages;
+
+// a cached pack replaces both the OBJ parse and the BVH build
+ScenePack scenePack;
+std::string scenePackFile;
+uint64_t scenePackKey = 0;
+bool scenePackLoaded = false;
+if (!sceneCache.empty() && !instancing && !indexedMesh && !sceneDescription && !generatedScene)
+{
+  ScenePackKey key;
+  if (key.addObjFile(ModelDir, ModelName))
+  {
+    key.addBuildConfig(bvhConfig);
+    auto detector = camera.generateDetector(camera.detectorWidth, camera.detectorHeight);
+    key.addValue(detector.first);
+    key.addValue(detector.second);
+    scenePackKey = key.value();
+    scenePackFile = scenePackPath(sceneCache, ModelName, scenePackKey);
+    scenePackLoaded = scenePack.open(scenePackFile, scenePackKey) && sceneObjListContent.addObjectFromPack(scenePack, bvhConfig);
+  }
+  else
+  {
+    // without the file contents the key would match any scene of that name
+    std::cerr << "Scene cache: could not read " << ModelDir + ModelName << " for the key, not using the cache" << std::endl;
+    sceneCache.clear();
+  }
+}
+
+if (!scenePackLoaded)
+{
+  Triangle_OBJ_result TriangleResult;
+  if (generatedScene)
+  {
+    SceneBuilder builder(generatedSceneSeed);
+    builder.addDefaultMaterials();
+    builder.addCornellBox();
+    builder.addCamera(camera);
+    TriangleResult = builder.result();
+  }
+  else
+  {
+    OBJ_Loader loader;
+    loader.setIndexedStorage(indexedMesh);
+    if (sceneDescription)
+    {
+      loader.addSceneDescription(ModelDir, ModelName, bvhConfig._threadCount);
+    }
+    else if (parallelObjParser)
+    {
+      loader.addTriangleObjectFileParallel(ModelDir, ModelName, bvhConfig._threadCount);
+    }
+    else
+    {
+      loader.addTriangleObjectFile(ModelDir, ModelName);  
+    }
+    loader.addCamera(&camera);
+    TriangleResult = loader.outputTrangleResult();
+  }
+
+  if (instancing)
+  {
+    std::vector<MeshInfo> meshes;
+    std::vector<InstanceInfo> instances;
+    findTranslatedInstances(TriangleResult.Triangles, TriangleResult.materialIDs, TriangleResult.shapeOffsets, meshes, instances);
+    sceneObjListContent.addInstancedObject(meshes, instances, TriangleResult.MaterialsInfoList, bvhConfig);
+  }
+  else if (indexedMesh)
+  {
+    sceneObjListContent.addIndexedObject(TriangleResult.Vertices, TriangleResult.IndexedTriangles, TriangleResult.MaterialsInfoList, TriangleResult.materialIDs, bvhConfig,
+                                         &TriangleResult.Analytic);
+  }
+  else
+  {
+    sceneObjListContent.addObject(TriangleResult.Triangles, TriangleResult.MaterialsInfoList, TriangleResult.materialIDs, bvhConfig,
+                                  &TriangleResult.Analytic);
+    if (!sceneCache.empty() && !sceneDescription && !generatedScene)
+    {
+      std::filesystem::create_directories(sceneCache);
+      sceneObjListContent.writeScenePack(scenePackFile, scenePackKey, TriangleResult.MaterialsInfoList);
+    }
+  }
+}
+if (placement == ScenePlacement::DEVICE)
+{
+  sceneObjListContent.toDevice();
+}
 ObjectList sceneObject;
 sceneObject.setObjects(sceneObjListContent);
 
@@ -140,23 +299,57 @@ sycl::buffer<Camera, 1> camerabuf(&camera, sycl::range<1>(1));
 myQueue.wait_and_throw();
 
 auto startTime = std::chrono::high_resolution_clock::now();
-std::cout << "submitting kernel\n";
-
-myQueue.submit([&](sycl::handler& cgh) {
-sycl::stream out(1024, 256, cgh);
-auto sceneAcc = scenebuf.template get_access<sycl::access::mode::read>(cgh);
-auto cameraAcc = camerabuf.template get_access<sycl::access::mode::read>(cgh);
-
-sycl::accessor counter_acc(counter_buf, cgh, sycl::write_only);
-sycl::accessor collision_acc(collision_buf, cgh, sycl::write_only);
-
-cgh.parallel_for(sycl::range<2>(imageWidth, imageHeight), [=](sycl::id<2> index) 
+uint64_t rayCount = 0;
+if (wavefront)
 {
-  int i = index[0];
-  int j = index[1];
-
-  for (int s = 0; s < ssp; ++s) 
+  std::cout << "running wavefront engine with " << wavefrontPaths << " paths in flight\n";
+  if (devices.size() > 1)
+  {
+    std::cout << "[INFO] The wavefront engine runs on the first device only" << std::endl;
+  }
+  WavefrontSettings settings;
+  settings._imageWidth = imageWidth;
+  settings._imageHeight = imageHeight;
+  settings._ssp = ssp;
+  settings._seed = seed;
+  settings._widthUnit = widthUnit;
+  settings._heightUnit = heightUnit;
+  settings._delayMean = delay_mean;
+  settings._delayStd = delay_std;
+  settings._reorder = reorderRays;
+  settings._reorderBits = reorderBits;
+  settings._sceneBounds = sceneObjListContent.sceneBounds();
+  settings._profile = wavefrontProfile;
+  WavefrontRenderer renderer(myQueue, wavefrontPaths);
+  WavefrontStats stats = renderer.render(scenebuf, camerabuf, settings, collision_buf, counter_buf);
+  rayCount = stats._rays;
+  std::cout << "[INFO] Wavefront engine: " << stats._paths << " paths in " << stats._iterations << " iterations" << std::endl;
+  // with every path in flight at once, iteration k traces the rays of depth k
+  bool singleWave = stats._paths <= wavefrontPaths;
+  for (size_t k = 0; k < stats._batches.size(); k++)
   {
+    const WavefrontBatch& batch = stats._batches[k];
+    std::cout << "[INFO] " << (singleWave ? "Depth " : "Iteration ") << k << ": " << batch._rays << " rays, " << batch._sortedRays << " reordered in "
+              << batch._sortSeconds * 1e3 << " ms, extend " << batch._extendSeconds * 1e3 << " ms, "
+              << (batch._rays > 0 ? batch._extendSeconds * 1e9 / batch._rays : 0) << " ns/ray" << std::endl;
+  }
+}
+else
+{
+// Binds one device's scene, camera and record buffers in cgh and returns the
+// body of the megakernel: trace(i, j, s) follows sample s of pixel (i, j),
+// records it when it reaches the detector and returns the rays it traced.
+auto bindTracer = [&](sycl::handler& cgh, sycl::buffer<syclScene, 1>& sceneBuffer, sycl::buffer<Camera, 1>& cameraBuffer,
+                      sycl::buffer<CollisionRecord>& recordBuffer, sycl::buffer<int, 1>& recordCounter) {
+auto sceneAcc = sceneBuffer.template get_access<sycl::access::mode::read>(cgh);
+auto cameraAcc = cameraBuffer.template get_access<sycl::access::mode::read>(cgh);
+
+sycl::accessor counter_acc(recordCounter, cgh, sycl::write_only);
+sycl::accessor collision_acc(recordBuffer, cgh, sycl::write_only);
+
+return [=](int i, int j, int s) -> uint64_t
+  {
+    // the seed depends only on the pixel and the sample, not on the chunk
     RNG rng(seed + i + j * imageWidth + s *ssp);
     Vec3 rayDir = cameraAcc[0].getRayDirection(i, j, rng); 
     Ray ray(cameraAcc[0].getPosition(), rayDir); 
@@ -190,10 +383,138 @@ cgh.parallel_for(sycl::range<2>(imageWidth, imageHeight), [=](sycl::id<2> index)
 
       collision_acc[idx].emission_delay = tem._emission_delay;
     }
+    return tem._rayCount;
+  };
+};
+
+// one chunk of the megakernel on queue, its records go to recordBuffer; the
+// persistent launch needs the device's PersistentWork, the static one none
+auto submitChunk = [&](sycl::queue& queue, sycl::buffer<syclScene, 1>& sceneBuffer, sycl::buffer<Camera, 1>& cameraBuffer,
+                       sycl::buffer<CollisionRecord>& recordBuffer, sycl::buffer<int, 1>& recordCounter,
+                       sycl::buffer<uint64_t, 1>& rayBuffer, PersistentWork* persistentWork, const SampleChunk& chunk) {
+if (persistentWork != nullptr)
+{
+  return submitPersistentChunk(queue, persistentConfig, chunk, *persistentWork, rayBuffer, [&](sycl::handler& cgh) {
+    return bindTracer(cgh, sceneBuffer, cameraBuffer, recordBuffer, recordCounter);
+  });
+}
+return queue.submit([&](sycl::handler& cgh) {
+auto trace = bindTracer(cgh, sceneBuffer, cameraBuffer, recordBuffer, recordCounter);
+sycl::accessor ray_acc(rayBuffer, cgh, sycl::read_write);
+
+int chunkX = chunk._x;
+int chunkY = chunk._y;
+int sampleBegin = chunk._sampleBegin;
+int sampleEnd = chunk._sampleEnd;
+cgh.parallel_for(sycl::range<2>(chunk._width, chunk._height), [=](sycl::id<2> index) 
+{
+  int i = chunkX + index[0];
+  int j = chunkY + index[1];
+  uint64_t rays = 0;
+
+  for (int s = sampleBegin; s < sampleEnd; ++s) 
+  {
+    rays += trace(i, j, s);
   }
+  auto ray_counter = sycl::atomic_ref<
+      uint64_t,
+      sycl::ext::oneapi::detail::memory_order::relaxed,
+      sycl::ext::oneapi::detail::memory_scope::device,
+      sycl::access::address_space::global_space>(ray_acc[0]);
+  ray_counter.fetch_add(rays);
 
   });
 });
+};
+
+// smaller chunks on several devices: finer balancing and smaller per-device record buffers
+if (devices.size() > 1)
+{
+  chunkConfig._pathsPerChunk = 1 << 22;
+}
+SampleScheduler scheduler(imageWidth, imageHeight, ssp, chunkConfig);
+if (devices.size() == 1)
+{
+  std::unique_ptr<PersistentWork> persistentWork;
+  if (persistent)
+  {
+    persistentWork = std::make_unique<PersistentWork>(devices[0], persistentConfig);
+  }
+  {
+    sycl::buffer<uint64_t, 1> ray_buf(&rayCount, sycl::range<1>(1));
+    scheduler.run([&](const SampleChunk& chunk) {
+      return submitChunk(myQueue, scenebuf, camerabuf, collision_buf, counter_buf, ray_buf, persistentWork.get(), chunk);
+    });
+  }
+  if (persistent)
+  {
+    reportWorkerBalance("Persistent workers", persistentWork->workerRays());
+  }
+}
+else
+{
+  // Every further device renders on its own copy of the scene. A chunk's
+  // records are merged into collision_buf as soon as it is done, so a device
+  // only holds the records of one chunk.
+  std::vector<std::unique_ptr<DeviceScene>> deviceScenes;
+  for (size_t d = 1; d < devices.size(); d++)
+  {
+    deviceScenes.push_back(std::make_unique<DeviceScene>(devices[d]));
+    deviceScenes.back()->load(sceneObjListContent, placement);
+  }
+  size_t chunkRecords = static_cast<size_t>(scheduler.maxChunkPaths());
+  std::vector<std::vector<CollisionRecord>> deviceRecords(devices.size(), std::vector<CollisionRecord>(chunkRecords));
+  std::vector<int> deviceRecordCounts(devices.size(), 0);
+  std::vector<uint64_t> deviceRays(devices.size(), 0);
+  std::vector<Camera> deviceCameras(devices.size(), camera);
+  std::vector<std::unique_ptr<PersistentWork>> devicePersistentWork(devices.size());
+  for (size_t d = 0; persistent && d < devices.size(); d++)
+  {
+    devicePersistentWork[d] = std::make_unique<PersistentWork>(devices[d], persistentConfig);
+  }
+  std::mutex mergeMutex;
+  size_t droppedRecords = 0;
+
+  std::vector<size_t> deviceChunks = scheduler.runDynamic(devices.size(), [&](size_t d, const SampleChunk& chunk) {
+    sycl::queue& queue = d == 0 ? myQueue : deviceScenes[d - 1]->_queue;
+    sycl::buffer<syclScene, 1>& sceneBuffer = d == 0 ? scenebuf : *deviceScenes[d - 1]->_sceneBuffer;
+    {
+      sycl::buffer<Camera, 1> cameraBuffer(&deviceCameras[d], sycl::range<1>(1));
+      sycl::buffer<CollisionRecord> recordBuffer(deviceRecords[d]);
+      sycl::buffer<int, 1> recordCounter(&deviceRecordCounts[d], sycl::range<1>(1));
+      sycl::buffer<uint64_t, 1> rayBuffer(&deviceRays[d], sycl::range<1>(1));
+      submitChunk(queue, sceneBuffer, cameraBuffer, recordBuffer, recordCounter, rayBuffer, devicePersistentWork[d].get(), chunk).wait_and_throw();
+    }
+
+    std::lock_guard<std::mutex> lock(mergeMutex);
+    sycl::host_accessor records(collision_buf);
+    sycl::host_accessor counter(counter_buf);
+    size_t count = std::min<size_t>(deviceRecordCounts[d], recordSize - counter[0]);
+    std::copy(deviceRecords[d].begin(), deviceRecords[d].begin() + count, &records[counter[0]]);
+    counter[0] += static_cast<int>(count);
+    droppedRecords += deviceRecordCounts[d] - count;
+    deviceRecordCounts[d] = 0;
+  });
+
+  for (size_t d = 0; d < devices.size(); d++)
+  {
+    rayCount += deviceRays[d];
+    std::cout << "[INFO] Device " << d << " rendered " << deviceChunks[d] << " chunks, " << deviceRays[d] << " rays" << std::endl;
+    if (persistent)
+    {
+      reportWorkerBalance("Device " + std::to_string(d) + " persistent workers", devicePersistentWork[d]->workerRays());
+    }
+  }
+  if (droppedRecords > 0)
+  {
+    std::cout << "[INFO] " << droppedRecords << " records did not fit into the record buffer" << std::endl;
+  }
+}
+myQueue.wait_and_throw();
+}
+double engineSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+std::cout << "[INFO] " << (wavefront ? "Wavefront" : persistent ? "Persistent" : "Megakernel") << " throughput: " << rayCount << " rays in " << engineSeconds
+          << " s, " << rayCount / engineSeconds / 1e6 << " Mrays/s" << std::endl;
 myQueue.wait_and_throw();
 myQueue.update_host(counter_buf.get_access());
 myQueue.update_host(collision_buf.get_access());
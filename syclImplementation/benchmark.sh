@@ -0,0 +1,3 @@
+#! /bin/sh
+. /opt/intel/oneapi/setvars.sh --include-intel-llvm > /dev/null;
+cd .. ; ./syclImplementation/build/LiDARBenchmark "$@"
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Geometry.hpp"
+#include <vector>
+
+// Analytic primitives of a scene next to its triangle mesh, with one
+// material index per primitive. ObjectListContent stores them after the
+// mesh, in the order boxes, quads, spheres; materialID() follows that order.
+struct AnalyticGeometry
+{
+    std::vector<Box> _boxes;
+    std::vector<Quad> _quads;
+    std::vector<Sphere> _spheres;
+    std::vector<int> _boxMaterialIDs;
+    std::vector<int> _quadMaterialIDs;
+    std::vector<int> _sphereMaterialIDs;
+
+    size_t size() const
+    {
+        return _boxes.size() + _quads.size() + _spheres.size();
+    }
+
+    int materialID(size_t index) const
+    {
+        if (index < _boxes.size())
+        {
+            return _boxMaterialIDs[index];
+        }
+        index -= _boxes.size();
+        if (index < _quads.size())
+        {
+            return _quadMaterialIDs[index];
+        }
+        return _sphereMaterialIDs[index - _quads.size()];
+    }
+};
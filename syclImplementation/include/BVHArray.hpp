@@ -1,9 +1,90 @@
 #pragma once
 
 #include "Bounds3.hpp"
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 class ObjectList;
+class GeometryList;
 struct Object;
+
+enum class BVHBuildMethod
+{
+    MIDDLE,
+    SAH,
+    SBVH,
+    LBVH
+};
+
+enum class BVHLayout
+{
+    BINARY,
+    WIDE4,
+    WIDE8,
+    COMPACT,
+    QUANTIZED8,
+    QUANTIZED16,
+    BLOCK8,
+    BINARY_UNORDERED    // binary nodes visited in fixed order without t-max pruning, for comparison
+};
+
+// Parameters of the host side BVH builder. The SAH costs are relative to
+// each other: _leafCost per primitive intersection, _traversalCost per node visit.
+struct BVHBuildConfig
+{
+    BVHBuildMethod _method = BVHBuildMethod::SAH;
+    BVHLayout _layout = BVHLayout::BINARY;
+    int _binCount = 16;
+    myComputeType _leafCost = 1.0f;
+    myComputeType _traversalCost = 1.0f;
+    int _maxLeafSize = 4;              // objects per leaf of the compact, quantized and block layouts
+    int _threadCount = 0;              // 0 uses every hardware thread
+    long _parallelThreshold = 4096;    // smaller subtrees are built serially
+    bool _flattenPrimitives = true;    // leaves index a triangle array in BVH order
+    myComputeType _spatialSplitBudget = 0.25f;   // SBVH: extra references allowed, relative to the object count
+    myComputeType _spatialSplitAlpha = 1e-5f;    // SBVH: child overlap, relative to the root area, that enables spatial splits
+    myComputeType _refitRebuildThreshold = 0.3f; // rebuild once a refit raises the SAH cost by this fraction
+};
+
+struct BVHBuildPrimitive
+{
+    Bounds3 _bounds;
+    Vec3 _centroid;
+    long _objectIndex = -1;
+};
+
+// Deepest leaf the builders produce; the traversal stacks are sized from it.
+// Once a subtree could not otherwise stay within it, the builders split at the
+// object median, which adds ceilLog2(count) levels at most.
+constexpr int kMaxBVHDepth = 63;
+
+inline int ceilLog2(long count)
+{
+    int bits = 0;
+    while ((1L << bits) < count)
+    {
+        bits++;
+    }
+    return bits;
+}
+
+inline bool bvhDepthBudgetSpent(int depth, long count)
+{
+    return depth + ceilLog2(count) >= kMaxBVHDepth;
+}
+
+// The traversals only assert that their stacks do not overflow, so every
+// finished tree is checked here instead, in release builds too.
+inline void requireBVHDepth(int depth, const std::string& what)
+{
+    if (depth > kMaxBVHDepth)
+    {
+        throw std::runtime_error(what + " is " + std::to_string(depth) + " levels deep, the traversal stacks are sized for "
+                                 + std::to_string(kMaxBVHDepth));
+    }
+}
+
 struct BVHNode
 {
     long _rightIndex = -1;
@@ -21,6 +102,9 @@ class BVHArray
     
 
     Intersection getIntersection(const long index, const Ray& ray, const ObjectList* objects) const;
+    Intersection getIntersectionUnordered(const long index, const Ray& ray, const ObjectList* objects) const;
+    long buildRecursive(BVHBuildPrimitive* primitives, long nodeIndex, long left, long right, const BVHBuildConfig& config, int threadCount, int depth);
+    void refitNode(long index, const GeometryList& _geometryList, const Object* _objectList);
     
     bool haveNode(const long index) const
     {
@@ -35,6 +119,9 @@ class BVHArray
 
     public:
 
+    // one deferred child per level above the current node, plus its two children
+    static constexpr int kStackSize = kMaxBVHDepth + 1;
+
     BVHArray()
     {
         _arraySize = 0;
@@ -57,6 +144,7 @@ class BVHArray
 
     void setBVHArray(size_t objectSize, BVHNode* array);
     Intersection Intersect(const Ray& ray, const ObjectList* objects) const;
+    Intersection IntersectUnordered(const Ray& ray, const ObjectList* objects) const;
 
     const BVHNode* getNode(long index) const
     {
@@ -74,30 +162,30 @@ class BVHArray
 
     // long buildTree(ObjectList* sceneObject, int left, int right);
 
-    long buildTree(const GeometryList& _geometryList, Object* _objectList, int left, int right);
+    long buildTree(const GeometryList& _geometryList, Object* _objectList, int left, int right, const BVHBuildConfig& config = BVHBuildConfig());
+    long buildTree(std::vector<BVHBuildPrimitive>& primitives, const BVHBuildConfig& config = BVHBuildConfig());
+    myComputeType computeSAHCost(const BVHBuildConfig& config = BVHBuildConfig()) const;
+    int depth() const;
+    void refit(const GeometryList& _geometryList, const Object* _objectList);
     ~BVHArray()
     {
 
     }
 };
 
-size_t caculateArraySize(int numObjects)
+inline size_t caculateArraySize(int numObjects)
 {
     return 2 * numObjects - 1;
 }
 
-bool testIntersection(const BVHNode* node, const Ray& ray)
+// invDir and dirIsNeg are computed once per ray by the caller
+inline bool testIntersection(const BVHNode* node, const Ray& ray, const Vec3& invDir, const std::array<int, 3>& dirIsNeg,
+                             myComputeType tMax, myComputeType& tEnter)
 {
-    Vec3 indiv(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
-    std::array<int, 3> dirIsNeg;
-    dirIsNeg[0] = ray.direction.x >0; 
-    dirIsNeg[1] = ray.direction.y >0; 
-    dirIsNeg[2] = ray.direction.z >0; 
-
-    return node->_bounds.IntersectP(ray, indiv, dirIsNeg);
+    return node->_bounds.IntersectP(ray, invDir, dirIsNeg, tMax, tEnter);
 }
 
-void BVHArray::setBVHArray(size_t arraySize, BVHNode* array)
+inline void BVHArray::setBVHArray(size_t arraySize, BVHNode* array)
 {
 
     _arraySize = arraySize;
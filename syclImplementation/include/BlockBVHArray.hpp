@@ -0,0 +1,216 @@
+#pragma once
+
+#include "CompactBVHArray.hpp"
+#include "PrimitiveList.hpp"
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+// Width triangles with their Moller-Trumbore data stored per lane, so one
+// block is tested with the same instructions for every lane. Unused lanes
+// have a zero normal, which the back-face test always rejects.
+template <int Width>
+struct TriangleBlock
+{
+    myComputeType _v1X[Width], _v1Y[Width], _v1Z[Width];
+    myComputeType _e1X[Width], _e1Y[Width], _e1Z[Width];
+    myComputeType _e2X[Width], _e2Y[Width], _e2Z[Width];
+    myComputeType _nX[Width], _nY[Width], _nZ[Width];
+    int _objectIndex[Width];
+
+    TriangleBlock()
+    {
+        for (int lane = 0; lane < Width; lane++)
+        {
+            setLane(lane, TrianglePrimitive(), -1);
+        }
+    }
+
+    void setLane(int lane, const TrianglePrimitive& tri, int objectIndex)
+    {
+        _v1X[lane] = tri._v1.x; _v1Y[lane] = tri._v1.y; _v1Z[lane] = tri._v1.z;
+        _e1X[lane] = tri._e1.x; _e1Y[lane] = tri._e1.y; _e1Z[lane] = tri._e1.z;
+        _e2X[lane] = tri._e2.x; _e2Y[lane] = tri._e2.y; _e2Z[lane] = tri._e2.z;
+        _nX[lane] = tri._normal.x; _nY[lane] = tri._normal.y; _nZ[lane] = tri._normal.z;
+        _objectIndex[lane] = objectIndex;
+    }
+};
+
+
+// Branch-free version of intersectTriangle over every lane of a block, with
+// the same tolerances. Returns the first lane with the smallest distance
+// below tMax, or -1.
+template <int Width>
+inline int intersectTriangleBlock(const TriangleBlock<Width>& block, const Ray& ray, myComputeType tMax, myComputeType& tHit)
+{
+    const Vec3 o = ray.origin;
+    const Vec3 d = ray.direction;
+    myComputeType laneT[Width];
+    bool laneHit[Width];
+
+#pragma unroll
+    for (int lane = 0; lane < Width; lane++)
+    {
+        myComputeType facing = block._nX[lane] * d.x + block._nY[lane] * d.y + block._nZ[lane] * d.z;
+
+        // pvec = d x e2
+        myComputeType px = d.y * block._e2Z[lane] - d.z * block._e2Y[lane];
+        myComputeType py = d.z * block._e2X[lane] - d.x * block._e2Z[lane];
+        myComputeType pz = d.x * block._e2Y[lane] - d.y * block._e2X[lane];
+        myComputeType det = block._e1X[lane] * px + block._e1Y[lane] * py + block._e1Z[lane] * pz;
+        myComputeType invDet = 1.0f / det;
+
+        myComputeType tx = o.x - block._v1X[lane];
+        myComputeType ty = o.y - block._v1Y[lane];
+        myComputeType tz = o.z - block._v1Z[lane];
+        myComputeType u = (tx * px + ty * py + tz * pz) * invDet;
+
+        // qvec = tvec x e1
+        myComputeType qx = ty * block._e1Z[lane] - tz * block._e1Y[lane];
+        myComputeType qy = tz * block._e1X[lane] - tx * block._e1Z[lane];
+        myComputeType qz = tx * block._e1Y[lane] - ty * block._e1X[lane];
+        myComputeType v = (d.x * qx + d.y * qy + d.z * qz) * invDet;
+        myComputeType t = (block._e2X[lane] * qx + block._e2Y[lane] * qy + block._e2Z[lane] * qz) * invDet;
+
+        laneHit[lane] = (facing <= -MyEPSILON) & (sycl::fabs(det) >= MyEPSILON * 10) &
+                        (u >= -MyEPSILON) & (u <= 1 + MyEPSILON) &
+                        (v >= -MyEPSILON) & (u + v <= 1 + MyEPSILON) &
+                        (t >= -MyEPSILON) & (t < tMax);
+        laneT[lane] = t;
+    }
+
+    int best = -1;
+    for (int lane = 0; lane < Width; lane++)
+    {
+        if (laneHit[lane] && (best < 0 || laneT[lane] < tHit))
+        {
+            best = lane;
+            tHit = laneT[lane];
+        }
+    }
+    return best;
+}
+
+
+// Compact layout whose leaves point at a run of triangle blocks instead of
+// objects: _offset is the first block and _objectCount the number of blocks.
+template <int Width>
+class BlockBVHArray
+{
+    long _arraySize = 0;
+    CompactBVHNode* _array = nullptr;
+    TriangleBlock<Width>* _blocks = nullptr;
+
+    public:
+
+    // one deferred child per level of the compact tree
+    static constexpr int kStackSize = kMaxBVHDepth;
+
+    BlockBVHArray() = default;
+
+    void setBlockBVHArray(size_t arraySize, CompactBVHNode* array, TriangleBlock<Width>* blocks)
+    {
+        _arraySize = arraySize;
+        _array = array;
+        _blocks = blocks;
+    }
+
+    long getArraySize() const
+    {
+        return _arraySize;
+    }
+
+    Intersection Intersect(const Ray& ray) const;
+};
+
+
+// Packs the objects of every compact leaf into ceil(count / Width) blocks.
+// The nodes keep their order, only the leaf offsets and counts change.
+template <int Width>
+void blockBVH(const std::vector<CompactBVHNode>& compact, const std::vector<TrianglePrimitive>& triangles,
+              std::vector<CompactBVHNode>& nodes, std::vector<TriangleBlock<Width>>& blocks)
+{
+    nodes = compact;
+    blocks.clear();
+    for (auto& node : nodes)
+    {
+        if (node._objectCount == 0)
+        {
+            continue;
+        }
+        uint32_t firstObject = node._offset;
+        uint32_t objectCount = node._objectCount;
+        node._offset = static_cast<uint32_t>(blocks.size());
+        node._objectCount = static_cast<uint16_t>((objectCount + Width - 1) / Width);
+        for (uint32_t k = 0; k < objectCount; k++)
+        {
+            if (k % Width == 0)
+            {
+                blocks.emplace_back();
+            }
+            blocks.back().setLane(k % Width, triangles[firstObject + k], static_cast<int>(firstObject + k));
+        }
+    }
+}
+
+
+template <int Width>
+Intersection BlockBVHArray<Width>::Intersect(const Ray& ray) const
+{
+    Intersection inter;
+    inter._hit = false;
+    inter._distance = INFINITY;
+    if (_array == nullptr || _arraySize == 0) return inter;
+
+    Vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+
+    uint32_t stack[kStackSize];
+    int stackCount = 0;
+    uint32_t current = 0;
+    uint32_t hitBlock = 0;
+    int hitLane = -1;
+
+    while (true) {
+        const CompactBVHNode& node = _array[current];
+        myComputeType tEnter;
+        if (node._bounds.IntersectP(ray, invDir, dirIsNeg, inter._distance, tEnter)) {
+            if (node._objectCount > 0) {
+                for (uint32_t k = 0; k < node._objectCount; k++) {
+                    myComputeType tHit = inter._distance;
+                    int lane = intersectTriangleBlock<Width>(_blocks[node._offset + k], ray, inter._distance, tHit);
+                    if (lane >= 0) {
+                        inter._distance = tHit;
+                        hitBlock = node._offset + k;
+                        hitLane = lane;
+                    }
+                }
+            } else {
+                assert(stackCount < kStackSize);
+                // dirIsNeg is set for a positive direction, the left child is then nearer
+                if (dirIsNeg[node._axis]) {
+                    stack[stackCount++] = node._offset;
+                    current = current + 1;
+                } else {
+                    stack[stackCount++] = current + 1;
+                    current = node._offset;
+                }
+                continue;
+            }
+        }
+        if (stackCount == 0) {
+            break;
+        }
+        current = stack[--stackCount];
+    }
+
+    // the hit record is only filled in once, for the closest lane
+    if (hitLane >= 0) {
+        const TriangleBlock<Width>& block = _blocks[hitBlock];
+        inter._hit = true;
+        inter._position = ray.origin + ray.direction * inter._distance;
+        inter._normal = Vec3(block._nX[hitLane], block._nY[hitLane], block._nZ[hitLane]);
+        inter._objectIndex = block._objectIndex[hitLane];
+    }
+    return inter;
+}
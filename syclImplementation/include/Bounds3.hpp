@@ -43,7 +43,7 @@ class Bounds3
             return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
         }
 
-        Vec3 Centroid() {return 0.5 * pMin + 0.5 * pMax;}
+        Vec3 Centroid() const {return 0.5 * pMin + 0.5 * pMax;}
         Bounds3 Intersect(const Bounds3& b)
         {
             return Bounds3(
@@ -77,6 +77,8 @@ class Bounds3
 
 
         inline bool IntersectP(const Ray& ray, const Vec3& invDir, const std::array<int, 3>& dirIsNeg) const;
+        inline bool IntersectP(const Ray& ray, const Vec3& invDir, const std::array<int, 3>& dirIsNeg,
+                               myComputeType tMax, myComputeType& tEnter) const;
 
 
 };
@@ -113,6 +115,39 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vec3& invDir, const std::a
     return tExit >= 0; // Ensure the intersection happens in front of the ray
 }
 
+// Same slab test, but the interval is clipped to tMax (the closest hit so far)
+// and the entry distance is returned so callers can order their visits.
+inline bool Bounds3::IntersectP(const Ray& ray, const Vec3& invDir, const std::array<int, 3>& dirIsNeg,
+                                myComputeType tMax, myComputeType& tEnter) const
+{
+    tEnter = std::numeric_limits<myComputeType>::lowest();
+    myComputeType tExit = tMax;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if (ray.direction[i] == 0)
+        {
+            if (ray.origin[i] < pMin[i] || ray.origin[i] > pMax[i])
+                return false;
+            continue;
+        }
+
+        myComputeType t_min = (pMin[i] - ray.origin[i]) * invDir[i];
+        myComputeType t_max = (pMax[i] - ray.origin[i]) * invDir[i];
+
+        if (dirIsNeg[i] == 0)
+            std::swap(t_min, t_max);
+
+        tEnter = std::max(t_min, tEnter);
+        tExit = std::min(t_max, tExit);
+
+        if (tEnter > tExit)
+            return false;
+    }
+
+    return tExit >= 0;
+}
+
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
 {
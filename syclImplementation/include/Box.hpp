@@ -0,0 +1,106 @@
+#pragma once
+#include "Geometry.hpp"
+#include "common.hpp"
+
+// Axis-aligned box, the analytic form of the 12 triangles a generated box
+// becomes in the OBJ. Like that closed mesh it is one-sided: a ray hits the
+// face it enters through, rays starting inside pass out without a hit.
+class Box : public Geometry
+{
+    public:
+
+        Vec3 _min, _max;
+
+        Box()
+            : Geometry(GeometryType::BOX){}
+        Box(const Vec3& min, const Vec3& max) : Geometry(GeometryType::BOX), _min(min), _max(max) {}
+
+    Intersection getIntersection_virtual(const Ray& ray) const
+    {
+        Intersection intersection;
+        myComputeType tNear = -kInfinity;
+        myComputeType tFar = kInfinity;
+        int nearAxis = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            myComputeType origin = ray.origin[axis];
+            myComputeType direction = ray.direction[axis];
+            if (sycl::fabs(direction) < MyEPSILON)
+            {
+                if (origin < _min[axis] || origin > _max[axis])
+                {
+                    return intersection;
+                }
+                continue;
+            }
+            myComputeType t0 = (_min[axis] - origin) / direction;
+            myComputeType t1 = (_max[axis] - origin) / direction;
+            if (t0 > t1)
+            {
+                std::swap(t0, t1);
+            }
+            if (t0 > tNear)
+            {
+                tNear = t0;
+                nearAxis = axis;
+            }
+            tFar = sycl::fmin(tFar, t1);
+        }
+        if (tNear > tFar || tNear < -MyEPSILON)
+        {
+            return intersection;
+        }
+
+        myComputeType sign = ray.direction[nearAxis] > 0 ? -1.0f : 1.0f;
+        intersection._hit = true;
+        intersection._distance = tNear;
+        intersection._position = ray.origin + ray.direction * tNear;
+        intersection._normal = Vec3(nearAxis == 0 ? sign : 0.0f, nearAxis == 1 ? sign : 0.0f, nearAxis == 2 ? sign : 0.0f);
+        return intersection;
+    }
+
+    myComputeType getArea_virtual() const
+    {
+        Vec3 size = _max - _min;
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
+    // uniform over the surface: a face is picked by its area, then a point on it
+    SamplingRecord Sample_virtual(RNG &rng)
+    {
+        Vec3 size = _max - _min;
+        myComputeType faceArea[3] = {size.y * size.z, size.z * size.x, size.x * size.y};
+        myComputeType pick = get_random_float(rng) * (faceArea[0] + faceArea[1] + faceArea[2]);
+        int axis = pick < faceArea[0] ? 0 : (pick < faceArea[0] + faceArea[1] ? 1 : 2);
+        bool upper = get_random_float(rng) < 0.5f;
+        myComputeType x = get_random_float(rng);
+        myComputeType y = get_random_float(rng);
+
+        SamplingRecord record;
+        record.pdf = 1.0f / getArea_virtual();
+        // the two free coordinates of the face, the third is fixed to one side
+        Vec3 position = _min + size * Vec3(axis == 0 ? 0.0f : x, axis == 1 ? 0.0f : (axis == 0 ? x : y), axis == 2 ? 0.0f : y);
+        myComputeType sign = upper ? 1.0f : -1.0f;
+        switch (axis)
+        {
+        case 0:
+            record.pos._position = Vec3(upper ? _max.x : _min.x, position.y, position.z);
+            record.pos._normal = Vec3(sign, 0, 0);
+            break;
+        case 1:
+            record.pos._position = Vec3(position.x, upper ? _max.y : _min.y, position.z);
+            record.pos._normal = Vec3(0, sign, 0);
+            break;
+        default:
+            record.pos._position = Vec3(position.x, position.y, upper ? _max.z : _min.z);
+            record.pos._normal = Vec3(0, 0, sign);
+            break;
+        }
+        return record;
+    }
+
+    Bounds3 getBounds_virtual() const
+    {
+        return Bounds3(_min, _max);
+    }
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "BVHArray.hpp"
+#include <cstdint>
+#include <vector>
+
+class ObjectList;
+
+// 32 byte node stored depth first: the left child of an inner node is always
+// the next node, so only the right child is kept. Leaves reference a
+// contiguous run of _objectCount objects starting at _offset.
+struct CompactBVHNode
+{
+    Bounds3 _bounds;
+    uint32_t _offset = 0;       // leaf: first object, inner node: right child
+    uint16_t _objectCount = 0;  // 0 marks an inner node
+    uint16_t _axis = 0;         // split axis, the left child lies on its negative side
+};
+
+static_assert(sizeof(myComputeType) != 4 || sizeof(CompactBVHNode) == 32, "CompactBVHNode should be 32 bytes");
+
+
+class CompactBVHArray
+{
+    long _arraySize = 0;
+    CompactBVHNode* _array = nullptr;
+
+    public:
+
+    // one deferred child per level; collapsing never deepens the binary tree
+    static constexpr int kStackSize = kMaxBVHDepth;
+
+    CompactBVHArray() = default;
+
+    void setCompactBVHArray(size_t arraySize, CompactBVHNode* array)
+    {
+        _arraySize = arraySize;
+        _array = array;
+    }
+
+    long getArraySize() const
+    {
+        return _arraySize;
+    }
+
+    const CompactBVHNode* getNode(long index) const
+    {
+        return (index >= 0 && index < _arraySize) ? &_array[index] : nullptr;
+    }
+
+    Intersection Intersect(const Ray& ray, const ObjectList* objects) const;
+};
+
+
+// Per binary node: the object range of its subtree and the SAH cost of the
+// cheaper choice between keeping the subtree and collapsing it into one leaf.
+struct CompactSubtreeInfo
+{
+    long _firstObject = 0;
+    long _objectCount = 0;
+    myComputeType _cost = 0;
+    bool _collapse = false;
+};
+
+// With blockWidth > 1 a leaf is priced per block of blockWidth objects, since
+// a whole block is tested at once.
+inline void evaluateCompactSubtree(const BVHArray& bvh, long index, const BVHBuildConfig& config, int blockWidth,
+                            std::vector<CompactSubtreeInfo>& info)
+{
+    const BVHNode* node = bvh.getNode(index);
+    CompactSubtreeInfo& current = info[index];
+    myComputeType area = node->_bounds.SurfaceArea();
+
+    if (node->_objectIndex >= 0)
+    {
+        current._firstObject = node->_objectIndex;
+        current._objectCount = 1;
+        current._cost = config._leafCost * area;
+        current._collapse = true;
+        return;
+    }
+
+    evaluateCompactSubtree(bvh, node->_leftIndex, config, blockWidth, info);
+    evaluateCompactSubtree(bvh, node->_rightIndex, config, blockWidth, info);
+    const CompactSubtreeInfo& left = info[node->_leftIndex];
+    const CompactSubtreeInfo& right = info[node->_rightIndex];
+
+    current._firstObject = std::min(left._firstObject, right._firstObject);
+    current._objectCount = left._objectCount + right._objectCount;
+
+    myComputeType splitCost = config._traversalCost * area + left._cost + right._cost;
+    myComputeType leafCost = config._leafCost * ((current._objectCount + blockWidth - 1) / blockWidth) * area;
+    current._collapse = current._objectCount <= config._maxLeafSize && leafCost <= splitCost;
+    current._cost = current._collapse ? leafCost : splitCost;
+}
+
+inline uint32_t emitCompactNode(const BVHArray& bvh, long index, const std::vector<CompactSubtreeInfo>& info,
+                         std::vector<CompactBVHNode>& nodes)
+{
+    uint32_t compactIndex = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+
+    const BVHNode* node = bvh.getNode(index);
+    const CompactSubtreeInfo& current = info[index];
+    nodes[compactIndex]._bounds = node->_bounds;
+
+    if (current._collapse)
+    {
+        nodes[compactIndex]._offset = static_cast<uint32_t>(current._firstObject);
+        nodes[compactIndex]._objectCount = static_cast<uint16_t>(current._objectCount);
+        return compactIndex;
+    }
+
+    // order the children along the axis that separates their centres the most
+    long first = node->_leftIndex;
+    long second = node->_rightIndex;
+    Vec3 delta = bvh.getNode(second)->_bounds.Centroid() - bvh.getNode(first)->_bounds.Centroid();
+    int axis = Bounds3(Vec3(0, 0, 0), Vec3(std::fabs(delta.x), std::fabs(delta.y), std::fabs(delta.z))).maxExtent();
+    if (delta[axis] < 0)
+    {
+        std::swap(first, second);
+    }
+
+    nodes[compactIndex]._axis = static_cast<uint16_t>(axis);
+    emitCompactNode(bvh, first, info, nodes);
+    nodes[compactIndex]._offset = emitCompactNode(bvh, second, info, nodes);
+    return compactIndex;
+}
+
+// Re-encodes a finished binary BVH; subtrees with at most _maxLeafSize objects
+// become a single leaf whenever that lowers their SAH cost.
+inline std::vector<CompactBVHNode> compactBVH(const BVHArray& bvh, const BVHBuildConfig& config, int blockWidth = 1)
+{
+    std::vector<CompactBVHNode> nodes;
+    if (bvh.getNode(0) == nullptr)
+    {
+        return nodes;
+    }
+
+    std::vector<CompactSubtreeInfo> info(bvh.getArraySize());
+    evaluateCompactSubtree(bvh, 0, config, blockWidth, info);
+    nodes.reserve(bvh.getArraySize());
+    emitCompactNode(bvh, 0, info, nodes);
+    return nodes;
+}
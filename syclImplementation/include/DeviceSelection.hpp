@@ -0,0 +1,111 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+#include "syclScene.hpp"
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Picks the devices a run uses from --device: gpu, cpu, all or any part of a
+// device name (case-insensitive). A gpu request falls back to the default
+// device on machines without one. With splitNuma every device that can be
+// partitioned by NUMA domain, such as a multi-socket CPU, is replaced by its
+// sub-devices so that each socket works on its own scene copy.
+
+inline std::string lowerCase(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return text;
+}
+
+inline std::vector<sycl::device> selectDevices(const std::string& selection, bool splitNuma)
+{
+    std::string wanted = lowerCase(selection);
+    std::vector<sycl::device> devices;
+    for (const sycl::device& device : sycl::device::get_devices())
+    {
+        std::string name = device.get_info<sycl::info::device::name>();
+        bool match = (wanted == "gpu" && device.is_gpu()) || (wanted == "cpu" && device.is_cpu())
+                  || (wanted == "all" && (device.is_gpu() || device.is_cpu()))
+                  || (wanted != "gpu" && wanted != "cpu" && wanted != "all" && lowerCase(name).find(wanted) != std::string::npos);
+        // the same device is often exposed by more than one backend
+        bool duplicate = std::any_of(devices.begin(), devices.end(), [&](const sycl::device& other) {
+            return other.get_info<sycl::info::device::name>() == name && other.get_platform() != device.get_platform();
+        });
+        if (match && !duplicate)
+        {
+            devices.push_back(device);
+        }
+    }
+    if (devices.empty() && wanted == "gpu")
+    {
+        std::cout << "[INFO] No GPU found, using the default device" << std::endl;
+        devices.push_back(sycl::device(sycl::default_selector_v));
+    }
+    if (devices.empty())
+    {
+        throw std::runtime_error("No SYCL device matches --device " + selection);
+    }
+
+    if (splitNuma)
+    {
+        std::vector<sycl::device> split;
+        for (const sycl::device& device : devices)
+        {
+            try
+            {
+                auto subDevices = device.create_sub_devices<sycl::info::partition_property::partition_by_affinity_domain>(
+                    sycl::info::partition_affinity_domain::numa);
+                split.insert(split.end(), subDevices.begin(), subDevices.end());
+            }
+            catch (const sycl::exception&)
+            {
+                split.push_back(device);
+            }
+        }
+        devices = split;
+    }
+
+    for (size_t k = 0; k < devices.size(); k++)
+    {
+        std::cout << "[INFO] Device " << k << ": " << devices[k].get_info<sycl::info::device::name>() << std::endl;
+    }
+    return devices;
+}
+
+
+// A device's own queue and copy of the scene. The members are declared in
+// construction order: the content refers to the queue, the scene to the
+// content's arrays.
+struct DeviceScene
+{
+    sycl::queue _queue;
+    ObjectListContent _content;
+    ObjectList _objects;
+    std::unique_ptr<syclScene> _scene;
+    std::unique_ptr<sycl::buffer<syclScene, 1>> _sceneBuffer;
+
+    DeviceScene(const sycl::device& device) : _queue(device), _content(_queue)
+    {
+    }
+
+    DeviceScene(const DeviceScene&) = delete;
+    DeviceScene& operator=(const DeviceScene&) = delete;
+
+    // copies source into this device's memory and wraps it for the kernels
+    void load(const ObjectListContent& source, ScenePlacement placement)
+    {
+        source.copyTo(_content);
+        if (placement == ScenePlacement::DEVICE)
+        {
+            _content.toDevice();
+        }
+        _objects.setObjects(_content);
+        _scene = std::make_unique<syclScene>(_objects);
+        _sceneBuffer = std::make_unique<sycl::buffer<syclScene, 1>>(_scene.get(), sycl::range<1>(1));
+    }
+};
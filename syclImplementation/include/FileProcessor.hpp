@@ -29,7 +29,7 @@
 
 
 
-std::unordered_map<std::string, std::vector<std::string>> parseFlags(int argc, char* argv[]) {
+inline std::unordered_map<std::string, std::vector<std::string>> parseFlags(int argc, char* argv[]) {
     std::unordered_map<std::string, std::vector<std::string>> args;
     std::string current_key;
 
@@ -59,7 +59,7 @@ struct CollisionRecord {
 };
 
 
-void host_exclusive_scan(const std::vector<int>& in, std::vector<int>& out) {
+inline void host_exclusive_scan(const std::vector<int>& in, std::vector<int>& out) {
     std::exclusive_scan(in.begin(), in.end(), out.begin(), 0);
 }
 
@@ -94,14 +94,14 @@ private:
 };
 
 // Constructor
-HDF5Writer::HDF5Writer(const std::string& outputFilename, float fov = 50, int height = 500, int width = 500)
+inline HDF5Writer::HDF5Writer(const std::string& outputFilename, float fov = 50, int height = 500, int width = 500)
     : filename(outputFilename), current_index(0),
       file(H5::H5File(outputFilename, H5F_ACC_TRUNC)) {
     initializeFile(fov, height, width);
 }
 
 
-void HDF5Writer::initializeFile(float fov = 50, int image_height = 500, int image_width = 500) {
+inline void HDF5Writer::initializeFile(float fov = 50, int image_height = 500, int image_width = 500) {
 
     hsize_t init_size[1] = {0};  // Start with 0 records
     hsize_t max_size[1] = {H5S_UNLIMITED};  // Allow unlimited records
@@ -143,7 +143,7 @@ void HDF5Writer::initializeFile(float fov = 50, int image_height = 500, int imag
 
 
 
-void HDF5Writer::writeRecord(int collisionCount, float distance, Vec3 collisionLocation, Vec3 collisionDirection, int camera_x, int camera_y, float emission_delay) {
+inline void HDF5Writer::writeRecord(int collisionCount, float distance, Vec3 collisionLocation, Vec3 collisionDirection, int camera_x, int camera_y, float emission_delay) {
 
     CollisionRecord record;
     record.collisionCount = collisionCount;
@@ -179,7 +179,7 @@ void HDF5Writer::writeRecord(int collisionCount, float distance, Vec3 collisionL
 }
 
 
-void HDF5Writer::writeBatch(const std::vector<CollisionRecord>& records) {
+inline void HDF5Writer::writeBatch(const std::vector<CollisionRecord>& records) {
     if (records.empty()) return;
 
     hsize_t new_size[1] = { current_index + records.size() };
@@ -197,13 +197,13 @@ void HDF5Writer::writeBatch(const std::vector<CollisionRecord>& records) {
 }
 
 
-void HDF5Writer::finalizeFile() {
+inline void HDF5Writer::finalizeFile() {
     file.close();
 }
 
 
 
-std::vector<CollisionRecord> filterCollisionRecordsSYCL(
+inline std::vector<CollisionRecord> filterCollisionRecordsSYCL(
     const std::vector<CollisionRecord>& inputRecords,
     sycl::queue& myQueue
 )
@@ -9,7 +9,11 @@
 
 enum class GeometryType
 {
-    TRIANGLE 
+    TRIANGLE,
+    INDEXED_TRIANGLE,
+    BOX,
+    QUAD,
+    SPHERE
 };
 
 struct SamplingRecord
@@ -33,6 +37,10 @@ public:
 };
 
 #include "Triangle.hpp"
+#include "IndexedTriangle.hpp"
+#include "Box.hpp"
+#include "Quad.hpp"
+#include "Sphere.hpp"
 
 // write the destructor for objector 
 // Geometry::~Geometry()
@@ -48,46 +56,78 @@ public:
 // }
 
 
-Intersection Geometry::getIntersection(const Ray& ray)
+inline Intersection Geometry::getIntersection(const Ray& ray)
 {
     switch (_type)
     {
     case GeometryType::TRIANGLE:
         return static_cast<Triangle*>(this)->getIntersection_virtual(ray);
+    case GeometryType::INDEXED_TRIANGLE:
+        return static_cast<IndexedTriangle*>(this)->getIntersection_virtual(ray);
+    case GeometryType::BOX:
+        return static_cast<Box*>(this)->getIntersection_virtual(ray);
+    case GeometryType::QUAD:
+        return static_cast<Quad*>(this)->getIntersection_virtual(ray);
+    case GeometryType::SPHERE:
+        return static_cast<Sphere*>(this)->getIntersection_virtual(ray);
     default:
         return Intersection();
     }
 }
 
-SamplingRecord Geometry::Sample(RNG &rng)
+inline SamplingRecord Geometry::Sample(RNG &rng)
 {
 
     switch (_type)
     {
     case GeometryType::TRIANGLE:
         return static_cast<Triangle*>(this)->Sample_virtual(rng);
+    case GeometryType::INDEXED_TRIANGLE:
+        return static_cast<IndexedTriangle*>(this)->Sample_virtual(rng);
+    case GeometryType::BOX:
+        return static_cast<Box*>(this)->Sample_virtual(rng);
+    case GeometryType::QUAD:
+        return static_cast<Quad*>(this)->Sample_virtual(rng);
+    case GeometryType::SPHERE:
+        return static_cast<Sphere*>(this)->Sample_virtual(rng);
     default:
         return SamplingRecord();
     }
 }
 
-myComputeType Geometry::getArea()
+inline myComputeType Geometry::getArea()
 {
     switch (_type)
     {
     case GeometryType::TRIANGLE:
         return static_cast<Triangle*>(this)->getArea_virtual();
+    case GeometryType::INDEXED_TRIANGLE:
+        return static_cast<IndexedTriangle*>(this)->getArea_virtual();
+    case GeometryType::BOX:
+        return static_cast<Box*>(this)->getArea_virtual();
+    case GeometryType::QUAD:
+        return static_cast<Quad*>(this)->getArea_virtual();
+    case GeometryType::SPHERE:
+        return static_cast<Sphere*>(this)->getArea_virtual();
     default:
         return 0;
     }
 }
 
-Bounds3 Geometry::getBounds() 
+inline Bounds3 Geometry::getBounds() 
 {
     switch (_type)
     {
     case GeometryType::TRIANGLE:
         return static_cast<Triangle*>(this)->getBounds_virtual();
+    case GeometryType::INDEXED_TRIANGLE:
+        return static_cast<IndexedTriangle*>(this)->getBounds_virtual();
+    case GeometryType::BOX:
+        return static_cast<Box*>(this)->getBounds_virtual();
+    case GeometryType::QUAD:
+        return static_cast<Quad*>(this)->getBounds_virtual();
+    case GeometryType::SPHERE:
+        return static_cast<Sphere*>(this)->getBounds_virtual();
     default:
         return Bounds3();
     }
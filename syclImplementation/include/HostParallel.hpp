@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+
+inline int hostThreadCount(int requested = 0)
+{
+    if (requested > 0)
+    {
+        return requested;
+    }
+    unsigned int hardwareThreads = std::thread::hardware_concurrency();
+    return hardwareThreads == 0 ? 1 : static_cast<int>(hardwareThreads);
+}
+
+inline int hostChunkCount(long count, int threadCount)
+{
+    return static_cast<int>(std::max(1L, std::min<long>(threadCount, count)));
+}
+
+// Runs func(chunk, chunkBegin, chunkEnd) on chunkCount contiguous slices of
+// [begin, end), the calling thread works on chunk 0 itself.
+template <typename Func>
+void parallelChunks(long begin, long end, int chunkCount, Func func)
+{
+    long count = end - begin;
+    if (chunkCount <= 1)
+    {
+        func(0, begin, end);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(chunkCount - 1);
+    for (int chunk = 1; chunk < chunkCount; chunk++)
+    {
+        long chunkBegin = begin + count * chunk / chunkCount;
+        long chunkEnd = begin + count * (chunk + 1) / chunkCount;
+        workers.emplace_back(func, chunk, chunkBegin, chunkEnd);
+    }
+    func(0, begin, begin + count / chunkCount);
+
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "Geometry.hpp"
+#include "common.hpp"
+#include <cstdint>
+
+// Triangle of an indexed mesh: three 32-bit indices into a vertex buffer
+// shared by the whole mesh. Edges, normal and area are derived when needed
+// instead of being stored, which takes a triangle from 80 to 24 bytes.
+class IndexedTriangle : public Geometry
+{
+    public:
+
+        uint32_t _indices[3] = {0, 0, 0};
+        const Vec3* _vertices = nullptr;    // set by ObjectListContent::linkPointerTables
+
+        IndexedTriangle()
+            : Geometry(GeometryType::INDEXED_TRIANGLE){}
+        IndexedTriangle(uint32_t i1, uint32_t i2, uint32_t i3) : Geometry(GeometryType::INDEXED_TRIANGLE)
+        {
+            _indices[0] = i1;
+            _indices[1] = i2;
+            _indices[2] = i3;
+        }
+
+    inline const Vec3& getVertex(int corner) const
+    {
+        return _vertices[_indices[corner]];
+    }
+
+    Intersection getIntersection_virtual(const Ray& ray) const
+    {
+        const Vec3& v1 = getVertex(0);
+        Vec3 e1 = getVertex(1) - v1;
+        Vec3 e2 = getVertex(2) - v1;
+        return intersectTriangle(v1, e1, e2, crossProduct(e1, e2).normalized(), ray);
+    }
+
+    myComputeType getArea_virtual() const
+    {
+        const Vec3& v1 = getVertex(0);
+        return crossProduct(getVertex(1) - v1, getVertex(2) - v1).length() * 0.5f;
+    }
+
+    // same point distribution as Triangle::Sample_virtual
+    SamplingRecord Sample_virtual(RNG &rng)
+    {
+        const Vec3& v1 = getVertex(0);
+        const Vec3& v2 = getVertex(1);
+        const Vec3& v3 = getVertex(2);
+        Vec3 normal = crossProduct(v2 - v1, v3 - v1);
+        SamplingRecord record;
+        record.pdf = 1.0f / (normal.length() * 0.5f);
+        myComputeType x = get_random_float(rng);
+        myComputeType y = get_random_float(rng);
+        record.pos._position = v1 * (1.0f - x) + v2 * (x * (1.0f - y)) + v3 * (x * y);
+        record.pos._normal = normal.normalized();
+        return record;
+    }
+
+    Bounds3 getBounds_virtual() const
+    {
+        return Union(Bounds3(getVertex(0), getVertex(1)), getVertex(2));
+    }
+};
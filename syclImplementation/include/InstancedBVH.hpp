@@ -0,0 +1,493 @@
+#pragma once
+
+#include "BVHArray.hpp"
+#include "PrimitiveList.hpp"
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <vector>
+
+// Two-level scene: a top-level BVH over instances, each of which places a
+// shared mesh with its own bottom-level BVH. Rays are moved into the mesh's
+// object space instead of transforming the triangles, so memory scales with
+// the unique meshes and moving an instance only rebuilds the top level.
+
+
+// 3x4 affine matrix, the rows of the linear part plus the translation.
+struct AffineTransform
+{
+    Vec3 _row0 = Vec3(1, 0, 0);
+    Vec3 _row1 = Vec3(0, 1, 0);
+    Vec3 _row2 = Vec3(0, 0, 1);
+    Vec3 _translation = Vec3(0, 0, 0);
+
+    static AffineTransform translate(const Vec3& offset)
+    {
+        AffineTransform transform;
+        transform._translation = offset;
+        return transform;
+    }
+
+    inline Vec3 applyVector(const Vec3& v) const
+    {
+        return Vec3(dotProduct(_row0, v), dotProduct(_row1, v), dotProduct(_row2, v));
+    }
+
+    inline Vec3 applyPoint(const Vec3& p) const
+    {
+        return applyVector(p) + _translation;
+    }
+
+    myComputeType determinant() const
+    {
+        return dotProduct(_row0, crossProduct(_row1, _row2));
+    }
+
+    // the columns of the inverse linear part are the cross products of the rows
+    AffineTransform inverse() const
+    {
+        myComputeType invDet = 1.0f / determinant();
+        Vec3 c0 = crossProduct(_row1, _row2) * invDet;
+        Vec3 c1 = crossProduct(_row2, _row0) * invDet;
+        Vec3 c2 = crossProduct(_row0, _row1) * invDet;
+        AffineTransform result;
+        result._row0 = Vec3(c0.x, c1.x, c2.x);
+        result._row1 = Vec3(c0.y, c1.y, c2.y);
+        result._row2 = Vec3(c0.z, c1.z, c2.z);
+        result._translation = -result.applyVector(_translation);
+        return result;
+    }
+
+    Bounds3 applyBounds(const Bounds3& bounds) const
+    {
+        Bounds3 result;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            Vec3 p(bounds[corner & 1].x, bounds[(corner >> 1) & 1].y, bounds[(corner >> 2) & 1].z);
+            result = Union(result, applyPoint(p));
+        }
+        return result;
+    }
+};
+
+
+// Bottom level: _nodeOffset is the mesh's root in the shared node array, the
+// node indices inside a mesh are local, and a leaf's _objectIndex counts from
+// _triangleOffset.
+struct MeshBVH
+{
+    long _nodeOffset = 0;
+    long _nodeCount = 0;
+    long _triangleOffset = 0;
+    long _triangleCount = 0;
+    Bounds3 _bounds;
+};
+
+struct Instance
+{
+    long _mesh = -1;
+    AffineTransform _toWorld;
+    AffineTransform _toObject;
+    myComputeType _normalSign = 1;  // -1 for mirroring transforms, which flip the winding
+    int _materialOverride = -1;     // -1 keeps the mesh's own materials
+    long _objectOffset = 0;         // first scene object index of this instance
+    Bounds3 _bounds;                // world space
+};
+
+// Host side description of a scene, see ObjectListContent::addInstancedObject.
+struct MeshInfo
+{
+    std::vector<Triangle> _triangles;
+    std::vector<int> _materialIDs;
+};
+
+struct InstanceInfo
+{
+    long _mesh = -1;
+    AffineTransform _transform;
+    int _materialOverride = -1;
+};
+
+
+// Scene object i is triangle (i - _objectOffset) of the instance that owns i,
+// in the mesh's BVH order.
+class InstanceBVH
+{
+    long _topSize = 0;
+    BVHNode* _topNodes = nullptr;
+    Instance* _instances = nullptr;
+    long _instanceCount = 0;
+    MeshBVH* _meshes = nullptr;
+    BVHNode* _meshNodes = nullptr;
+    TrianglePrimitive* _meshTriangles = nullptr;
+    int* _meshMaterialIndices = nullptr;
+
+    myComputeType intersectMesh(const MeshBVH& mesh, const Ray& ray, myComputeType normalSign,
+                                myComputeType tMax, long& hitTriangle) const;
+
+    public:
+
+    // both levels are binary trees built within kMaxBVHDepth
+    static constexpr int kStackSize = kMaxBVHDepth + 1;
+
+    InstanceBVH() = default;
+
+    void setInstanceBVH(long topSize, BVHNode* topNodes, long instanceCount, Instance* instances, MeshBVH* meshes,
+                        BVHNode* meshNodes, TrianglePrimitive* meshTriangles, int* meshMaterialIndices)
+    {
+        _topSize = topSize;
+        _topNodes = topNodes;
+        _instanceCount = instanceCount;
+        _instances = instances;
+        _meshes = meshes;
+        _meshNodes = meshNodes;
+        _meshTriangles = meshTriangles;
+        _meshMaterialIndices = meshMaterialIndices;
+    }
+
+    inline bool isActive() const
+    {
+        return _instances != nullptr;
+    }
+
+    // instances are stored by increasing _objectOffset
+    inline long findInstance(long objectIndex) const
+    {
+        long low = 0;
+        long high = _instanceCount - 1;
+        while (low < high)
+        {
+            long mid = (low + high + 1) / 2;
+            if (_instances[mid]._objectOffset <= objectIndex)
+            {
+                low = mid;
+            }
+            else
+            {
+                high = mid - 1;
+            }
+        }
+        return low;
+    }
+
+    inline int getMaterialIndex(long objectIndex) const
+    {
+        const Instance& instance = _instances[findInstance(objectIndex)];
+        if (instance._materialOverride >= 0)
+        {
+            return instance._materialOverride;
+        }
+        return _meshMaterialIndices[_meshes[instance._mesh]._triangleOffset + objectIndex - instance._objectOffset];
+    }
+
+    // world space vertex and edges of a scene object
+    inline void getTriangle(long objectIndex, Vec3& v1, Vec3& e1, Vec3& e2) const
+    {
+        const Instance& instance = _instances[findInstance(objectIndex)];
+        const TrianglePrimitive& tri = _meshTriangles[_meshes[instance._mesh]._triangleOffset + objectIndex - instance._objectOffset];
+        v1 = instance._toWorld.applyPoint(tri._v1);
+        e1 = instance._toWorld.applyVector(tri._e1);
+        e2 = instance._toWorld.applyVector(tri._e2);
+    }
+
+    myComputeType getArea(long objectIndex) const
+    {
+        Vec3 v1, e1, e2;
+        getTriangle(objectIndex, v1, e1, e2);
+        return crossProduct(e1, e2).length() * 0.5f;
+    }
+
+    SamplingRecord Sample(RNG& rng, long objectIndex) const
+    {
+        Vec3 v1, e1, e2;
+        getTriangle(objectIndex, v1, e1, e2);
+        Vec3 n = crossProduct(e1, e2);
+        SamplingRecord record;
+        record.pdf = 1.0f / (n.length() * 0.5f);
+        myComputeType x = get_random_float(rng);
+        myComputeType y = get_random_float(rng);
+        record.pos._position = v1 + e1 * (x * (1.0f - y)) + e2 * (x * y);
+        record.pos._normal = n.normalized();
+        record.pos._objectIndex = objectIndex;
+        return record;
+    }
+
+    Intersection Intersect(const Ray& ray) const;
+};
+
+
+// Closest-hit traversal of one mesh with a ray already in its object space.
+// Returns the hit distance, or tMax when nothing closer was found.
+inline myComputeType InstanceBVH::intersectMesh(const MeshBVH& mesh, const Ray& ray, myComputeType normalSign,
+                                                myComputeType tMax, long& hitTriangle) const
+{
+    if (mesh._nodeCount == 0) {
+        return tMax;
+    }
+    const BVHNode* nodes = _meshNodes + mesh._nodeOffset;
+    Vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+
+    myComputeType rootEnter;
+    if (!testIntersection(&nodes[0], ray, invDir, dirIsNeg, tMax, rootEnter)) {
+        return tMax;
+    }
+
+    long stack[kStackSize] = {0};
+    myComputeType stackEnter[kStackSize] = {rootEnter};
+    int stackCount = 1;
+
+    while (stackCount != 0) {
+        stackCount--;
+        if (stackEnter[stackCount] > tMax) {
+            continue;
+        }
+        const BVHNode* node = &nodes[stack[stackCount]];
+
+        if (node->_objectIndex >= 0) {
+            const TrianglePrimitive& tri = _meshTriangles[mesh._triangleOffset + node->_objectIndex];
+            Intersection tmp = intersectTriangle(tri._v1, tri._e1, tri._e2, tri._normal * normalSign, ray);
+            if (tmp._hit && tmp._distance < tMax) {
+                tMax = tmp._distance;
+                hitTriangle = node->_objectIndex;
+            }
+            continue;
+        }
+
+        myComputeType leftEnter, rightEnter;
+        bool hitLeft = testIntersection(&nodes[node->_leftIndex], ray, invDir, dirIsNeg, tMax, leftEnter);
+        bool hitRight = testIntersection(&nodes[node->_rightIndex], ray, invDir, dirIsNeg, tMax, rightEnter);
+        assert(stackCount + 2 <= kStackSize);
+        if (hitLeft && hitRight) {
+            bool leftIsNear = leftEnter <= rightEnter;
+            stack[stackCount] = leftIsNear ? node->_rightIndex : node->_leftIndex;
+            stackEnter[stackCount] = leftIsNear ? rightEnter : leftEnter;
+            stack[stackCount + 1] = leftIsNear ? node->_leftIndex : node->_rightIndex;
+            stackEnter[stackCount + 1] = leftIsNear ? leftEnter : rightEnter;
+            stackCount += 2;
+        } else if (hitLeft || hitRight) {
+            stack[stackCount] = hitLeft ? node->_leftIndex : node->_rightIndex;
+            stackEnter[stackCount] = hitLeft ? leftEnter : rightEnter;
+            stackCount++;
+        }
+    }
+    return tMax;
+}
+
+
+// Top-level traversal in world space. At an instance leaf the ray is moved
+// into object space without normalising the direction, so distances along it
+// stay comparable with the world space ones.
+inline Intersection InstanceBVH::Intersect(const Ray& ray) const
+{
+    Intersection inter;
+    inter._hit = false;
+    inter._distance = INFINITY;
+    if (_topNodes == nullptr || _topSize == 0) return inter;
+
+    Vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+
+    myComputeType rootEnter;
+    if (!testIntersection(&_topNodes[0], ray, invDir, dirIsNeg, inter._distance, rootEnter)) {
+        return inter;
+    }
+
+    long stack[kStackSize] = {0};
+    myComputeType stackEnter[kStackSize] = {rootEnter};
+    int stackCount = 1;
+    long hitInstance = -1;
+    long hitTriangle = -1;
+
+    while (stackCount != 0) {
+        stackCount--;
+        if (stackEnter[stackCount] > inter._distance) {
+            continue;
+        }
+        const BVHNode* node = &_topNodes[stack[stackCount]];
+
+        if (node->_objectIndex >= 0) {
+            const Instance& instance = _instances[node->_objectIndex];
+            Ray objectRay = ray;
+            objectRay.origin = instance._toObject.applyPoint(ray.origin);
+            objectRay.direction = instance._toObject.applyVector(ray.direction);
+            long triangle = -1;
+            myComputeType t = intersectMesh(_meshes[instance._mesh], objectRay, instance._normalSign, inter._distance, triangle);
+            if (triangle >= 0) {
+                inter._distance = t;
+                hitInstance = node->_objectIndex;
+                hitTriangle = triangle;
+            }
+            continue;
+        }
+
+        myComputeType leftEnter, rightEnter;
+        bool hitLeft = testIntersection(&_topNodes[node->_leftIndex], ray, invDir, dirIsNeg, inter._distance, leftEnter);
+        bool hitRight = testIntersection(&_topNodes[node->_rightIndex], ray, invDir, dirIsNeg, inter._distance, rightEnter);
+        assert(stackCount + 2 <= kStackSize);
+        if (hitLeft && hitRight) {
+            bool leftIsNear = leftEnter <= rightEnter;
+            stack[stackCount] = leftIsNear ? node->_rightIndex : node->_leftIndex;
+            stackEnter[stackCount] = leftIsNear ? rightEnter : leftEnter;
+            stack[stackCount + 1] = leftIsNear ? node->_leftIndex : node->_rightIndex;
+            stackEnter[stackCount + 1] = leftIsNear ? leftEnter : rightEnter;
+            stackCount += 2;
+        } else if (hitLeft || hitRight) {
+            stack[stackCount] = hitLeft ? node->_leftIndex : node->_rightIndex;
+            stackEnter[stackCount] = hitLeft ? leftEnter : rightEnter;
+            stackCount++;
+        }
+    }
+
+    // the hit record is filled in world space once, for the closest triangle
+    if (hitInstance >= 0) {
+        const Instance& instance = _instances[hitInstance];
+        const TrianglePrimitive& tri = _meshTriangles[_meshes[instance._mesh]._triangleOffset + hitTriangle];
+        inter._hit = true;
+        inter._position = ray.origin + ray.direction * inter._distance;
+        inter._normal = crossProduct(instance._toWorld.applyVector(tri._e1), instance._toWorld.applyVector(tri._e2)).normalized();
+        inter._objectIndex = instance._objectOffset + hitTriangle;
+    }
+    return inter;
+}
+
+
+// Bottom-level BVH of one mesh, appended to nodes. The mesh's triangles and
+// materials are appended in leaf order.
+inline void buildMeshBVH(const MeshInfo& mesh, const BVHBuildConfig& config, MeshBVH& meshBVH, std::vector<BVHNode>& nodes,
+                  std::vector<TrianglePrimitive>& triangles, std::vector<int>& materialIndices)
+{
+    long count = static_cast<long>(mesh._triangles.size());
+    std::vector<BVHBuildPrimitive> primitives(count);
+    for (long i = 0; i < count; i++)
+    {
+        primitives[i]._bounds = mesh._triangles[i].getBounds_virtual();
+        primitives[i]._centroid = primitives[i]._bounds.Centroid();
+        primitives[i]._objectIndex = i;
+    }
+
+    meshBVH._nodeOffset = static_cast<long>(nodes.size());
+    meshBVH._triangleOffset = static_cast<long>(triangles.size());
+    meshBVH._triangleCount = count;
+    if (count == 0)
+    {
+        return;
+    }
+
+    std::vector<BVHNode> meshNodes(caculateArraySize(count));
+    BVHArray bvh;
+    bvh.setBVHArray(meshNodes.size(), meshNodes.data());
+    bvh.buildTree(primitives, config);
+    requireBVHDepth(bvh.depth(), "Mesh BVH");
+
+    meshBVH._nodeCount = static_cast<long>(meshNodes.size());
+    meshBVH._bounds = meshNodes[0]._bounds;
+    nodes.insert(nodes.end(), meshNodes.begin(), meshNodes.end());
+
+    for (long i = 0; i < count; i++)
+    {
+        const Triangle& tri = mesh._triangles[primitives[i]._objectIndex];
+        TrianglePrimitive primitive;
+        primitive._v1 = tri._v1;
+        primitive._e1 = tri.getEdge1();
+        primitive._e2 = tri.getEdge2();
+        primitive._normal = tri.getNormal();
+        triangles.push_back(primitive);
+        materialIndices.push_back(mesh._materialIDs[primitives[i]._objectIndex]);
+    }
+}
+
+
+// Top-level BVH over the world bounds of the instances. The instances keep
+// their order, the leaves refer to them by index.
+inline void buildInstanceBVH(const Instance* instances, long instanceCount, const BVHBuildConfig& config, std::vector<BVHNode>& nodes)
+{
+    nodes.clear();
+    if (instanceCount == 0)
+    {
+        return;
+    }
+    std::vector<BVHBuildPrimitive> primitives(instanceCount);
+    for (long i = 0; i < instanceCount; i++)
+    {
+        primitives[i]._bounds = instances[i]._bounds;
+        primitives[i]._centroid = instances[i]._bounds.Centroid();
+        primitives[i]._objectIndex = i;
+    }
+
+    nodes.assign(caculateArraySize(instanceCount), BVHNode());
+    BVHArray bvh;
+    bvh.setBVHArray(nodes.size(), nodes.data());
+    bvh.buildTree(primitives, config);
+    requireBVHDepth(bvh.depth(), "Top-level BVH");
+    for (auto& node : nodes)
+    {
+        if (node._objectIndex >= 0)
+        {
+            node._objectIndex = primitives[node._objectIndex]._objectIndex;
+        }
+    }
+}
+
+
+// Splits a loaded triangle soup into meshes and instances: shapes with the
+// same materials whose vertices match up to a translation share one mesh.
+// shapeOffsets holds the first triangle of every shape.
+inline void findTranslatedInstances(const std::vector<Triangle>& tris, const std::vector<int>& materialIDs,
+                             const std::vector<size_t>& shapeOffsets, std::vector<MeshInfo>& meshes,
+                             std::vector<InstanceInfo>& instances)
+{
+    // candidates are grouped by triangle count and first material
+    std::map<std::pair<size_t, int>, std::vector<long>> candidates;
+    for (size_t shape = 0; shape < shapeOffsets.size(); shape++)
+    {
+        size_t begin = shapeOffsets[shape];
+        size_t end = shape + 1 < shapeOffsets.size() ? shapeOffsets[shape + 1] : tris.size();
+        if (begin >= end)
+        {
+            continue;
+        }
+        size_t count = end - begin;
+        Bounds3 bounds;
+        for (size_t i = begin; i < end; i++)
+        {
+            bounds = Union(bounds, tris[i].getBounds_virtual());
+        }
+        myComputeType tolerance = 1e-4f * std::max(bounds.Diagonal().length(), (myComputeType)1e-3f);
+
+        InstanceInfo instance;
+        std::vector<long>& sameShape = candidates[std::make_pair(count, materialIDs[begin])];
+        for (long meshIndex : sameShape)
+        {
+            const MeshInfo& mesh = meshes[meshIndex];
+            Vec3 offset = tris[begin]._v1 - mesh._triangles[0]._v1;
+            bool match = true;
+            for (size_t k = 0; k < count && match; k++)
+            {
+                const Triangle& a = tris[begin + k];
+                const Triangle& b = mesh._triangles[k];
+                match = materialIDs[begin + k] == mesh._materialIDs[k]
+                     && (a._v1 - b._v1 - offset).length() <= tolerance
+                     && (a._v2 - b._v2 - offset).length() <= tolerance
+                     && (a._v3 - b._v3 - offset).length() <= tolerance;
+            }
+            if (match)
+            {
+                instance._mesh = meshIndex;
+                instance._transform = AffineTransform::translate(offset);
+                break;
+            }
+        }
+
+        if (instance._mesh < 0)
+        {
+            MeshInfo mesh;
+            mesh._triangles.assign(tris.begin() + begin, tris.begin() + end);
+            mesh._materialIDs.assign(materialIDs.begin() + begin, materialIDs.begin() + end);
+            instance._mesh = static_cast<long>(meshes.size());
+            sameShape.push_back(instance._mesh);
+            meshes.push_back(std::move(mesh));
+        }
+        instances.push_back(instance);
+    }
+}
@@ -21,4 +21,5 @@ struct resultRecordStructure{
     int _collisionCount = 0;
     myComputeType _travelDistance = 0;
     float _emission_delay = 0;
+    int _rayCount = 0;      // rays cast for this path, for the rays/s figures
 };
\ No newline at end of file
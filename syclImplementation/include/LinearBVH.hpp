@@ -0,0 +1,198 @@
+#pragma once
+
+#include "BVHArray.hpp"
+#include "Geometry.hpp"
+#include <oneapi/dpl/execution>
+#include <oneapi/dpl/algorithm>
+#include <cstdint>
+
+// Linear BVH (Karras 2012) built entirely with kernels on the scene's queue:
+// Morton codes of the centroids, a radix sort by code, one work-item per
+// inner node to emit the hierarchy and a bottom-up pass for the bounds.
+// Inner nodes take indices 0..n-2 with the root at 0, leaf k sits at n-1+k
+// and refers to object slot k, so the objects are reordered by code.
+
+// spreads the low 21 bits so that two zero bits follow each one
+inline uint64_t expandMortonBits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+inline uint64_t mortonCode(const Vec3& centroid, const Bounds3& centroidBounds)
+{
+    const myComputeType scale = static_cast<myComputeType>((1 << 21) - 1);
+    Vec3 extent = centroidBounds.Diagonal();
+    myComputeType x = extent.x > 0 ? (centroid.x - centroidBounds.pMin.x) / extent.x : 0.5f;
+    myComputeType y = extent.y > 0 ? (centroid.y - centroidBounds.pMin.y) / extent.y : 0.5f;
+    myComputeType z = extent.z > 0 ? (centroid.z - centroidBounds.pMin.z) / extent.z : 0.5f;
+    uint64_t qx = static_cast<uint64_t>(sycl::fmin(sycl::fmax(x * scale, (myComputeType)0), scale));
+    uint64_t qy = static_cast<uint64_t>(sycl::fmin(sycl::fmax(y * scale, (myComputeType)0), scale));
+    uint64_t qz = static_cast<uint64_t>(sycl::fmin(sycl::fmax(z * scale, (myComputeType)0), scale));
+    return (expandMortonBits(qx) << 2) | (expandMortonBits(qy) << 1) | expandMortonBits(qz);
+}
+
+// Length of the common prefix of the codes at i and j, -1 outside the array.
+// Equal codes fall back to the indices so every key is unique.
+inline int mortonPrefix(const uint64_t* codes, long count, long i, long j)
+{
+    if (j < 0 || j >= count)
+    {
+        return -1;
+    }
+    uint64_t a = codes[i];
+    uint64_t b = codes[j];
+    if (a == b)
+    {
+        return 64 + sycl::clz(static_cast<uint64_t>(i) ^ static_cast<uint64_t>(j));
+    }
+    return sycl::clz(a ^ b);
+}
+
+
+template <typename ObjectType>
+void buildLinearBVH(sycl::queue& myQueue, Geometry** geometryList, ObjectType* objects, size_t objectCount, BVHNode* nodes)
+{
+    const long n = static_cast<long>(objectCount);
+    if (n == 0)
+    {
+        return;
+    }
+
+    Bounds3* primitiveBounds = sycl::malloc_device<Bounds3>(n, myQueue);
+    uint64_t* codes = sycl::malloc_device<uint64_t>(n, myQueue);
+    long* order = sycl::malloc_device<long>(n, myQueue);
+    ObjectType* unsorted = sycl::malloc_device<ObjectType>(n, myQueue);
+    long* parents = sycl::malloc_device<long>(2 * n - 1, myQueue);
+    int* arrivals = sycl::malloc_device<int>(2 * n - 1, myQueue);
+
+    const long partialCount = std::min(n, 1024L);
+    Bounds3* partialBounds = sycl::malloc_device<Bounds3>(partialCount + 1, myQueue);
+
+    myQueue.memcpy(unsorted, objects, sizeof(ObjectType) * n).wait();
+    myQueue.memset(arrivals, 0, sizeof(int) * (2 * n - 1)).wait();
+
+    myQueue.parallel_for(sycl::range<1>(n), [=](sycl::id<1> index) {
+        long i = index[0];
+        primitiveBounds[i] = geometryList[unsorted[i]._geometryIndex]->getBounds();
+        order[i] = i;
+    }).wait();
+
+    // centroid bounds in two steps: strided partial unions, then one work-item
+    myQueue.parallel_for(sycl::range<1>(partialCount), [=](sycl::id<1> index) {
+        Bounds3 bounds;
+        for (long i = index[0]; i < n; i += partialCount)
+        {
+            bounds = Union(bounds, primitiveBounds[i].Centroid());
+        }
+        partialBounds[index[0]] = bounds;
+    }).wait();
+    myQueue.single_task([=]() {
+        Bounds3 bounds;
+        for (long i = 0; i < partialCount; i++)
+        {
+            bounds = Union(bounds, partialBounds[i]);
+        }
+        partialBounds[partialCount] = bounds;
+    }).wait();
+
+    myQueue.parallel_for(sycl::range<1>(n), [=](sycl::id<1> index) {
+        long i = index[0];
+        codes[i] = mortonCode(primitiveBounds[i].Centroid(), partialBounds[partialCount]);
+    }).wait();
+
+    oneapi::dpl::sort_by_key(oneapi::dpl::execution::make_device_policy(myQueue), codes, codes + n, order);
+
+    // leaves, in code order
+    myQueue.parallel_for(sycl::range<1>(n), [=](sycl::id<1> index) {
+        long k = index[0];
+        objects[k] = unsorted[order[k]];
+        BVHNode leaf;
+        leaf._objectIndex = k;
+        leaf._bounds = primitiveBounds[order[k]];
+        nodes[n - 1 + k] = leaf;
+    }).wait();
+    myQueue.single_task([=]() {
+        parents[0] = -1;
+    }).wait();
+
+    if (n > 1)
+    {
+        myQueue.parallel_for(sycl::range<1>(n - 1), [=](sycl::id<1> index) {
+            long i = index[0];
+
+            // direction and far end of the key range covered by node i
+            long d = mortonPrefix(codes, n, i, i + 1) - mortonPrefix(codes, n, i, i - 1) >= 0 ? 1 : -1;
+            int prefixMin = mortonPrefix(codes, n, i, i - d);
+            long lengthMax = 2;
+            while (mortonPrefix(codes, n, i, i + lengthMax * d) > prefixMin)
+            {
+                lengthMax *= 2;
+            }
+            long length = 0;
+            for (long t = lengthMax / 2; t >= 1; t /= 2)
+            {
+                if (mortonPrefix(codes, n, i, i + (length + t) * d) > prefixMin)
+                {
+                    length += t;
+                }
+            }
+            long j = i + length * d;
+
+            // the split is where the common prefix of the range ends
+            int prefixNode = mortonPrefix(codes, n, i, j);
+            long split = 0;
+            for (long divisor = 2; ; divisor *= 2)
+            {
+                long t = (length + divisor - 1) / divisor;
+                if (mortonPrefix(codes, n, i, i + (split + t) * d) > prefixNode)
+                {
+                    split += t;
+                }
+                if (t <= 1)
+                {
+                    break;
+                }
+            }
+            long gamma = i + split * d + sycl::min(d, 0L);
+
+            long left = sycl::min(i, j) == gamma ? n - 1 + gamma : gamma;
+            long right = sycl::max(i, j) == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+            nodes[i]._objectIndex = -1;
+            nodes[i]._leftIndex = left;
+            nodes[i]._rightIndex = right;
+            parents[left] = i;
+            parents[right] = i;
+        }).wait();
+
+        // the second child to arrive at a node unions both boxes and moves up
+        myQueue.parallel_for(sycl::range<1>(n), [=](sycl::id<1> index) {
+            long node = parents[n - 1 + index[0]];
+            while (node >= 0)
+            {
+                sycl::atomic_ref<int, sycl::memory_order::acq_rel, sycl::memory_scope::device,
+                                 sycl::access::address_space::global_space> arrival(arrivals[node]);
+                if (arrival.fetch_add(1) == 0)
+                {
+                    break;
+                }
+                nodes[node]._bounds = Union(nodes[nodes[node]._leftIndex]._bounds, nodes[nodes[node]._rightIndex]._bounds);
+                sycl::atomic_fence(sycl::memory_order::acq_rel, sycl::memory_scope::device);
+                node = parents[node];
+            }
+        }).wait();
+    }
+
+    sycl::free(primitiveBounds, myQueue);
+    sycl::free(codes, myQueue);
+    sycl::free(order, myQueue);
+    sycl::free(unsorted, myQueue);
+    sycl::free(parents, myQueue);
+    sycl::free(arrivals, myQueue);
+    sycl::free(partialBounds, myQueue);
+}
@@ -43,7 +43,7 @@ class Material
 
 #include "DiffuseMaterial.hpp"
 
-myComputeType Material::pdf(const Vec3 &wi, const Vec3 &wo, const Vec3 &N)const{
+inline myComputeType Material::pdf(const Vec3 &wi, const Vec3 &wo, const Vec3 &N)const{
     switch (_type)
     {
     case DIFFUSE:
@@ -53,7 +53,7 @@ myComputeType Material::pdf(const Vec3 &wi, const Vec3 &wo, const Vec3 &N)const{
     }
 }
 
-Vec3 Material::sample(const Vec3 &wi, const Vec3 &N, RNG &rng)const{
+inline Vec3 Material::sample(const Vec3 &wi, const Vec3 &N, RNG &rng)const{
     switch (_type)
     {
     case DIFFUSE:
@@ -63,7 +63,7 @@ Vec3 Material::sample(const Vec3 &wi, const Vec3 &N, RNG &rng)const{
     }
 }
 
-Vec3 Material::eval(const Vec3 &wi, const Vec3 &wo, const Vec3 &N)const{
+inline Vec3 Material::eval(const Vec3 &wi, const Vec3 &wo, const Vec3 &N)const{
     switch (_type)
     {
     case DIFFUSE:
@@ -1,32 +1,43 @@
 #pragma once
 
 #include "GeometryList.hpp"
+#include "AnalyticGeometry.hpp"
 #include "MaterialList.hpp"
 #include "BVHArray.hpp"
+#include "WideBVHArray.hpp"
+#include "CompactBVHArray.hpp"
+#include "QuantizedBVHArray.hpp"
+#include "PrimitiveList.hpp"
+#include "BlockBVHArray.hpp"
+#include "SpatialSplitBVH.hpp"
+#include "LinearBVH.hpp"
+#include "InstancedBVH.hpp"
+#include "ScenePack.hpp"
+#include "SceneArena.hpp"
 #include "Camera.hpp"
+#include "HostParallel.hpp"
+#include <cassert>
+#include <chrono>
+#include <future>
+
+// Where the scene arrays live while rendering. SHARED keeps them in
+// malloc_shared memory so the host can still refit or rebuild the scene,
+// DEVICE moves them to malloc_device memory with ObjectListContent::toDevice().
+enum class ScenePlacement
+{
+    SHARED,
+    DEVICE
+};
 
 struct Object
 {
     long _geometryIndex = -1;
     long _materialIndex = -1;
+    bool _splitCopy = false;    // extra reference to an object split by the SBVH builder
 };
 
 
 
-bool spaceCompare(const GeometryList geometryList ,const Object& obja, const Object& objb, int dim)
-{
-
-    auto a = geometryList.getGeometry(obja._geometryIndex);
-    auto b = geometryList.getGeometry(objb._geometryIndex);
-
-
-    myComputeType aCentroid = a->getBounds().Centroid()[dim];
-    myComputeType bCentroid = b->getBounds().Centroid()[dim];
-
-    return aCentroid < bCentroid;
-}
-
-
 struct ObjectListContent
 {
     sycl::queue& _myQueue;
@@ -39,6 +50,18 @@ struct ObjectListContent
     size_t _geometryListSize = 0;
     Triangle* _triangleList = nullptr;
     size_t _triangleListSize = 0;
+    // indexed storage, filled by addIndexedObject instead of _triangleList
+    Vec3* _vertexList = nullptr;
+    size_t _vertexListSize = 0;
+    IndexedTriangle* _indexedTriangleList = nullptr;
+    size_t _indexedTriangleListSize = 0;
+    // analytic primitives, stored after the mesh in the geometry pointer table
+    Box* _boxList = nullptr;
+    size_t _boxListSize = 0;
+    Quad* _quadList = nullptr;
+    size_t _quadListSize = 0;
+    Sphere* _sphereList = nullptr;
+    size_t _sphereListSize = 0;
     
     Material** _materialList = nullptr;
     size_t _materialListSize = 0;
@@ -51,179 +74,1003 @@ struct ObjectListContent
     BVHNode* _bvhResource = nullptr;
     size_t _bvhSize = 0;    
 
+    BVHLayout _bvhLayout = BVHLayout::BINARY;
+    WideBVHNode<4>* _bvh4Resource = nullptr;
+    size_t _bvh4Size = 0;
+    WideBVHNode<8>* _bvh8Resource = nullptr;
+    size_t _bvh8Size = 0;
+    CompactBVHNode* _compactBvhResource = nullptr;
+    size_t _compactBvhSize = 0;
+    QuantizedBVHNode<uint8_t>* _quantized8BvhResource = nullptr;
+    size_t _quantized8BvhSize = 0;
+    QuantizedBVHNode<uint16_t>* _quantized16BvhResource = nullptr;
+    size_t _quantized16BvhSize = 0;
+    Bounds3 _quantizedRootBounds;
+    CompactBVHNode* _blockBvhResource = nullptr;
+    size_t _blockBvhSize = 0;
+    TriangleBlock<8>* _triangleBlock8Resource = nullptr;
+    size_t _triangleBlock8Size = 0;
+
+    TrianglePrimitive* _primitiveTriangles = nullptr;
+    int* _primitiveMaterialIndices = nullptr;
+    size_t _primitiveListSize = 0;
+
+    BVHBuildConfig _bvhConfig;
+    myComputeType _builtSAHCost = 0;    // SAH cost right after the last full build
+    ScenePlacement _placement = ScenePlacement::SHARED;
+
+    // two-level scene, filled by addInstancedObject instead of the arrays above
+    BVHNode* _topBvhResource = nullptr;
+    size_t _topBvhSize = 0;
+    Instance* _instanceResource = nullptr;
+    size_t _instanceCount = 0;
+    MeshBVH* _meshResource = nullptr;
+    size_t _meshCount = 0;
+    BVHNode* _meshBvhResource = nullptr;
+    size_t _meshBvhSize = 0;
+    TrianglePrimitive* _meshTriangleResource = nullptr;
+    int* _meshMaterialIndices = nullptr;
+    size_t _meshTriangleSize = 0;
+
+    // the arrays whose sizes are known before the build share one allocation
+    SceneArena _arena;
+    bool _hugePages = false;    // advise the arena as huge-page backed on a CPU device
+
+
+    template <typename T>
+    T* allocateResource(const std::string& name, size_t count)
+    {
+        T* resource = _arena.take<T>(name, count);
+        return resource != nullptr ? resource : sycl::malloc_shared<T>(count, _myQueue);
+    }
+
+    void freeResource(void* resource)
+    {
+        if (resource != nullptr && !_arena.contains(resource))
+        {
+            sycl::free(resource, _myQueue);
+        }
+    }
+
+    // Sizes the arena for a flat scene. SBVH adds references during the build,
+    // so its objects and nodes are left out; zero counts reserve nothing.
+    void reserveSceneArena(size_t triangleCount, size_t materialCount, size_t objectCount, size_t nodeCount, size_t primitiveCount,
+                           size_t indexedTriangleCount = 0, size_t vertexCount = 0, const AnalyticGeometry* analytic = nullptr)
+    {
+        _arena.clear();
+        _arena.reserve<Triangle>("triangles", triangleCount);
+        _arena.reserve<IndexedTriangle>("indexed triangles", indexedTriangleCount);
+        _arena.reserve<Vec3>("vertices", vertexCount);
+        if (analytic != nullptr)
+        {
+            _arena.reserve<Box>("boxes", analytic->_boxes.size());
+            _arena.reserve<Quad>("quads", analytic->_quads.size());
+            _arena.reserve<Sphere>("spheres", analytic->_spheres.size());
+        }
+        _arena.reserve<Geometry*>("geometry pointers", triangleCount + indexedTriangleCount + (analytic ? analytic->size() : 0));
+        _arena.reserve<diffuseMaterial>("materials", materialCount);
+        _arena.reserve<Material*>("material pointers", materialCount);
+        _arena.reserve<Object>("objects", objectCount);
+        _arena.reserve<BVHNode>("BVH nodes", nodeCount);
+        _arena.reserve<TrianglePrimitive>("primitive triangles", primitiveCount);
+        _arena.reserve<int>("primitive materials", primitiveCount);
+        _arena.allocate(_myQueue, _hugePages);
+    }
+
+    // Arena for addObject and addIndexedObject: one object per geometry and,
+    // unless SBVH adds references, a 2n-1 node BVH and n flattened primitives.
+    // Analytic primitives have no flattened form, so they rule out the latter.
+    void reserveBuiltScene(size_t triangleCount, size_t indexedTriangleCount, size_t vertexCount, size_t materialCount,
+                           const BVHBuildConfig& bvhConfig, const AnalyticGeometry* analytic = nullptr)
+    {
+        size_t analyticCount = analytic ? analytic->size() : 0;
+        size_t geometryCount = triangleCount + indexedTriangleCount + analyticCount;
+        bool spatialSplits = bvhConfig._method == BVHBuildMethod::SBVH;
+        reserveSceneArena(triangleCount, materialCount, spatialSplits ? 0 : geometryCount,
+                          spatialSplits ? 0 : caculateArraySize(geometryCount),
+                          (bvhConfig._flattenPrimitives && !spatialSplits && analyticCount == 0) ? geometryCount : 0,
+                          indexedTriangleCount, vertexCount, analytic);
+    }
+
+    // Calls f(resource, count) for every data array; the two pointer tables
+    // are left out because they are rebuilt rather than copied.
+    template <typename Self, typename F>
+    static void forEachResource(Self& self, F f)
+    {
+        f(self._triangleList, self._triangleListSize);
+        f(self._indexedTriangleList, self._indexedTriangleListSize);
+        f(self._vertexList, self._vertexListSize);
+        f(self._boxList, self._boxListSize);
+        f(self._quadList, self._quadListSize);
+        f(self._sphereList, self._sphereListSize);
+        f(self._diffuseMaterialList, self._diffuseMaterialListSize);
+        f(self._objectList, self._objectListSize);
+        f(self._bvhResource, self._bvhSize);
+        f(self._bvh4Resource, self._bvh4Size);
+        f(self._bvh8Resource, self._bvh8Size);
+        f(self._compactBvhResource, self._compactBvhSize);
+        f(self._quantized8BvhResource, self._quantized8BvhSize);
+        f(self._quantized16BvhResource, self._quantized16BvhSize);
+        f(self._blockBvhResource, self._blockBvhSize);
+        f(self._triangleBlock8Resource, self._triangleBlock8Size);
+        f(self._primitiveTriangles, self._primitiveListSize);
+        f(self._primitiveMaterialIndices, self._primitiveListSize);
+        f(self._topBvhResource, self._topBvhSize);
+        f(self._instanceResource, self._instanceCount);
+        f(self._meshResource, self._meshCount);
+        f(self._meshBvhResource, self._meshBvhSize);
+        f(self._meshTriangleResource, self._meshTriangleSize);
+        f(self._meshMaterialIndices, self._meshTriangleSize);
+    }
+
+    size_t sceneMemoryBytes() const
+    {
+        size_t bytes = sizeof(Geometry*) * _geometryListSize + sizeof(Material*) * _materialListSize;
+        forEachResource(*this, [&](const auto* resource, size_t count) {
+            bytes += resource != nullptr ? sizeof(*resource) * count : 0;
+        });
+        return bytes;
+    }
+
+    // bounds of the whole scene from the root of the binary or top-level BVH,
+    // copied so that device placement works too
+    Bounds3 sceneBounds()
+    {
+        const BVHNode* root = _topBvhSize > 0 ? _topBvhResource : _bvhResource;
+        if (root == nullptr)
+        {
+            return Bounds3();
+        }
+        BVHNode node;
+        _myQueue.memcpy(&node, root, sizeof(BVHNode)).wait();
+        return node._bounds;
+    }
+
+    void reportMemory() const
+    {
+        size_t separate = (_geometryList && !_arena.contains(_geometryList)) + (_materialList && !_arena.contains(_materialList));
+        forEachResource(*this, [&](const auto* resource, size_t count) {
+            separate += resource != nullptr && count > 0 && !_arena.contains(resource);
+        });
+        size_t geometryBytes = sizeof(Geometry*) * _geometryListSize + sizeof(Triangle) * _triangleListSize
+                             + sizeof(IndexedTriangle) * _indexedTriangleListSize + sizeof(Vec3) * _vertexListSize
+                             + sizeof(Box) * _boxListSize + sizeof(Quad) * _quadListSize + sizeof(Sphere) * _sphereListSize;
+        std::cout << "[INFO] Scene memory: " << std::fixed << std::setprecision(2) << sceneMemoryBytes() / 1048576.0
+                  << " MB (geometry " << geometryBytes / 1048576.0 << " MB), arena " << _arena.capacity() / 1048576.0 << " MB, " << separate
+                  << " separate allocations" << std::defaultfloat << std::endl;
+    }
+
 
+    // One bulk copy per array; the pointer tables are allocated by
+    // addObjects once all geometry is in and filled by linkPointerTables.
     void addTriangleGeometry(std::vector<Triangle> &tris)
     {
-        _triangleList = sycl::malloc_shared<Triangle>(tris.size(), _myQueue);
-        _geometryList = sycl::malloc_shared<Geometry*>(tris.size(), _myQueue);
+        _triangleList = allocateResource<Triangle>("triangles", tris.size());
+        _myQueue.memcpy(_triangleList, tris.data(), sizeof(Triangle) * tris.size()).wait();
+        _triangleListSize = tris.size();
+        _geometryListSize = tris.size();
+        _globalGeometryIndex = tris.size();
+    }
 
-            for (size_t i = 0; i < tris.size(); i++)
-            {
-                //_triangles[i] = tris[i];
-                _myQueue.memcpy(_triangleList+i, &tris[i], sizeof(Triangle)).wait();
-                _geometryListSize++;
-                _geometryList[_globalGeometryIndex] = &_triangleList[i];
-                _globalGeometryIndex++;
-            }
-            _triangleListSize = tris.size();
+    void addIndexedTriangleGeometry(std::vector<Vec3>& vertices, std::vector<IndexedTriangle>& tris)
+    {
+        _vertexList = allocateResource<Vec3>("vertices", vertices.size());
+        _indexedTriangleList = allocateResource<IndexedTriangle>("indexed triangles", tris.size());
+        _myQueue.memcpy(_vertexList, vertices.data(), sizeof(Vec3) * vertices.size());
+        _myQueue.memcpy(_indexedTriangleList, tris.data(), sizeof(IndexedTriangle) * tris.size());
+        _myQueue.wait();
+        _vertexListSize = vertices.size();
+        _indexedTriangleListSize = tris.size();
+        _geometryListSize = tris.size();
+        _globalGeometryIndex = tris.size();
+    }
 
+    // Appended after the mesh, boxes first, then quads, then spheres.
+    void addAnalyticGeometry(const AnalyticGeometry& analytic)
+    {
+        uploadGeometry(_boxList, _boxListSize, analytic._boxes, "boxes");
+        uploadGeometry(_quadList, _quadListSize, analytic._quads, "quads");
+        uploadGeometry(_sphereList, _sphereListSize, analytic._spheres, "spheres");
+        _myQueue.wait();
+        _geometryListSize += analytic.size();
+        _globalGeometryIndex = _geometryListSize;
+    }
+
+    // queues the copy, an empty list leaves the array unallocated
+    template <typename T>
+    void uploadGeometry(T*& resource, size_t& size, const std::vector<T>& geometry, const std::string& name)
+    {
+        size = geometry.size();
+        if (size > 0)
+        {
+            resource = allocateResource<T>(name, size);
+            _myQueue.memcpy(resource, geometry.data(), sizeof(T) * size);
+        }
     }
 
 
     void addMaterial(std::vector<MaterialInfo>& materialInfoList)
     {
-            _materialList = sycl::malloc_shared<Material*>(materialInfoList.size(), _myQueue);
-            _diffuseMaterialList = sycl::malloc_shared<diffuseMaterial>(materialInfoList.size(), _myQueue);
-            for (size_t i = 0; i < materialInfoList.size(); i++)
+        std::vector<diffuseMaterial> materials;
+        materials.reserve(materialInfoList.size());
+        for (const auto& info : materialInfoList)
+        {
+            materials.push_back(diffuseMaterial(info._emission, info._specular, info._diffuse));
+        }
+        _materialList = allocateResource<Material*>("material pointers", materials.size());
+        _diffuseMaterialList = allocateResource<diffuseMaterial>("materials", materials.size());
+        _myQueue.memcpy(_diffuseMaterialList, materials.data(), sizeof(diffuseMaterial) * materials.size()).wait();
+        _materialListSize = materials.size();
+        _diffuseMaterialListSize = materials.size();
+        _gloablMaterialIndex = materials.size();
+    }
+
+    // Points every entry of _geometryList at its triangle or analytic
+    // primitive and every entry of _materialList at its material, and every
+    // indexed triangle at the vertex buffer. Runs as one kernel, so the tables
+    // come out right for shared and for device memory alike.
+    void linkPointerTables()
+    {
+        Geometry** geometryList = _geometryList;
+        Triangle* triangleList = _triangleList;
+        IndexedTriangle* indexedTriangleList = _indexedTriangleList;
+        const Vec3* vertexList = _vertexList;
+        Box* boxList = _boxList;
+        Quad* quadList = _quadList;
+        Sphere* sphereList = _sphereList;
+        size_t meshCount = _triangleListSize + _indexedTriangleListSize;
+        size_t boxCount = _boxListSize;
+        size_t quadCount = _quadListSize;
+        size_t geometryCount = (_geometryList && (_triangleList || _indexedTriangleList || _boxList || _quadList || _sphereList))
+                             ? _geometryListSize : 0;
+        Material** materialList = _materialList;
+        diffuseMaterial* diffuseMaterialList = _diffuseMaterialList;
+        size_t materialCount = (_materialList && _diffuseMaterialList) ? _materialListSize : 0;
+        size_t count = std::max(geometryCount, materialCount);
+        if (count == 0)
+        {
+            return;
+        }
+        _myQueue.parallel_for(sycl::range<1>(count), [=](sycl::id<1> index) {
+            size_t i = index[0];
+            if (i < meshCount && triangleList)
+            {
+                geometryList[i] = &triangleList[i];
+            }
+            else if (i < meshCount)
             {
-                //_diffuseList[i] = diffuseMaterial(materialInfoList[i]._emission, materialInfoList[i]._specular, materialInfoList[i]._diffuse);
-                diffuseMaterial material(materialInfoList[i]._emission, materialInfoList[i]._specular, materialInfoList[i]._diffuse);
-                _myQueue.memcpy(_diffuseMaterialList+i, &material, sizeof(diffuseMaterial)).wait();
-                _materialList[_gloablMaterialIndex] = &_diffuseMaterialList[i];
-                _materialListSize++;
-                _diffuseMaterialListSize++;
-                _gloablMaterialIndex++;
+                indexedTriangleList[i]._vertices = vertexList;
+                geometryList[i] = &indexedTriangleList[i];
             }
+            else if (i < geometryCount)
+            {
+                size_t j = i - meshCount;
+                if (j < boxCount)
+                {
+                    geometryList[i] = &boxList[j];
+                }
+                else if (j < boxCount + quadCount)
+                {
+                    geometryList[i] = &quadList[j - boxCount];
+                }
+                else
+                {
+                    geometryList[i] = &sphereList[j - boxCount - quadCount];
+                }
+            }
+            if (i < materialCount)
+            {
+                materialList[i] = &diffuseMaterialList[i];
+            }
+        }).wait();
     }
 
 
-    void addObject(std::vector<Triangle> &tris, std::vector<MaterialInfo>& materialInfoList, std::vector<int>& geomIDs)
+    // analytic, when given, adds its boxes, quads and spheres after the triangles
+    void addObject(std::vector<Triangle> &tris, std::vector<MaterialInfo>& materialInfoList, std::vector<int>& geomIDs, const BVHBuildConfig& bvhConfig = BVHBuildConfig(),
+                   const AnalyticGeometry* analytic = nullptr)
     {
+        auto uploadStart = std::chrono::high_resolution_clock::now();
+        reserveBuiltScene(tris.size(), 0, 0, materialInfoList.size(), bvhConfig, analytic);
         addTriangleGeometry(tris);
+        addObjects(materialInfoList, geomIDs, bvhConfig, uploadStart, analytic);
+    }
+
+    // Same as addObject for a mesh stored as a shared vertex buffer and index
+    // triplets, see OBJ_Loader::setIndexedStorage.
+    void addIndexedObject(std::vector<Vec3>& vertices, std::vector<IndexedTriangle>& tris, std::vector<MaterialInfo>& materialInfoList,
+                          std::vector<int>& geomIDs, const BVHBuildConfig& bvhConfig = BVHBuildConfig(),
+                          const AnalyticGeometry* analytic = nullptr)
+    {
+        auto uploadStart = std::chrono::high_resolution_clock::now();
+        reserveBuiltScene(0, tris.size(), vertices.size(), materialInfoList.size(), bvhConfig, analytic);
+        addIndexedTriangleGeometry(vertices, tris);
+        addObjects(materialInfoList, geomIDs, bvhConfig, uploadStart, analytic);
+    }
+
+    // The analytic primitives and materials, one object per geometry, then the
+    // BVH over them. geomIDs holds the materials of the mesh triangles only.
+    void addObjects(std::vector<MaterialInfo>& materialInfoList, std::vector<int>& geomIDs, const BVHBuildConfig& bvhConfig,
+                    std::chrono::high_resolution_clock::time_point uploadStart, const AnalyticGeometry* analytic = nullptr)
+    {
+        size_t meshCount = _geometryListSize;
+        if (analytic != nullptr)
+        {
+            addAnalyticGeometry(*analytic);
+        }
+        _geometryList = allocateResource<Geometry*>("geometry pointers", _geometryListSize);
         addMaterial(materialInfoList);
+        linkPointerTables();
 
-        size_t GeometryListSize = tris.size();
-        _objectList = sycl::malloc_shared<Object>(tris.size(), _myQueue);
+        size_t GeometryListSize = _geometryListSize;
+        _objectList = allocateResource<Object>("objects", GeometryListSize);
 
         for (size_t i = 0; i < GeometryListSize; i++)
         {
-            _objectList[_objectListSize]._materialIndex = static_cast<long>(geomIDs[i]);
+            int materialID = i < meshCount ? geomIDs[i] : analytic->materialID(i - meshCount);
+            _objectList[_objectListSize] = Object();    // USM memory comes uninitialised
+            _objectList[_objectListSize]._materialIndex = static_cast<long>(materialID);
             _objectList[_objectListSize]._geometryIndex = static_cast<long>(i);
             _objectListSize++;  
         }
+        auto uploadEnd = std::chrono::high_resolution_clock::now();
+        std::cout << "[INFO] Scene upload time: "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(uploadEnd - uploadStart).count() / 1000.0
+                  << " ms for " << GeometryListSize << " primitives" << std::endl;
 
-        _bvhSize = caculateArraySize(_objectListSize);
-        _bvhResource = sycl::malloc_shared<BVHNode>(_bvhSize, _myQueue);
-        for (size_t i = 0; i < _bvhSize; i++)
+        buildBVH(bvhConfig);
+        reportMemory();
+    }
+
+    // Same scene as addObject, restored from a pack written by writeScenePack:
+    // the arrays are copied out of the mapping in one go and only the derived
+    // layouts are generated. Returns false when a section is missing.
+    bool addObjectFromPack(const ScenePack& pack, const BVHBuildConfig& bvhConfig = BVHBuildConfig())
+    {
+        auto loadStart = std::chrono::high_resolution_clock::now();
+        size_t triangleCount, materialCount, objectCount, nodeCount, infoCount;
+        const Triangle* triangles = pack.section<Triangle>(ScenePackSection::TRIANGLES, triangleCount);
+        const MaterialInfo* materials = pack.section<MaterialInfo>(ScenePackSection::MATERIALS, materialCount);
+        const Object* objects = pack.section<Object>(ScenePackSection::OBJECTS, objectCount);
+        const BVHNode* nodes = pack.section<BVHNode>(ScenePackSection::BVH_NODES, nodeCount);
+        const ScenePackBuildInfo* info = pack.section<ScenePackBuildInfo>(ScenePackSection::BUILD_INFO, infoCount);
+        if (triangles == nullptr || materials == nullptr || objects == nullptr || nodes == nullptr || infoCount != 1)
         {
-            _bvhResource[i]._objectIndex = -1;
-            _bvhResource[i]._leftIndex = -1;
-            _bvhResource[i]._rightIndex = -1;
+            return false;
         }
 
-        BVHArray bvh;  
+        reserveSceneArena(triangleCount, materialCount, objectCount, nodeCount, bvhConfig._flattenPrimitives ? objectCount : 0);
+        _triangleListSize = triangleCount;
+        _triangleList = allocateResource<Triangle>("triangles", _triangleListSize);
+        _myQueue.memcpy(_triangleList, triangles, sizeof(Triangle) * _triangleListSize).wait();
+        _geometryListSize = triangleCount;
+        _geometryList = allocateResource<Geometry*>("geometry pointers", _geometryListSize);
+        _globalGeometryIndex = _geometryListSize;
 
-        GeometryList Tem_geometryList;
+        std::vector<MaterialInfo> materialInfoList(materials, materials + materialCount);
+        addMaterial(materialInfoList);
+        linkPointerTables();
+
+        _objectListSize = objectCount;
+        _objectList = allocateResource<Object>("objects", _objectListSize);
+        _myQueue.memcpy(_objectList, objects, sizeof(Object) * _objectListSize).wait();
+        _bvhSize = nodeCount;
+        _bvhResource = allocateResource<BVHNode>("BVH nodes", _bvhSize);
+        _myQueue.memcpy(_bvhResource, nodes, sizeof(BVHNode) * _bvhSize).wait();
+        _bvhConfig = bvhConfig;
+        _builtSAHCost = info->_sahCost;
+
+        auto loadEnd = std::chrono::high_resolution_clock::now();
+        std::cout << "[INFO] Scene pack loaded in "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(loadEnd - loadStart).count() / 1000.0
+                  << " ms: " << _triangleListSize << " triangles, " << _bvhSize << " BVH nodes" << std::endl;
 
+        GeometryList Tem_geometryList;
         Tem_geometryList.setTriangles(this->_triangleList, this->_triangleListSize);
         Tem_geometryList.setGeometryList(this->_geometryList, this->_geometryListSize);
-
+        BVHArray bvh;
         bvh.setBVHArray(this->_bvhSize, this->_bvhResource);
-        bvh.buildTree(Tem_geometryList,this->_objectList, 0, _objectListSize - 1);      
+        addDerivedLayouts(bvh, bvhConfig, Tem_geometryList);
+        reportMemory();
+        return true;
+    }
 
+    // Writes what addObject produced. The geometry pointer table is rebuilt on
+    // load, so only plain data goes into the pack. Call before toDevice().
+    bool writeScenePack(const std::string& path, uint64_t key, const std::vector<MaterialInfo>& materialInfoList) const
+    {
+        requireSharedPlacement("writeScenePack");
+        if (_indexedTriangleList != nullptr || _boxList != nullptr || _quadList != nullptr || _sphereList != nullptr)
+        {
+            std::cout << "[INFO] Scene packs hold plain triangles, not writing one for an indexed mesh or analytic primitives" << std::endl;
+            return false;
+        }
+        ScenePackBuildInfo info;
+        info._sahCost = _builtSAHCost;
+        ScenePackWriter writer;
+        writer.addSection(ScenePackSection::TRIANGLES, _triangleList, _triangleListSize);
+        writer.addSection(ScenePackSection::MATERIALS, materialInfoList.data(), materialInfoList.size());
+        writer.addSection(ScenePackSection::OBJECTS, _objectList, _objectListSize);
+        writer.addSection(ScenePackSection::BVH_NODES, _bvhResource, _bvhSize);
+        writer.addSection(ScenePackSection::BUILD_INFO, &info, 1);
+        bool written = writer.write(path, key);
+        std::cout << "[INFO] " << (written ? "Wrote scene pack " : "Could not write scene pack ") << path << std::endl;
+        return written;
     }
 
-    void toDevice() {
-        // Triangle List
-        Triangle* triangle_device_ptr = nullptr;
-        if (_triangleList && _triangleListSize > 0) {
-            triangle_device_ptr = sycl::malloc_device<Triangle>(_triangleListSize, _myQueue);
-            _myQueue.memcpy(triangle_device_ptr, _triangleList, sizeof(Triangle) * _triangleListSize).wait();
-            sycl::free(_triangleList, _myQueue);
-            _triangleList = triangle_device_ptr;
-        }
-
-        // Geometry List
-        if (_geometryList && _geometryListSize > 0) {
-            // Create a temporary host-side array of device pointers
-            std::vector<Geometry*> geometry_ptrs(_geometryListSize);
-            for (size_t i = 0; i < _geometryListSize; ++i) {
-                geometry_ptrs[i] = &_triangleList[i]; // Use device-side triangle pointer
-            }
+    // Two-level alternative to addObject: one bottom-level BVH per mesh and a
+    // top-level BVH over the instances. Both levels use the binary layout, the
+    // builder falls back to SAH for the SBVH and LBVH methods.
+    void addInstancedObject(std::vector<MeshInfo>& meshes, std::vector<InstanceInfo>& instances,
+                            std::vector<MaterialInfo>& materialInfoList, const BVHBuildConfig& bvhConfig = BVHBuildConfig())
+    {
+        BVHBuildConfig meshConfig = bvhConfig;
+        if (meshConfig._method == BVHBuildMethod::SBVH || meshConfig._method == BVHBuildMethod::LBVH)
+        {
+            meshConfig._method = BVHBuildMethod::SAH;
+        }
 
-            Geometry** device_ptr = sycl::malloc_device<Geometry*>(_geometryListSize, _myQueue);
-            _myQueue.memcpy(device_ptr, geometry_ptrs.data(), sizeof(Geometry*) * _geometryListSize).wait();
-            sycl::free(_geometryList, _myQueue);
-            _geometryList = device_ptr;
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        std::vector<MeshBVH> meshBVHs(meshes.size());
+        std::vector<BVHNode> nodes;
+        std::vector<TrianglePrimitive> triangles;
+        std::vector<int> materialIndices;
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            buildMeshBVH(meshes[i], meshConfig, meshBVHs[i], nodes, triangles, materialIndices);
         }
 
-        // Diffuse Material List
-        diffuseMaterial* diffuse_device_ptr = nullptr;
-        if (_diffuseMaterialList && _diffuseMaterialListSize > 0) {
-            diffuse_device_ptr = sycl::malloc_device<diffuseMaterial>(_diffuseMaterialListSize, _myQueue);
-            _myQueue.memcpy(diffuse_device_ptr, _diffuseMaterialList, sizeof(diffuseMaterial) * _diffuseMaterialListSize).wait();
-            sycl::free(_diffuseMaterialList, _myQueue);
-            _diffuseMaterialList = diffuse_device_ptr;
+        _arena.clear();
+        _arena.reserve<diffuseMaterial>("materials", materialInfoList.size());
+        _arena.reserve<Material*>("material pointers", materialInfoList.size());
+        _arena.reserve<MeshBVH>("meshes", meshBVHs.size());
+        _arena.reserve<BVHNode>("mesh BVH nodes", nodes.size());
+        _arena.reserve<TrianglePrimitive>("mesh triangles", triangles.size());
+        _arena.reserve<int>("mesh materials", materialIndices.size());
+        _arena.reserve<Instance>("instances", instances.size());
+        _arena.reserve<BVHNode>("top-level BVH nodes", instances.empty() ? 0 : caculateArraySize(instances.size()));
+        _arena.allocate(_myQueue, _hugePages);
+        addMaterial(materialInfoList);
+        linkPointerTables();
+
+        _meshCount = meshBVHs.size();
+        _meshResource = allocateResource<MeshBVH>("meshes", _meshCount);
+        _myQueue.memcpy(_meshResource, meshBVHs.data(), sizeof(MeshBVH) * _meshCount).wait();
+        _meshBvhSize = nodes.size();
+        _meshBvhResource = allocateResource<BVHNode>("mesh BVH nodes", _meshBvhSize);
+        _myQueue.memcpy(_meshBvhResource, nodes.data(), sizeof(BVHNode) * _meshBvhSize).wait();
+        _meshTriangleSize = triangles.size();
+        _meshTriangleResource = allocateResource<TrianglePrimitive>("mesh triangles", _meshTriangleSize);
+        _meshMaterialIndices = allocateResource<int>("mesh materials", _meshTriangleSize);
+        _myQueue.memcpy(_meshTriangleResource, triangles.data(), sizeof(TrianglePrimitive) * _meshTriangleSize).wait();
+        _myQueue.memcpy(_meshMaterialIndices, materialIndices.data(), sizeof(int) * _meshTriangleSize).wait();
+
+        _instanceCount = instances.size();
+        _instanceResource = allocateResource<Instance>("instances", _instanceCount);
+        _objectListSize = 0;
+        for (size_t i = 0; i < _instanceCount; i++)
+        {
+            _instanceResource[i] = Instance();
+            _instanceResource[i]._mesh = instances[i]._mesh;
+            _instanceResource[i]._materialOverride = instances[i]._materialOverride;
+            _instanceResource[i]._objectOffset = static_cast<long>(_objectListSize);
+            setTransform(_instanceResource[i], instances[i]._transform);
+            _objectListSize += _meshResource[instances[i]._mesh]._triangleCount;
+        }
+
+        _bvhConfig = meshConfig;
+        buildTopLevelBVH();
+        auto buildEnd = std::chrono::high_resolution_clock::now();
+        std::cout << "[INFO] Two-level BVH build time: "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(buildEnd - buildStart).count() / 1000.0
+                  << " ms" << std::endl;
+        std::cout << "[INFO] Instances: " << _instanceCount << " of " << _meshCount << " meshes, "
+                  << _meshTriangleSize << " unique triangles for " << _objectListSize << " scene triangles" << std::endl;
+        reportMemory();
+    }
+
+    // Moves one instance and rebuilds only the top level. Like
+    // updateTriangles, only valid before toDevice().
+    void setInstanceTransform(size_t instance, const AffineTransform& transform)
+    {
+        if (instance >= _instanceCount)
+        {
+            throw std::runtime_error("setInstanceTransform: instance index out of range");
+        }
+        requireSharedPlacement("setInstanceTransform");
+        setTransform(_instanceResource[instance], transform);
+
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        buildTopLevelBVH();
+        auto buildEnd = std::chrono::high_resolution_clock::now();
+        std::cout << "[INFO] Top-level BVH build time: "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(buildEnd - buildStart).count() / 1000.0
+                  << " ms for " << _instanceCount << " instances" << std::endl;
+    }
+
+    void setTransform(Instance& instance, const AffineTransform& transform)
+    {
+        instance._toWorld = transform;
+        instance._toObject = transform.inverse();
+        instance._normalSign = transform.determinant() < 0 ? -1.0f : 1.0f;
+        instance._bounds = transform.applyBounds(_meshResource[instance._mesh]._bounds);
+    }
+
+    // The instance count is fixed, so a rebuild reuses the nodes of the last one.
+    void buildTopLevelBVH()
+    {
+        std::vector<BVHNode> nodes;
+        buildInstanceBVH(_instanceResource, static_cast<long>(_instanceCount), _bvhConfig, nodes);
+        if (_topBvhResource == nullptr || _topBvhSize != nodes.size())
+        {
+            releaseResource(_topBvhResource, _topBvhSize);
+            _topBvhResource = allocateResource<BVHNode>("top-level BVH nodes", nodes.size());
         }
+        _topBvhSize = nodes.size();
+        _myQueue.memcpy(_topBvhResource, nodes.data(), sizeof(BVHNode) * _topBvhSize).wait();
+    }
+
+    // Builds the BVH over the current objects, then the layout it is traversed with.
+    void buildBVH(const BVHBuildConfig& bvhConfig)
+    {
+        BVHArray bvh;  
 
-        // Material List
-        if (_materialList && _materialListSize > 0) {
-            std::vector<Material*> material_ptrs(_materialListSize);
-            for (size_t i = 0; i < _materialListSize; ++i) {
-                material_ptrs[i] = &_diffuseMaterialList[i]; // Use device-side pointer
+        GeometryList Tem_geometryList;
+
+        Tem_geometryList.setTriangles(this->_triangleList, this->_triangleListSize);
+        Tem_geometryList.setGeometryList(this->_geometryList, this->_geometryListSize);
+
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        int buildThreads = hostThreadCount(bvhConfig._threadCount);
+        if (bvhConfig._method == BVHBuildMethod::SBVH)
+        {
+            addSpatialSplitBVH(Tem_geometryList, bvhConfig);
+            bvh.setBVHArray(this->_bvhSize, this->_bvhResource);
+            buildThreads = 1;
+        }
+        else
+        {
+            _bvhSize = caculateArraySize(_objectListSize);
+            _bvhResource = allocateResource<BVHNode>("BVH nodes", _bvhSize);
+            for (size_t i = 0; i < _bvhSize; i++)
+            {
+                _bvhResource[i]._objectIndex = -1;
+                _bvhResource[i]._leftIndex = -1;
+                _bvhResource[i]._rightIndex = -1;
+            }
+            bvh.setBVHArray(this->_bvhSize, this->_bvhResource);
+            if (bvhConfig._method == BVHBuildMethod::LBVH)
+            {
+                buildLinearBVH(_myQueue, _geometryList, _objectList, _objectListSize, _bvhResource);
+                buildThreads = 0;
             }
+            // Morton codes shared by many objects can push a linear BVH past
+            // the traversal stack, the host builder caps the depth
+            if (bvhConfig._method == BVHBuildMethod::LBVH && bvh.depth() > kMaxBVHDepth)
+            {
+                std::cout << "[INFO] Linear BVH is " << bvh.depth() << " levels deep, rebuilding with SAH" << std::endl;
+                for (size_t i = 0; i < _bvhSize; i++)
+                {
+                    _bvhResource[i] = BVHNode();
+                }
+                BVHBuildConfig sahConfig = bvhConfig;
+                sahConfig._method = BVHBuildMethod::SAH;
+                bvh.buildTree(Tem_geometryList, this->_objectList, 0, _objectListSize - 1, sahConfig);
+                buildThreads = hostThreadCount(bvhConfig._threadCount);
+            }
+            else if (bvhConfig._method != BVHBuildMethod::LBVH)
+            {
+                bvh.buildTree(Tem_geometryList,this->_objectList, 0, _objectListSize - 1, bvhConfig);      
+            }
+        }
+        auto buildEnd = std::chrono::high_resolution_clock::now();
+        std::cout << "[INFO] BVH build time: "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(buildEnd - buildStart).count() / 1000.0
+                  << " ms " << (buildThreads > 0 ? "with " + std::to_string(buildThreads) + " threads"
+                                                 : "on " + _myQueue.get_device().get_info<sycl::info::device::name>()) << std::endl;
+        _bvhConfig = bvhConfig;
+        _builtSAHCost = bvh.computeSAHCost(bvhConfig);
+        std::cout << "[INFO] BVH SAH cost: " << _builtSAHCost << std::endl;
+
+        addDerivedLayouts(bvh, bvhConfig, Tem_geometryList);
+    }
+
+    // Everything derived from the binary BVH: the flattened primitives and the
+    // traversal layout. Regenerated after every refit.
+    void addDerivedLayouts(const BVHArray& bvh, const BVHBuildConfig& bvhConfig, const GeometryList& geometryList)
+    {
+        requireBVHDepth(bvh.depth(), "BVH");
 
-            Material** device_ptr = sycl::malloc_device<Material*>(_materialListSize, _myQueue);
-            _myQueue.memcpy(device_ptr, material_ptrs.data(), sizeof(Material*) * _materialListSize).wait();
-            sycl::free(_materialList, _myQueue);
-            _materialList = device_ptr;
+        if (bvhConfig._flattenPrimitives)
+        {
+            addPrimitiveList(geometryList);
         }
 
-        // Object List
-        if (_objectList && _objectListSize > 0) {
-            Object* device_ptr = sycl::malloc_device<Object>(_objectListSize, _myQueue);
-            _myQueue.memcpy(device_ptr, _objectList, sizeof(Object) * _objectListSize).wait();
-            sycl::free(_objectList, _myQueue);
-            _objectList = device_ptr;
+        _bvhLayout = bvhConfig._layout;
+        switch (_bvhLayout)
+        {
+        case BVHLayout::WIDE4:
+            addWideBVH<4>(bvh, _bvh4Resource, _bvh4Size);
+            break;
+        case BVHLayout::WIDE8:
+            addWideBVH<8>(bvh, _bvh8Resource, _bvh8Size);
+            break;
+        case BVHLayout::COMPACT:
+            addCompactBVH(bvh, bvhConfig);
+            break;
+        case BVHLayout::QUANTIZED8:
+            addQuantizedBVH<uint8_t>(bvh, bvhConfig, _quantized8BvhResource, _quantized8BvhSize);
+            break;
+        case BVHLayout::QUANTIZED16:
+            addQuantizedBVH<uint16_t>(bvh, bvhConfig, _quantized16BvhResource, _quantized16BvhSize);
+            break;
+        case BVHLayout::BLOCK8:
+            addBlockBVH<8>(bvh, bvhConfig, geometryList, _triangleBlock8Resource, _triangleBlock8Size);
+            break;
+        default:
+            break;
         }
+    }
 
-        // BVH Resource
-        if (_bvhResource && _bvhSize > 0) {
-            BVHNode* device_ptr = sycl::malloc_device<BVHNode>(_bvhSize, _myQueue);
-            _myQueue.memcpy(device_ptr, _bvhResource, sizeof(BVHNode) * _bvhSize).wait();
-            sycl::free(_bvhResource, _myQueue);
-            _bvhResource = device_ptr;
+    // The SBVH leaves refer to reference slots, so every slot gets its own copy
+    // of the object and the BVH is sized by the builder rather than up front.
+    void addSpatialSplitBVH(const GeometryList& geometryList, const BVHBuildConfig& bvhConfig)
+    {
+        std::vector<Geometry*> geometries(_objectListSize);
+        for (size_t i = 0; i < _objectListSize; i++)
+        {
+            geometries[i] = geometryList.getGeometry(_objectList[i]._geometryIndex);
         }
 
-        _myQueue.wait();
-        std::cout << "[INFO] Data moved to device memory with updated pointer redirection.\n";
+        std::vector<BVHNode> nodes;
+        std::vector<long> references;
+        buildSpatialSplitBVH(geometries, bvhConfig, nodes, references);
+
+        Object* objects = allocateResource<Object>("SBVH objects", references.size());
+        std::vector<bool> referenced(_objectListSize, false);
+        for (size_t i = 0; i < references.size(); i++)
+        {
+            objects[i] = _objectList[references[i]];
+            objects[i]._splitCopy = referenced[references[i]];
+            referenced[references[i]] = true;
+        }
+        std::cout << "[INFO] SBVH references: " << references.size() << " for " << _objectListSize << " objects" << std::endl;
+        freeResource(_objectList);
+        _objectList = objects;
+        _objectListSize = references.size();
+
+        _bvhSize = nodes.size();
+        _bvhResource = allocateResource<BVHNode>("SBVH nodes", _bvhSize);
+        _myQueue.memcpy(_bvhResource, nodes.data(), sizeof(BVHNode) * _bvhSize).wait();
     }
 
+    // buildTree leaves the objects in BVH order, so the flattened arrays share their indices
+    void addPrimitiveList(const GeometryList& geometryList)
+    {
+        std::vector<TrianglePrimitive> triangles;
+        std::vector<int> materialIndices;
+        if (!flattenPrimitives(geometryList, _objectList, _objectListSize, triangles, materialIndices))
+        {
+            std::cout << "[INFO] Scene has non-triangle geometry, primitives are not flattened" << std::endl;
+            return;
+        }
+        _primitiveListSize = _objectListSize;
+        _primitiveTriangles = allocateResource<TrianglePrimitive>("primitive triangles", _primitiveListSize);
+        _primitiveMaterialIndices = allocateResource<int>("primitive materials", _primitiveListSize);
+        _myQueue.memcpy(_primitiveTriangles, triangles.data(), sizeof(TrianglePrimitive) * _primitiveListSize).wait();
+        _myQueue.memcpy(_primitiveMaterialIndices, materialIndices.data(), sizeof(int) * _primitiveListSize).wait();
+    }
 
-    ~ObjectListContent()
+    void addCompactBVH(const BVHArray& bvh, const BVHBuildConfig& bvhConfig)
     {
-        if (_objectList != nullptr)
+        BVHBuildConfig compactConfig = bvhConfig;
+        compactConfig._maxLeafSize = std::min(std::max(bvhConfig._maxLeafSize, 1), 65535);
+        std::vector<CompactBVHNode> nodes = compactBVH(bvh, compactConfig);
+        _compactBvhSize = nodes.size();
+        _compactBvhResource = allocateResource<CompactBVHNode>("compact BVH nodes", _compactBvhSize);
+        _myQueue.memcpy(_compactBvhResource, nodes.data(), sizeof(CompactBVHNode) * _compactBvhSize).wait();
+        std::cout << "[INFO] Compact BVH nodes: " << _compactBvhSize << " (" << sizeof(CompactBVHNode) * _compactBvhSize
+                  << " bytes, binary layout " << sizeof(BVHNode) * _bvhSize << " bytes)" << std::endl;
+    }
+
+    template <typename QuantType>
+    void addQuantizedBVH(const BVHArray& bvh, const BVHBuildConfig& bvhConfig, QuantizedBVHNode<QuantType>*& resource, size_t& size)
+    {
+        BVHBuildConfig compactConfig = bvhConfig;
+        compactConfig._maxLeafSize = std::min(std::max(bvhConfig._maxLeafSize, 1), 255);
+        std::vector<CompactBVHNode> compact = compactBVH(bvh, compactConfig);
+        std::vector<QuantizedBVHNode<QuantType>> nodes = quantizeBVH<QuantType>(compact);
+        if (!compact.empty())
         {
-            sycl::free(_objectList, _myQueue);
+            _quantizedRootBounds = compact[0]._bounds;
         }
+        size = nodes.size();
+        resource = allocateResource<QuantizedBVHNode<QuantType>>("quantized BVH nodes", size);
+        _myQueue.memcpy(resource, nodes.data(), sizeof(QuantizedBVHNode<QuantType>) * size).wait();
+        std::cout << "[INFO] Quantized BVH nodes: " << size << " (" << sizeof(QuantizedBVHNode<QuantType>) * size
+                  << " bytes, binary layout " << sizeof(BVHNode) * _bvhSize << " bytes)" << std::endl;
+    }
+
+    template <int Width>
+    void addBlockBVH(const BVHArray& bvh, const BVHBuildConfig& bvhConfig, const GeometryList& geometryList,
+                     TriangleBlock<Width>*& resource, size_t& size)
+    {
+        std::vector<TrianglePrimitive> triangles;
+        std::vector<int> materialIndices;
+        if (!flattenPrimitives(geometryList, _objectList, _objectListSize, triangles, materialIndices))
+        {
+            std::cout << "[INFO] Scene has non-triangle geometry, using the compact layout instead of triangle blocks" << std::endl;
+            _bvhLayout = BVHLayout::COMPACT;
+            addCompactBVH(bvh, bvhConfig);
+            return;
+        }
+
+        BVHBuildConfig compactConfig = bvhConfig;
+        compactConfig._maxLeafSize = std::min(std::max(bvhConfig._maxLeafSize, 1), 65535);
+        std::vector<CompactBVHNode> nodes;
+        std::vector<TriangleBlock<Width>> blocks;
+        blockBVH<Width>(compactBVH(bvh, compactConfig, Width), triangles, nodes, blocks);
+
+        _blockBvhSize = nodes.size();
+        _blockBvhResource = allocateResource<CompactBVHNode>("block BVH nodes", _blockBvhSize);
+        _myQueue.memcpy(_blockBvhResource, nodes.data(), sizeof(CompactBVHNode) * _blockBvhSize).wait();
+        size = blocks.size();
+        resource = allocateResource<TriangleBlock<Width>>("triangle blocks", size);
+        _myQueue.memcpy(resource, blocks.data(), sizeof(TriangleBlock<Width>) * size).wait();
+        std::cout << "[INFO] Block BVH nodes: " << _blockBvhSize << ", " << Width << "-wide triangle blocks: " << size
+                  << " (" << 100.0 * _objectListSize / (size * Width) << "% lanes used)" << std::endl;
+    }
 
-        if (_geometryList != nullptr)
+    template <int Width>
+    void addWideBVH(const BVHArray& bvh, WideBVHNode<Width>*& resource, size_t& size)
+    {
+        std::vector<WideBVHNode<Width>> nodes = collapseBVH<Width>(bvh);
+        int stackDepth = std::max(wideStackDepth<Width>(nodes), 1);
+        if (stackDepth > WideBVHArray<Width>::kStackSize)
         {
-            sycl::free(_geometryList, _myQueue);
+            std::cout << "[INFO] BVH" << Width << " traversal could need " << stackDepth << " stack entries, more than its "
+                      << WideBVHArray<Width>::kStackSize << "; using the binary layout" << std::endl;
+            _bvhLayout = BVHLayout::BINARY;
+            return;
         }
+        size = nodes.size();
+        resource = allocateResource<WideBVHNode<Width>>("wide BVH nodes", size);
+        _myQueue.memcpy(resource, nodes.data(), sizeof(WideBVHNode<Width>) * size).wait();
+        std::cout << "[INFO] BVH" << Width << " nodes: " << size << " (" << sizeof(WideBVHNode<Width>) * size << " bytes)" << std::endl;
+
+    }
 
-        if (_triangleList != nullptr)
+    // DEVICE placement: every array is copied to device memory in one batch,
+    // the arena as a single block, the shared copies are freed and the pointer tables are rebuilt on the
+    // device. Afterwards the host can no longer read the scene, so the
+    // pack writer, updateTriangles and setInstanceTransform refuse to run.
+    void toDevice() {
+        if (_placement == ScenePlacement::DEVICE)
         {
-            sycl::free(_triangleList, _myQueue);
+            return;
         }
+        auto uploadStart = std::chrono::high_resolution_clock::now();
+        std::vector<void*> sharedResources;
+        forEachResource(*this, [&](auto*& resource, size_t count) {
+            if (!_arena.contains(resource))
+            {
+                moveToDevice(resource, count, sharedResources);
+            }
+        });
 
-        if (_materialList != nullptr)
+        // the arena moves as one copy, pointers into it keep their offsets
+        if (void* sharedArena = _arena.moveToDevice())
         {
-            sycl::free(_materialList, _myQueue);
+            forEachResource(*this, [&](auto*& resource, size_t) {
+                _arena.rebase(resource, sharedArena);
+            });
+            _arena.rebase(_geometryList, sharedArena);
+            _arena.rebase(_materialList, sharedArena);
+            sharedResources.push_back(sharedArena);
+        }
+
+        // the pointer tables only hold addresses, they are rebuilt instead of copied
+        if (_geometryList && _geometryListSize > 0 && !_arena.contains(_geometryList)) {
+            sharedResources.push_back(_geometryList);
+            _geometryList = sycl::malloc_device<Geometry*>(_geometryListSize, _myQueue);
+        }
+        if (_materialList && _materialListSize > 0 && !_arena.contains(_materialList)) {
+            sharedResources.push_back(_materialList);
+            _materialList = sycl::malloc_device<Material*>(_materialListSize, _myQueue);
         }
+        _myQueue.wait();
+        linkPointerTables();
 
-        if (_diffuseMaterialList != nullptr)
+        for (void* resource : sharedResources)
         {
-            sycl::free(_diffuseMaterialList, _myQueue);
+            sycl::free(resource, _myQueue);
         }
+        _placement = ScenePlacement::DEVICE;
+        auto uploadEnd = std::chrono::high_resolution_clock::now();
+        std::cout << "[INFO] Scene moved to device memory in "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(uploadEnd - uploadStart).count() / 1000.0
+                  << " ms" << std::endl;
+        reportMemory();
+    }
 
-        if (_bvhResource != nullptr)
+    // Copies the finished scene into target, whose queue may belong to another
+    // device and context. Every array is staged through the host into its own
+    // shared allocation there and the pointer tables are linked anew; call
+    // toDevice() on the copy for device placement.
+    void copyTo(ObjectListContent& target) const
+    {
+        auto copyStart = std::chrono::high_resolution_clock::now();
+        std::vector<std::pair<const void*, size_t>> sources;
+        forEachResource(*this, [&](const auto* resource, size_t count) {
+            sources.push_back({resource, count});
+        });
+        size_t k = 0;
+        forEachResource(target, [&](auto*& resource, size_t& count) {
+            using T = std::remove_reference_t<decltype(*resource)>;
+            const T* source = static_cast<const T*>(sources[k].first);
+            count = sources[k++].second;
+            resource = nullptr;
+            if (source != nullptr && count > 0)
+            {
+                std::vector<T> staging(count);
+                _myQueue.memcpy(staging.data(), source, sizeof(T) * count).wait();
+                resource = target.allocateResource<T>("copied array", count);
+                target._myQueue.memcpy(resource, staging.data(), sizeof(T) * count).wait();
+            }
+        });
+
+        target._geometryListSize = _geometryListSize;
+        target._geometryList = _geometryListSize > 0 ? target.allocateResource<Geometry*>("geometry pointers", _geometryListSize) : nullptr;
+        target._materialListSize = _materialListSize;
+        target._materialList = _materialListSize > 0 ? target.allocateResource<Material*>("material pointers", _materialListSize) : nullptr;
+        target._globalGeometryIndex = _globalGeometryIndex;
+        target._gloablMaterialIndex = _gloablMaterialIndex;
+        target._bvhLayout = _bvhLayout;
+        target._quantizedRootBounds = _quantizedRootBounds;
+        target._bvhConfig = _bvhConfig;
+        target._builtSAHCost = _builtSAHCost;
+        target.linkPointerTables();
+        target._myQueue.wait();
+
+        auto copyEnd = std::chrono::high_resolution_clock::now();
+        std::cout << "[INFO] Scene copied in "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(copyEnd - copyStart).count() / 1000.0
+                  << " ms" << std::endl;
+    }
+
+    // Queues the copy of a shared array into device memory; the shared array
+    // is freed by the caller once the queue has drained.
+    template <typename T>
+    void moveToDevice(T*& resource, size_t size, std::vector<void*>& sharedResources)
+    {
+        if (resource && size > 0) {
+            T* device_ptr = sycl::malloc_device<T>(size, _myQueue);
+            _myQueue.memcpy(device_ptr, resource, sizeof(T) * size);
+            sharedResources.push_back(resource);
+            resource = device_ptr;
+        }
+    }
+
+    void requireSharedPlacement(const char* operation) const
+    {
+        if (_placement != ScenePlacement::SHARED)
         {
-            sycl::free(_bvhResource, _myQueue);
+            throw std::runtime_error(std::string(operation) + " needs the scene in shared memory, call it before toDevice()");
         }
     }
 
 
+    // Moves the vertices of the loaded triangles (same count and order as in
+    // addObject) and refits the BVH bottom-up. Once the refitted SAH cost has
+    // grown past _refitRebuildThreshold the tree is rebuilt instead.
+    // Only valid while the scene is still in shared memory, before toDevice().
+    // Returns true when the BVH was rebuilt.
+    bool updateTriangles(std::vector<Triangle>& tris)
+    {
+        if (tris.size() != _triangleListSize)
+        {
+            throw std::runtime_error("updateTriangles expects the triangle count of the loaded scene");
+        }
+        requireSharedPlacement("updateTriangles");
+        _myQueue.memcpy(_triangleList, tris.data(), sizeof(Triangle) * _triangleListSize).wait();
+
+        GeometryList Tem_geometryList;
+        Tem_geometryList.setTriangles(this->_triangleList, this->_triangleListSize);
+        Tem_geometryList.setGeometryList(this->_geometryList, this->_geometryListSize);
+
+        BVHArray bvh;
+        bvh.setBVHArray(this->_bvhSize, this->_bvhResource);
+        auto refitStart = std::chrono::high_resolution_clock::now();
+        bvh.refit(Tem_geometryList, _objectList);
+        auto refitEnd = std::chrono::high_resolution_clock::now();
+        myComputeType cost = bvh.computeSAHCost(_bvhConfig);
+        std::cout << "[INFO] BVH refit time: "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(refitEnd - refitStart).count() / 1000.0
+                  << " ms, SAH cost " << cost << " (built " << _builtSAHCost << ")" << std::endl;
+
+        releaseDerivedLayouts();
+        if (cost > _builtSAHCost * (1 + _bvhConfig._refitRebuildThreshold))
+        {
+            std::cout << "[INFO] SAH cost degraded past the threshold, rebuilding the BVH" << std::endl;
+            releaseResource(_bvhResource, _bvhSize);
+            removeSplitCopies();
+            buildBVH(_bvhConfig);
+            return true;
+        }
+        addDerivedLayouts(bvh, _bvhConfig, Tem_geometryList);
+        return false;
+    }
+
+    // A rebuild starts from the original objects, not the SBVH references.
+    void removeSplitCopies()
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < _objectListSize; i++)
+        {
+            if (!_objectList[i]._splitCopy)
+            {
+                _objectList[count++] = _objectList[i];
+            }
+        }
+        _objectListSize = count;
+    }
+
+    template <typename T>
+    void releaseResource(T*& resource, size_t& size)
+    {
+        freeResource(resource);
+        resource = nullptr;
+        size = 0;
+    }
+
+    void releaseDerivedLayouts()
+    {
+        releaseResource(_bvh4Resource, _bvh4Size);
+        releaseResource(_bvh8Resource, _bvh8Size);
+        releaseResource(_compactBvhResource, _compactBvhSize);
+        releaseResource(_quantized8BvhResource, _quantized8BvhSize);
+        releaseResource(_quantized16BvhResource, _quantized16BvhSize);
+        releaseResource(_blockBvhResource, _blockBvhSize);
+        releaseResource(_triangleBlock8Resource, _triangleBlock8Size);
+        size_t primitiveListSize = _primitiveListSize;
+        releaseResource(_primitiveTriangles, primitiveListSize);
+        releaseResource(_primitiveMaterialIndices, _primitiveListSize);
+    }
+
+    void releaseBVH()
+    {
+        releaseResource(_bvhResource, _bvhSize);
+        releaseDerivedLayouts();
+    }
+
+    void releaseInstances()
+    {
+        releaseResource(_topBvhResource, _topBvhSize);
+        releaseResource(_instanceResource, _instanceCount);
+        releaseResource(_meshResource, _meshCount);
+        releaseResource(_meshBvhResource, _meshBvhSize);
+        size_t meshTriangleSize = _meshTriangleSize;
+        releaseResource(_meshTriangleResource, meshTriangleSize);
+        releaseResource(_meshMaterialIndices, _meshTriangleSize);
+    }
+
+    ~ObjectListContent()
+    {
+        freeResource(_objectList);
+        freeResource(_geometryList);
+        freeResource(_triangleList);
+        freeResource(_indexedTriangleList);
+        freeResource(_vertexList);
+        freeResource(_boxList);
+        freeResource(_quadList);
+        freeResource(_sphereList);
+        freeResource(_materialList);
+        freeResource(_diffuseMaterialList);
+        releaseBVH();
+        releaseInstances();
+    }
+
+
     
 
 };
@@ -236,6 +1083,15 @@ class ObjectList
     Object* _objectList = nullptr;
     size_t _objectListSize = 0;
     BVHArray _bvh;
+    BVHLayout _bvhLayout = BVHLayout::BINARY;
+    WideBVHArray<4> _bvh4;
+    WideBVHArray<8> _bvh8;
+    CompactBVHArray _compactBvh;
+    QuantizedBVHArray<uint8_t> _quantized8Bvh;
+    QuantizedBVHArray<uint16_t> _quantized16Bvh;
+    BlockBVHArray<8> _blockBvh8;
+    PrimitiveList _primitiveList;
+    InstanceBVH _instanceBvh;
 
     public:
         inline size_t getObjectsListSize() const{return _objectListSize;}
@@ -254,6 +1110,17 @@ class ObjectList
             _materialList.setDiffuseList(content._diffuseMaterialList, content._diffuseMaterialListSize);            
             _materialList.setMaterialList(content._materialList, content._materialListSize);
             _bvh.setBVHArray(content._bvhSize, content._bvhResource);
+            _bvhLayout = content._bvhLayout;
+            _bvh4.setWideBVHArray(content._bvh4Size, content._bvh4Resource);
+            _bvh8.setWideBVHArray(content._bvh8Size, content._bvh8Resource);
+            _compactBvh.setCompactBVHArray(content._compactBvhSize, content._compactBvhResource);
+            _quantized8Bvh.setQuantizedBVHArray(content._quantized8BvhSize, content._quantized8BvhResource, content._quantizedRootBounds);
+            _quantized16Bvh.setQuantizedBVHArray(content._quantized16BvhSize, content._quantized16BvhResource, content._quantizedRootBounds);
+            _blockBvh8.setBlockBVHArray(content._blockBvhSize, content._blockBvhResource, content._triangleBlock8Resource);
+            _primitiveList.setPrimitives(content._primitiveListSize, content._primitiveTriangles, content._primitiveMaterialIndices);
+            _instanceBvh.setInstanceBVH(content._topBvhSize, content._topBvhResource, content._instanceCount, content._instanceResource,
+                                        content._meshResource, content._meshBvhResource, content._meshTriangleResource,
+                                        content._meshMaterialIndices);
             // _bvh.buildTree(_geometryList,_objectList, 0, _objectListSize - 1);
         }
 
@@ -264,6 +1131,15 @@ class ObjectList
             _geometryList = other._geometryList;
             _materialList = other._materialList;
             _bvh = other._bvh;
+            _bvhLayout = other._bvhLayout;
+            _bvh4 = other._bvh4;
+            _bvh8 = other._bvh8;
+            _compactBvh = other._compactBvh;
+            _quantized8Bvh = other._quantized8Bvh;
+            _quantized16Bvh = other._quantized16Bvh;
+            _blockBvh8 = other._blockBvh8;
+            _primitiveList = other._primitiveList;
+            _instanceBvh = other._instanceBvh;
         }
 
         ObjectList& operator=(const ObjectList& other)
@@ -273,6 +1149,15 @@ class ObjectList
             _geometryList = other._geometryList;
             _materialList = other._materialList;
             _bvh = other._bvh;
+            _bvhLayout = other._bvhLayout;
+            _bvh4 = other._bvh4;
+            _bvh8 = other._bvh8;
+            _compactBvh = other._compactBvh;
+            _quantized8Bvh = other._quantized8Bvh;
+            _quantized16Bvh = other._quantized16Bvh;
+            _blockBvh8 = other._blockBvh8;
+            _primitiveList = other._primitiveList;
+            _instanceBvh = other._instanceBvh;
             return *this;
         }
 
@@ -295,6 +1180,12 @@ class ObjectList
             {
                 return Intersection();
             }
+            if (_primitiveList.isFlat())
+            {
+                Intersection intersection = _primitiveList.getIntersection(ray, index);
+                intersection._objectIndex = index;
+                return intersection;
+            }
             Object _object = _objectList[index];
             auto _geometry = _geometryList.getGeometry(_object._geometryIndex);
             auto intersection = _geometry->getIntersection(ray);
@@ -303,12 +1194,22 @@ class ObjectList
             return intersection;
         }
 
+        // copies made by spatial splits must not count twice when sampling lights
+        inline bool isSplitCopy(long index) const
+        {
+            return !_instanceBvh.isActive() && _objectList[index]._splitCopy;
+        }
+
         myComputeType getArea(long index) const
         {
             if (index < 0)
             {
                 return 0;
             }
+            if (_instanceBvh.isActive())
+            {
+                return _instanceBvh.getArea(index);
+            }
             Object _object = _objectList[index];
             auto _geometry = _geometryList.getGeometry(_object._geometryIndex);
             return _geometry->getArea();
@@ -318,6 +1219,10 @@ class ObjectList
 
         SamplingRecord Sample(RNG &rng, size_t index) const
         {
+            if (_instanceBvh.isActive())
+            {
+                return _instanceBvh.Sample(rng, index);
+            }
             Object _object = _objectList[index];
             Geometry* _geometry = _geometryList.getGeometry(_object._geometryIndex);
             SamplingRecord record = _geometry->Sample(rng);
@@ -335,6 +1240,14 @@ class ObjectList
             {
                 return nullptr;
             }
+            if (_instanceBvh.isActive())
+            {
+                return _materialList.getMaterial(_instanceBvh.getMaterialIndex(index));
+            }
+            if (_primitiveList.isFlat())
+            {
+                return _materialList.getMaterial(_primitiveList.getMaterialIndex(index));
+            }
             Object _object = _objectList[index];
             return _materialList.getMaterial(_object._materialIndex);
             //return _materialList.getMaterial(_materialIndexArray[index]);
@@ -343,7 +1256,29 @@ class ObjectList
 
         Intersection Intersect(const Ray &ray) const 
         {
-            return _bvh.Intersect(ray, this);
+            if (_instanceBvh.isActive())
+            {
+                return _instanceBvh.Intersect(ray);
+            }
+            switch (_bvhLayout)
+            {
+            case BVHLayout::WIDE4:
+                return _bvh4.Intersect(ray, this);
+            case BVHLayout::WIDE8:
+                return _bvh8.Intersect(ray, this);
+            case BVHLayout::COMPACT:
+                return _compactBvh.Intersect(ray, this);
+            case BVHLayout::QUANTIZED8:
+                return _quantized8Bvh.Intersect(ray, this);
+            case BVHLayout::QUANTIZED16:
+                return _quantized16Bvh.Intersect(ray, this);
+            case BVHLayout::BLOCK8:
+                return _blockBvh8.Intersect(ray);
+            case BVHLayout::BINARY_UNORDERED:
+                return _bvh.IntersectUnordered(ray, this);
+            default:
+                return _bvh.Intersect(ray, this);
+            }
         }
 
 
@@ -353,82 +1288,430 @@ class ObjectList
 };
 
 
-Bounds3 getBounds(const GeometryList& _geometryList, Object* _objectList,size_t index)
+inline Bounds3 getBounds(const GeometryList& _geometryList, const Object* _objectList,size_t index)
 {
     Object _object = _objectList[index];
     Geometry* _geometry = _geometryList.getGeometry(_object._geometryIndex);
     return _geometry->getBounds();
 }
 
-void spacePartitioning(const GeometryList& _geometryList, Object* _objectList, long left, long right)
+inline void computeRangeBounds(const BVHBuildPrimitive* primitives, long left, long right, int chunkCount,
+                        Bounds3& bounds, Bounds3& centroidBounds)
 {
-    Bounds3 centroidBounds;
-    for (int i = left; i <= right; i++)
+    std::vector<Bounds3> chunkBounds(chunkCount);
+    std::vector<Bounds3> chunkCentroidBounds(chunkCount);
+    parallelChunks(left, right + 1, chunkCount, [&](int chunk, long begin, long end) {
+        for (long i = begin; i < end; i++)
+        {
+            chunkBounds[chunk] = Union(chunkBounds[chunk], primitives[i]._bounds);
+            chunkCentroidBounds[chunk] = Union(chunkCentroidBounds[chunk], primitives[i]._centroid);
+        }
+    });
+
+    for (int chunk = 0; chunk < chunkCount; chunk++)
     {
-        auto _geometry = _geometryList.getGeometry(_objectList[i]._geometryIndex);
-        centroidBounds = Union(centroidBounds, _geometry->getBounds().Centroid());
+        bounds = Union(bounds, chunkBounds[chunk]);
+        centroidBounds = Union(centroidBounds, chunkCentroidBounds[chunk]);
     }
+}
+
+
+// Stable two-pass partition: every chunk counts its left-side primitives,
+// then scatters into a scratch copy at its prefix offset. The serial path is
+// stable as well, so the tree does not depend on the thread count.
+// Returns the index of the first primitive of the right side.
+template <typename Predicate>
+long parallelPartition(BVHBuildPrimitive* primitives, long left, long right, int chunkCount, Predicate predicate)
+{
+    if (chunkCount <= 1)
+    {
+        return static_cast<long>(std::stable_partition(primitives + left, primitives + right + 1, predicate) - primitives);
+    }
+
+    std::vector<long> chunkBegin(chunkCount);
+    std::vector<long> chunkEnd(chunkCount);
+    std::vector<long> chunkLeftCount(chunkCount, 0);
+    parallelChunks(left, right + 1, chunkCount, [&](int chunk, long begin, long end) {
+        chunkBegin[chunk] = begin;
+        chunkEnd[chunk] = end;
+        for (long i = begin; i < end; i++)
+        {
+            if (predicate(primitives[i]))
+            {
+                chunkLeftCount[chunk]++;
+            }
+        }
+    });
+
+    long totalLeft = 0;
+    std::vector<long> leftOffset(chunkCount);
+    for (int chunk = 0; chunk < chunkCount; chunk++)
+    {
+        leftOffset[chunk] = totalLeft;
+        totalLeft += chunkLeftCount[chunk];
+    }
+    std::vector<long> rightOffset(chunkCount);
+    long rightStart = totalLeft;
+    for (int chunk = 0; chunk < chunkCount; chunk++)
+    {
+        rightOffset[chunk] = rightStart;
+        rightStart += (chunkEnd[chunk] - chunkBegin[chunk]) - chunkLeftCount[chunk];
+    }
+
+    std::vector<BVHBuildPrimitive> scratch(right - left + 1);
+    parallelChunks(left, right + 1, chunkCount, [&](int chunk, long begin, long end) {
+        long leftSlot = leftOffset[chunk];
+        long rightSlot = rightOffset[chunk];
+        for (long i = begin; i < end; i++)
+        {
+            if (predicate(primitives[i]))
+            {
+                scratch[leftSlot++] = primitives[i];
+            }
+            else
+            {
+                scratch[rightSlot++] = primitives[i];
+            }
+        }
+    });
+
+    parallelChunks(left, right + 1, chunkCount, [&](int chunk, long begin, long end) {
+        std::copy(scratch.begin() + (begin - left), scratch.begin() + (end - left), primitives + begin);
+    });
+
+    return left + totalLeft;
+}
+
+
+inline long middlePartitioning(BVHBuildPrimitive* primitives, long left, long right, int chunkCount = 1)
+{
+    Bounds3 bounds;
+    Bounds3 centroidBounds;
+    computeRangeBounds(primitives, left, right, chunkCount, bounds, centroidBounds);
     int dim = centroidBounds.maxExtent();
+    long mid = (left + right) / 2;
 
-    std::sort(_objectList + left, _objectList + right + 1,
-              [&_geometryList, dim](const Object& obja, const Object& objb) {
-                  return spaceCompare(_geometryList, obja, objb, dim);
+    // only the median has to be in place, both halves stay unsorted
+    std::nth_element(primitives + left, primitives + mid, primitives + right + 1,
+              [dim](const BVHBuildPrimitive& a, const BVHBuildPrimitive& b) {
+                  return a._centroid[dim] < b._centroid[dim];
               });
+    return mid;
+}
+
+
+inline int sahBinIndex(const Vec3& centroid, const Bounds3& centroidBounds, int dim, int binCount)
+{
+    myComputeType extent = centroidBounds.pMax[dim] - centroidBounds.pMin[dim];
+    int bin = static_cast<int>(binCount * ((centroid[dim] - centroidBounds.pMin[dim]) / extent));
+    return std::min(std::max(bin, 0), binCount - 1);
 }
 
 
-long BVHArray::buildTree(const GeometryList& _geometryList, Object* _objectList, int left, int right)
+// Binned SAH split: every axis is cut into _binCount buckets over the centroid
+// bounds and the cheapest bucket boundary is chosen, the range is then
+// partitioned in place. Returns the last index of the left child.
+inline long sahPartitioning(BVHBuildPrimitive* primitives, long left, long right, const BVHBuildConfig& config, int chunkCount = 1)
 {
+    Bounds3 bounds;
+    Bounds3 centroidBounds;
+    computeRangeBounds(primitives, left, right, chunkCount, bounds, centroidBounds);
+
+    // bins of all three axes are filled in one pass, indexed [chunk][dim][bin]
+    int binCount = std::max(config._binCount, 2);
+    int binsPerChunk = 3 * binCount;
+    std::vector<Bounds3> binBounds(chunkCount * binsPerChunk);
+    std::vector<long> binObjectCount(chunkCount * binsPerChunk, 0);
+    parallelChunks(left, right + 1, chunkCount, [&](int chunk, long begin, long end) {
+        Bounds3* chunkBins = &binBounds[chunk * binsPerChunk];
+        long* chunkCounts = &binObjectCount[chunk * binsPerChunk];
+        for (long i = begin; i < end; i++)
+        {
+            for (int dim = 0; dim < 3; dim++)
+            {
+                if (centroidBounds.pMax[dim] - centroidBounds.pMin[dim] <= 0)
+                {
+                    continue;
+                }
+                int bin = dim * binCount + sahBinIndex(primitives[i]._centroid, centroidBounds, dim, binCount);
+                chunkBins[bin] = Union(chunkBins[bin], primitives[i]._bounds);
+                chunkCounts[bin]++;
+            }
+        }
+    });
+    for (int chunk = 1; chunk < chunkCount; chunk++)
+    {
+        for (int bin = 0; bin < binsPerChunk; bin++)
+        {
+            binBounds[bin] = Union(binBounds[bin], binBounds[chunk * binsPerChunk + bin]);
+            binObjectCount[bin] += binObjectCount[chunk * binsPerChunk + bin];
+        }
+    }
+
+    myComputeType nodeArea = bounds.SurfaceArea();
+    if (nodeArea <= 0)
+    {
+        nodeArea = 1;
+    }
 
-    static long index = 0;
+    myComputeType bestCost = std::numeric_limits<myComputeType>::max();
+    int bestDim = -1;
+    int bestSplit = -1;
+    std::vector<myComputeType> leftCost(binCount - 1);
 
-    if(!haveNode(index))
+    for (int dim = 0; dim < 3; dim++)
+    {
+        if (centroidBounds.pMax[dim] - centroidBounds.pMin[dim] <= 0)
+        {
+            continue;
+        }
+        const Bounds3* dimBounds = &binBounds[dim * binCount];
+        const long* dimCounts = &binObjectCount[dim * binCount];
+
+        // sweep from the left, leftCost[k] covers the bins 0..k
+        Bounds3 sweepBounds;
+        long sweepCount = 0;
+        for (int k = 0; k < binCount - 1; k++)
+        {
+            sweepBounds = Union(sweepBounds, dimBounds[k]);
+            sweepCount += dimCounts[k];
+            leftCost[k] = sweepCount > 0 ? sweepBounds.SurfaceArea() * sweepCount : 0;
+        }
+
+        // sweep from the right and evaluate the split after bin k
+        sweepBounds = Bounds3();
+        sweepCount = 0;
+        for (int k = binCount - 1; k > 0; k--)
+        {
+            sweepBounds = Union(sweepBounds, dimBounds[k]);
+            sweepCount += dimCounts[k];
+            long leftCount = (right - left + 1) - sweepCount;
+            if (sweepCount == 0 || leftCount == 0)
+            {
+                continue;
+            }
+            myComputeType cost = config._traversalCost
+                + config._leafCost * (leftCost[k - 1] + sweepBounds.SurfaceArea() * sweepCount) / nodeArea;
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestDim = dim;
+                bestSplit = k - 1;
+            }
+        }
+    }
+
+    // all centroids coincide, any split is as good as another
+    if (bestDim < 0)
+    {
+        return middlePartitioning(primitives, left, right);
+    }
+
+    long mid = parallelPartition(primitives, left, right, chunkCount,
+              [&centroidBounds, bestDim, bestSplit, binCount](const BVHBuildPrimitive& primitive) {
+                  return sahBinIndex(primitive._centroid, centroidBounds, bestDim, binCount) <= bestSplit;
+              }) - 1;
+
+    if (mid < left || mid >= right)
+    {
+        return middlePartitioning(primitives, left, right);
+    }
+    return mid;
+}
+
+
+inline long BVHArray::buildTree(const GeometryList& _geometryList, Object* _objectList, int left, int right, const BVHBuildConfig& config)
+{
+    int threadCount = hostThreadCount(config._threadCount);
+    int chunkCount = hostChunkCount(right - left + 1, threadCount);
+
+    // bounds and centroids are computed once instead of at every level
+    std::vector<BVHBuildPrimitive> primitives(right + 1);
+    parallelChunks(left, right + 1, chunkCount, [&](int chunk, long begin, long end) {
+        for (long i = begin; i < end; i++)
+        {
+            primitives[i]._bounds = getBounds(_geometryList, _objectList, i);
+            primitives[i]._centroid = primitives[i]._bounds.Centroid();
+            primitives[i]._objectIndex = i;
+        }
+    });
+
+    long rootIndex = buildRecursive(primitives.data(), 0, left, right, config, threadCount, 0);
+
+    // leaves refer to object slots, so the objects follow the primitive order
+    std::vector<Object> objects(_objectList + left, _objectList + right + 1);
+    parallelChunks(left, right + 1, chunkCount, [&](int chunk, long begin, long end) {
+        for (long i = begin; i < end; i++)
+        {
+            _objectList[i] = objects[primitives[i]._objectIndex - left];
+        }
+    });
+
+    return rootIndex;
+}
+
+
+// Same build over bounds computed by the caller, used for the two-level BVH.
+// On return the primitives are in leaf order: leaf slot k holds primitives[k].
+inline long BVHArray::buildTree(std::vector<BVHBuildPrimitive>& primitives, const BVHBuildConfig& config)
+{
+    if (primitives.empty())
+    {
+        return -1;
+    }
+    int threadCount = hostThreadCount(config._threadCount);
+    return buildRecursive(primitives.data(), 0, 0, static_cast<long>(primitives.size()) - 1, config, threadCount, 0);
+}
+
+
+// A subtree over n objects always takes 2n - 1 nodes, so children are placed
+// depth first without a shared counter: the left child follows its parent and
+// the right child follows the whole left subtree. Subtrees of at least
+// _parallelThreshold objects are built as two tasks sharing threadCount.
+// Close to kMaxBVHDepth the split falls back to the median.
+inline long BVHArray::buildRecursive(BVHBuildPrimitive* primitives, long nodeIndex, long left, long right, const BVHBuildConfig& config, int threadCount, int depth)
+{
+    if(!haveNode(nodeIndex))
     {
-        std::cout << index << std::endl;
-        std::cout << left << "  " << right << std::endl;
         return -1;
     }
-    
-    long curIndex = index;
-    index = index + 1;
-    
     
     if (left == right)
     {
-        _array[curIndex]._objectIndex = left;
-        _array[curIndex]._bounds = getBounds(_geometryList,_objectList,left);
-        return curIndex;
+        _array[nodeIndex]._objectIndex = left;
+        _array[nodeIndex]._bounds = primitives[left]._bounds;
+        return nodeIndex;
     }
-    else if (left + 1 == right)
+
+    bool parallel = threadCount > 1 && (right - left + 1) >= config._parallelThreshold;
+    int chunkCount = parallel ? hostChunkCount(right - left + 1, threadCount) : 1;
+
+    long mid = left;
+    if (left + 1 != right)
     {
-        long leftIndex = buildTree(_geometryList, _objectList, left, left);
-        long rightIndex = buildTree(_geometryList, _objectList, right, right);
-        _array[curIndex]._leftIndex = leftIndex; 
-        _array[curIndex]._rightIndex = rightIndex;
-        
-        _array[curIndex]._bounds = Union(_array[leftIndex]._bounds, _array[rightIndex]._bounds);
-        return curIndex;
+        switch (bvhDepthBudgetSpent(depth, right - left + 1) ? BVHBuildMethod::MIDDLE : config._method)
+        {
+        case BVHBuildMethod::SAH:
+            mid = sahPartitioning(primitives, left, right, config, chunkCount);
+            break;
+        default:
+            mid = middlePartitioning(primitives, left, right, chunkCount);
+            break;
+        }
+    }
+
+    long leftIndex = nodeIndex + 1;
+    long rightIndex = nodeIndex + 2 * (mid - left + 1);
+
+    if (parallel)
+    {
+        int leftThreads = threadCount / 2;
+        auto leftTask = std::async(std::launch::async, [&]() {
+            return buildRecursive(primitives, leftIndex, left, mid, config, leftThreads, depth + 1);
+        });
+        buildRecursive(primitives, rightIndex, mid + 1, right, config, threadCount - leftThreads, depth + 1);
+        leftTask.get();
+    }
+    else
+    {
+        buildRecursive(primitives, leftIndex, left, mid, config, 1, depth + 1);
+        buildRecursive(primitives, rightIndex, mid + 1, right, config, 1, depth + 1);
     }
-    spacePartitioning(_geometryList, _objectList,left, right);
-    long mid = (left + right) / 2;
-    
 
-    long leftIndex = buildTree(_geometryList, _objectList,  left, mid);
-    long rightIndex = buildTree(_geometryList, _objectList, mid + 1, right); 
-    _array[curIndex]._leftIndex = leftIndex;
-    _array[curIndex]._rightIndex = rightIndex;
+    _array[nodeIndex]._leftIndex = leftIndex;
+    _array[nodeIndex]._rightIndex = rightIndex;
 
-    //std::cout << "The left index is " << leftIndex << "  The right index is " << rightIndex << std::endl;
     if(haveNode(leftIndex) && haveNode(rightIndex))
     {
-         _array[curIndex]._bounds = Union(_array[leftIndex]._bounds, _array[rightIndex]._bounds);
+         _array[nodeIndex]._bounds = Union(_array[leftIndex]._bounds, _array[rightIndex]._bounds);
     }
    
-    return curIndex;
+    return nodeIndex;
 }
 
 
-Intersection BVHArray::Intersect(const Ray& ray, const ObjectList* objects) const
+// Expected cost of a random ray against the tree, relative to the root box.
+inline myComputeType BVHArray::computeSAHCost(const BVHBuildConfig& config) const
+{
+    if (!haveNode(0))
+    {
+        return 0;
+    }
+
+    myComputeType rootArea = _array[0]._bounds.SurfaceArea();
+    if (rootArea <= 0)
+    {
+        return 0;
+    }
+
+    myComputeType cost = 0;
+    for (long i = 0; i < _arraySize; i++)
+    {
+        const BVHNode& node = _array[i];
+        if (node._objectIndex >= 0)
+        {
+            cost += config._leafCost * node._bounds.SurfaceArea() / rootArea;
+        }
+        else if (haveNode(node._leftIndex) || haveNode(node._rightIndex))
+        {
+            cost += config._traversalCost * node._bounds.SurfaceArea() / rootArea;
+        }
+    }
+    return cost;
+}
+
+
+// Deepest leaf below the root, which is at depth 0.
+inline int BVHArray::depth() const
+{
+    if (!haveNode(0))
+    {
+        return 0;
+    }
+
+    int deepest = 0;
+    std::vector<std::pair<long, int>> pending = {{0, 0}};
+    while (!pending.empty())
+    {
+        auto [index, level] = pending.back();
+        pending.pop_back();
+        deepest = std::max(deepest, level);
+        const BVHNode& node = _array[index];
+        if (node._objectIndex < 0)
+        {
+            if (haveNode(node._leftIndex)) pending.push_back({node._leftIndex, level + 1});
+            if (haveNode(node._rightIndex)) pending.push_back({node._rightIndex, level + 1});
+        }
+    }
+    return deepest;
+}
+
+
+// Post-order pass from the root: leaves take the current geometry bounds and
+// every inner node the union of its children. The topology is unchanged.
+inline void BVHArray::refit(const GeometryList& _geometryList, const Object* _objectList)
+{
+    if (haveNode(0))
+    {
+        refitNode(0, _geometryList, _objectList);
+    }
+}
+
+inline void BVHArray::refitNode(long index, const GeometryList& _geometryList, const Object* _objectList)
+{
+    BVHNode& node = _array[index];
+    if (node._objectIndex >= 0)
+    {
+        node._bounds = getBounds(_geometryList, _objectList, node._objectIndex);
+        return;
+    }
+    refitNode(node._leftIndex, _geometryList, _objectList);
+    refitNode(node._rightIndex, _geometryList, _objectList);
+    node._bounds = Union(_array[node._leftIndex]._bounds, _array[node._rightIndex]._bounds);
+}
+
+
+inline Intersection BVHArray::Intersect(const Ray& ray, const ObjectList* objects) const
 {
     Intersection inter;
     if (_array == nullptr) return inter;
@@ -436,13 +1719,23 @@ Intersection BVHArray::Intersect(const Ray& ray, const ObjectList* objects) cons
     return inter;
 }
 
+inline Intersection BVHArray::IntersectUnordered(const Ray& ray, const ObjectList* objects) const
+{
+    Intersection inter;
+    if (_array == nullptr) return inter;
+    inter = getIntersectionUnordered(0, ray, objects);
+    return inter;
+}
+
 
 
 
-Intersection BVHArray::getIntersection(const long index, const Ray &ray,
-                                       const ObjectList *objects) const {
+// Closest-hit traversal: the ray interval shrinks with every accepted hit,
+// boxes entered beyond the closest hit are skipped and the nearer child is
+// visited first. Children are box-tested before they are pushed.
+inline Intersection BVHArray::getIntersection(const long index, const Ray &ray,
+                                              const ObjectList *objects) const {
 
- const float EPSILON = 1e-6f;  // Minimum valid ray distance
   if (!haveNode(index))
     return Intersection();
 
@@ -450,44 +1743,337 @@ Intersection BVHArray::getIntersection(const long index, const Ray &ray,
   inter._hit = false;
   inter._distance = INFINITY;
 
-  BVHNode *stack[50] = {&(_array[index])};
+  Vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+  std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+
+  myComputeType rootEnter;
+  if (!testIntersection(&_array[index], ray, invDir, dirIsNeg, inter._distance, rootEnter)) {
+    return inter;
+  }
+
+  long stack[kStackSize] = {index};
+  myComputeType stackEnter[kStackSize] = {rootEnter};
   int stackCount = 1;
 
   while (stackCount != 0) {
     stackCount--;
-    BVHNode *curNode = stack[stackCount];
+    // a closer hit may have been found since this node was pushed
+    if (stackEnter[stackCount] > inter._distance) {
+      continue;
+    }
+    const BVHNode *curNode = &_array[stack[stackCount]];
+
+    // leaf node
+    if (curNode->_objectIndex >= 0) {
+      Intersection tmp = objects->getIntersection(ray, curNode->_objectIndex);
+      if (tmp._hit && tmp._distance < inter._distance) {
+        inter = tmp;
+      }
+      continue;
+    }
+
     long curLeft = curNode->_leftIndex;
     long curRight = curNode->_rightIndex;
+    myComputeType leftEnter, rightEnter;
+    bool hitLeft = haveNode(curLeft) && testIntersection(&_array[curLeft], ray, invDir, dirIsNeg, inter._distance, leftEnter);
+    bool hitRight = haveNode(curRight) && testIntersection(&_array[curRight], ray, invDir, dirIsNeg, inter._distance, rightEnter);
+
+    // the builders keep every leaf within kMaxBVHDepth, so both children fit
+    assert(stackCount + 2 <= kStackSize);
+    if (hitLeft && hitRight) {
+      // far child goes first so the near child is popped next
+      bool leftIsNear = leftEnter <= rightEnter;
+      stack[stackCount] = leftIsNear ? curRight : curLeft;
+      stackEnter[stackCount] = leftIsNear ? rightEnter : leftEnter;
+      stack[stackCount + 1] = leftIsNear ? curLeft : curRight;
+      stackEnter[stackCount + 1] = leftIsNear ? leftEnter : rightEnter;
+      stackCount += 2;
+    } else if (hitLeft || hitRight) {
+      stack[stackCount] = hitLeft ? curLeft : curRight;
+      stackEnter[stackCount] = hitLeft ? leftEnter : rightEnter;
+      stackCount++;
+    }
+  }
 
-    if (!testIntersection(curNode, ray)) {
+  return inter;
+}
+
+
+// The traversal before the closest-hit one: every popped node's box is
+// tested against the whole ray and both children are pushed in fixed order.
+// Selected with BVHLayout::BINARY_UNORDERED to compare the two.
+inline Intersection BVHArray::getIntersectionUnordered(const long index, const Ray &ray,
+                                                       const ObjectList *objects) const {
+
+  if (!haveNode(index))
+    return Intersection();
+
+  Intersection inter;
+  inter._hit = false;
+  inter._distance = INFINITY;
+
+  Vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+  std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+
+  long stack[kStackSize] = {index};
+  int stackCount = 1;
+
+  while (stackCount != 0) {
+    stackCount--;
+    const BVHNode *curNode = &_array[stack[stackCount]];
+
+    if (!curNode->_bounds.IntersectP(ray, invDir, dirIsNeg)) {
       continue;
     }
 
     // leaf node
     if (curNode->_objectIndex >= 0) {
-      auto curObjectIndex = curNode->_objectIndex;
-      Intersection tmp = objects->getIntersection(ray, curObjectIndex);
-      if (tmp._hit && inter._distance > tmp._distance) {
-        inter = tmp;
-      }
-      // Only accept this intersection if it's far enough away to avoid self-intersection
-      if (tmp._hit && tmp._distance > EPSILON && tmp._distance < inter._distance) {
+      Intersection tmp = objects->getIntersection(ray, curNode->_objectIndex);
+      if (tmp._hit && tmp._distance < inter._distance) {
         inter = tmp;
       }
       continue;
     }
 
-    // add left
-    if (haveNode(curLeft)) {
-      stack[stackCount] = &_array[curLeft];
-      stackCount++;
+    assert(stackCount + 2 <= kStackSize);
+    if (haveNode(curNode->_leftIndex)) {
+      stack[stackCount++] = curNode->_leftIndex;
+    }
+    if (haveNode(curNode->_rightIndex)) {
+      stack[stackCount++] = curNode->_rightIndex;
+    }
+  }
+
+  return inter;
+}
+
+
+template <int Width>
+Intersection WideBVHArray<Width>::Intersect(const Ray& ray, const ObjectList* objects) const
+{
+  Intersection inter;
+  inter._hit = false;
+  inter._distance = INFINITY;
+  if (_array == nullptr || _arraySize == 0) return inter;
+
+  Vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+  bool negX = invDir.x < 0, negY = invDir.y < 0, negZ = invDir.z < 0;
+
+  int stack[kStackSize] = {0};
+  myComputeType stackEnter[kStackSize] = {0};
+  int stackCount = 1;
+
+  while (stackCount != 0) {
+    stackCount--;
+    if (stackEnter[stackCount] > inter._distance) {
+      continue;
+    }
+    const WideBVHNode<Width>& node = _array[stack[stackCount]];
+
+    // Slab test of every lane. The near and far planes are picked once per
+    // node from the ray direction and min/max are plain compares, so the
+    // loop has no branches and can be vectorised across the lanes. A NaN
+    // from a ray lying in a slab plane is the left operand and is dropped.
+    // Empty lanes carry an inverted box and never hit.
+    const myComputeType* nearX = negX ? node._maxX : node._minX;
+    const myComputeType* farX = negX ? node._minX : node._maxX;
+    const myComputeType* nearY = negY ? node._maxY : node._minY;
+    const myComputeType* farY = negY ? node._minY : node._maxY;
+    const myComputeType* nearZ = negZ ? node._maxZ : node._minZ;
+    const myComputeType* farZ = negZ ? node._minZ : node._maxZ;
+    myComputeType laneEnter[Width];
+    unsigned int laneHit = 0;
+#pragma unroll
+    for (int lane = 0; lane < Width; lane++) {
+      myComputeType tEnter = std::numeric_limits<myComputeType>::lowest();
+      myComputeType tExit = inter._distance;
+      myComputeType tNear = (nearX[lane] - ray.origin.x) * invDir.x;
+      myComputeType tFar = (farX[lane] - ray.origin.x) * invDir.x;
+      tEnter = tNear > tEnter ? tNear : tEnter;
+      tExit = tFar < tExit ? tFar : tExit;
+      tNear = (nearY[lane] - ray.origin.y) * invDir.y;
+      tFar = (farY[lane] - ray.origin.y) * invDir.y;
+      tEnter = tNear > tEnter ? tNear : tEnter;
+      tExit = tFar < tExit ? tFar : tExit;
+      tNear = (nearZ[lane] - ray.origin.z) * invDir.z;
+      tFar = (farZ[lane] - ray.origin.z) * invDir.z;
+      tEnter = tNear > tEnter ? tNear : tEnter;
+      tExit = tFar < tExit ? tFar : tExit;
+      laneEnter[lane] = tEnter;
+      laneHit |= static_cast<unsigned int>((tEnter <= tExit) & (tExit >= 0) & (node._minX[lane] <= node._maxX[lane])) << lane;
     }
 
-    if (haveNode(curRight)) {
-      stack[stackCount] = &_array[curRight];
+    // leaves are tested right away, inner children are pushed far to near
+    int innerChild[Width];
+    myComputeType innerEnter[Width];
+    int innerCount = 0;
+    for (int lane = 0; lane < Width; lane++) {
+      if (!(laneHit >> lane & 1) || laneEnter[lane] > inter._distance) {
+        continue;
+      }
+      int child = node._child[lane];
+      if (WideBVHNode<Width>::isLeaf(child)) {
+        Intersection tmp = objects->getIntersection(ray, WideBVHNode<Width>::leafObject(child));
+        if (tmp._hit && tmp._distance < inter._distance) {
+          inter = tmp;
+        }
+        continue;
+      }
+      int slot = innerCount++;
+      while (slot > 0 && innerEnter[slot - 1] < laneEnter[lane]) {
+        innerChild[slot] = innerChild[slot - 1];
+        innerEnter[slot] = innerEnter[slot - 1];
+        slot--;
+      }
+      innerChild[slot] = child;
+      innerEnter[slot] = laneEnter[lane];
+    }
+
+    // addWideBVH only keeps trees whose worst case fits, see wideStackDepth
+    assert(stackCount + innerCount <= kStackSize);
+    for (int i = 0; i < innerCount; i++) {
+      stack[stackCount] = innerChild[i];
+      stackEnter[stackCount] = innerEnter[i];
       stackCount++;
     }
   }
 
   return inter;
 }
+
+
+// Depth-first traversal of the compact layout: each visit tests the node's own
+// box against the closest hit, then continues with the child on the ray's
+// near side of the split axis and defers the other one.
+inline Intersection CompactBVHArray::Intersect(const Ray& ray, const ObjectList* objects) const
+{
+  Intersection inter;
+  inter._hit = false;
+  inter._distance = INFINITY;
+  if (_array == nullptr || _arraySize == 0) return inter;
+
+  Vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+  std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+
+  uint32_t stack[kStackSize];
+  int stackCount = 0;
+  uint32_t current = 0;
+
+  while (true) {
+    const CompactBVHNode& node = _array[current];
+    myComputeType tEnter;
+    if (node._bounds.IntersectP(ray, invDir, dirIsNeg, inter._distance, tEnter)) {
+      if (node._objectCount > 0) {
+        for (uint32_t k = 0; k < node._objectCount; k++) {
+          Intersection tmp = objects->getIntersection(ray, node._offset + k);
+          if (tmp._hit && tmp._distance < inter._distance) {
+            inter = tmp;
+          }
+        }
+      } else {
+        // one deferred child per level, the tree is no deeper than kMaxBVHDepth
+        assert(stackCount < kStackSize);
+        // dirIsNeg is set for a positive direction, the left child is then nearer
+        if (dirIsNeg[node._axis]) {
+          stack[stackCount++] = node._offset;
+          current = current + 1;
+        } else {
+          stack[stackCount++] = current + 1;
+          current = node._offset;
+        }
+        continue;
+      }
+    }
+    if (stackCount == 0) {
+      break;
+    }
+    current = stack[--stackCount];
+  }
+
+  return inter;
+}
+
+
+// Same visiting order as the compact layout. Boxes are decoded from the
+// parent box on the way down, so a deferred child is pushed together with its
+// decoded box and entry distance.
+template <typename QuantType>
+Intersection QuantizedBVHArray<QuantType>::Intersect(const Ray& ray, const ObjectList* objects) const
+{
+  Intersection inter;
+  inter._hit = false;
+  inter._distance = INFINITY;
+  if (_array == nullptr || _arraySize == 0) return inter;
+
+  Vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+  std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+
+  myComputeType rootEnter;
+  if (!_rootBounds.IntersectP(ray, invDir, dirIsNeg, inter._distance, rootEnter)) {
+    return inter;
+  }
+
+  uint32_t stack[kStackSize];
+  Bounds3 stackBounds[kStackSize];
+  myComputeType stackEnter[kStackSize];
+  int stackCount = 0;
+
+  uint32_t current = 0;
+  Bounds3 currentBounds = _rootBounds;
+
+  while (true) {
+    const QuantizedBVHNode<QuantType>& node = _array[current];
+    bool descend = false;
+
+    if (node._objectCount > 0) {
+      for (uint32_t k = 0; k < node._objectCount; k++) {
+        Intersection tmp = objects->getIntersection(ray, node._offset + k);
+        if (tmp._hit && tmp._distance < inter._distance) {
+          inter = tmp;
+        }
+      }
+    } else {
+      uint32_t leftIndex = current + 1;
+      uint32_t rightIndex = node._offset;
+      Bounds3 leftBounds = decodeQuantizedBounds(_array[leftIndex], currentBounds);
+      Bounds3 rightBounds = decodeQuantizedBounds(_array[rightIndex], currentBounds);
+      myComputeType leftEnter, rightEnter;
+      bool hitLeft = leftBounds.IntersectP(ray, invDir, dirIsNeg, inter._distance, leftEnter);
+      bool hitRight = rightBounds.IntersectP(ray, invDir, dirIsNeg, inter._distance, rightEnter);
+
+      if (hitLeft && hitRight) {
+        assert(stackCount < kStackSize);
+        // dirIsNeg is set for a positive direction, the left child is then nearer
+        bool leftIsNear = dirIsNeg[node._axis] != 0;
+        stack[stackCount] = leftIsNear ? rightIndex : leftIndex;
+        stackBounds[stackCount] = leftIsNear ? rightBounds : leftBounds;
+        stackEnter[stackCount] = leftIsNear ? rightEnter : leftEnter;
+        stackCount++;
+        current = leftIsNear ? leftIndex : rightIndex;
+        currentBounds = leftIsNear ? leftBounds : rightBounds;
+        descend = true;
+      } else if (hitLeft || hitRight) {
+        current = hitLeft ? leftIndex : rightIndex;
+        currentBounds = hitLeft ? leftBounds : rightBounds;
+        descend = true;
+      }
+    }
+
+    if (descend) {
+      continue;
+    }
+
+    // resume with the closest deferred child still in front of the closest hit
+    while (stackCount != 0 && stackEnter[stackCount - 1] > inter._distance) {
+      stackCount--;
+    }
+    if (stackCount == 0) {
+      break;
+    }
+    stackCount--;
+    current = stack[stackCount];
+    currentBounds = stackBounds[stackCount];
+  }
+
+  return inter;
+}
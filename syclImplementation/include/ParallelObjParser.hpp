@@ -0,0 +1,293 @@
+#pragma once
+
+#include "tiny_obj_loader.h"
+#include "HostParallel.hpp"
+#include "ScenePack.hpp"
+#include "Geometry.hpp"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Parallel OBJ front-end for the subset the simulation reads: v, f, usemtl,
+// mtllib, o and g. The mapped file is cut into one chunk per thread on line
+// boundaries and every chunk is parsed on its own. Chunks cannot know how
+// many vertices, which material or which shape came before them, so those
+// are fixed up in a short serial pass before the triangles are emitted in
+// parallel. MTL files are still read with tinyobj::LoadMtl.
+
+// relative (negative) OBJ indices are stored as -1 - (local position + bias)
+constexpr long kObjRelativeBias = 1L << 40;
+
+struct ObjChunk
+{
+    std::vector<Vec3> _vertices;
+    // triangle corners after fan triangulation: a 1-based OBJ index becomes
+    // its final 0-based index, a relative one is resolved against the
+    // chunk's own vertices and encoded with kObjRelativeBias
+    std::vector<long> _corners;
+    std::vector<int> _materials;                 // per triangle, index into _materialNames, -2 inherits
+    std::vector<std::string> _materialNames;
+    std::vector<size_t> _shapeStarts;            // local triangle count at every o or g line
+    std::vector<std::string> _mtlLibraries;
+    size_t _triangleOffset = 0;
+    size_t _vertexOffset = 0;
+};
+
+struct ParsedObj
+{
+    std::vector<Triangle> _triangles;
+    std::vector<Vec3> _vertices;        // indexed output: the vertex buffer and
+    std::vector<uint32_t> _indices;     // one index triplet per triangle
+    std::vector<int> _materialIDs;
+    std::vector<size_t> _shapeOffsets;
+    std::vector<tinyobj::material_t> _materials;
+};
+
+
+inline const char* skipSpaces(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+    return p;
+}
+
+inline const char* skipToken(const char* p, const char* end)
+{
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+    {
+        p++;
+    }
+    return p;
+}
+
+inline bool isKeyword(const char* p, const char* end, const char* keyword, size_t length)
+{
+    return static_cast<size_t>(end - p) > length && std::equal(keyword, keyword + length, p)
+        && (p[length] == ' ' || p[length] == '\t');
+}
+
+inline void parseObjChunk(const char* begin, const char* end, ObjChunk& chunk)
+{
+    std::vector<long> face;
+    const char* line = begin;
+    while (line < end)
+    {
+        const char* lineEnd = std::find(line, end, '\n');
+        const char* p = skipSpaces(line, lineEnd);
+        const char* contentEnd = lineEnd;
+        while (contentEnd > p && (contentEnd[-1] == '\r' || contentEnd[-1] == ' ' || contentEnd[-1] == '\t'))
+        {
+            contentEnd--;
+        }
+
+        if (isKeyword(p, contentEnd, "v", 1))
+        {
+            double xyz[3] = {0, 0, 0};
+            p += 1;
+            for (int k = 0; k < 3; k++)
+            {
+                p = skipSpaces(p, contentEnd);
+                if (p < contentEnd && *p == '+') p++;
+                p = std::from_chars(p, contentEnd, xyz[k]).ptr;
+            }
+            chunk._vertices.push_back(Vec3(static_cast<float>(xyz[0]), static_cast<float>(xyz[1]), static_cast<float>(xyz[2])));
+        }
+        else if (isKeyword(p, contentEnd, "f", 1))
+        {
+            face.clear();
+            p += 1;
+            while ((p = skipSpaces(p, contentEnd)) < contentEnd)
+            {
+                long index = 0;
+                std::from_chars(p, contentEnd, index);
+                if (index > 0)
+                {
+                    face.push_back(index - 1);
+                }
+                else if (index < 0)
+                {
+                    face.push_back(-1 - (static_cast<long>(chunk._vertices.size()) + index + kObjRelativeBias));
+                }
+                p = skipToken(p, contentEnd);
+            }
+            for (size_t k = 1; k + 1 < face.size(); k++)
+            {
+                chunk._corners.push_back(face[0]);
+                chunk._corners.push_back(face[k]);
+                chunk._corners.push_back(face[k + 1]);
+                chunk._materials.push_back(chunk._materialNames.empty() ? -2 : static_cast<int>(chunk._materialNames.size()) - 1);
+            }
+        }
+        else if (isKeyword(p, contentEnd, "usemtl", 6))
+        {
+            p = skipSpaces(p + 6, contentEnd);
+            chunk._materialNames.push_back(std::string(p, contentEnd));
+        }
+        else if (isKeyword(p, contentEnd, "o", 1) || isKeyword(p, contentEnd, "g", 1))
+        {
+            chunk._shapeStarts.push_back(chunk._materials.size());
+        }
+        else if (isKeyword(p, contentEnd, "mtllib", 6))
+        {
+            p += 6;
+            while ((p = skipSpaces(p, contentEnd)) < contentEnd)
+            {
+                const char* nameEnd = skipToken(p, contentEnd);
+                chunk._mtlLibraries.push_back(std::string(p, nameEnd));
+                p = nameEnd;
+            }
+        }
+        line = lineEnd + 1;
+    }
+}
+
+
+// Returns false when the file cannot be mapped. With indexed set the triangles
+// come out as _vertices and _indices instead of _triangles; an index outside
+// the file's vertices then refers to an extra vertex at the origin.
+inline bool parseObjParallel(const std::string& objFilePath, const std::string& objFile, int threadCount, bool indexed, ParsedObj& result)
+{
+    MappedFile file;
+    if (!file.open(objFilePath + objFile))
+    {
+        return false;
+    }
+    const char* data = file.data();
+    const char* dataEnd = data + file.size();
+
+    // chunk k starts after the first line break at or past k * size / count
+    int chunkCount = hostChunkCount(static_cast<long>(file.size() / (1 << 16)) + 1, hostThreadCount(threadCount));
+    std::vector<const char*> bounds(chunkCount + 1, dataEnd);
+    bounds[0] = data;
+    for (int k = 1; k < chunkCount; k++)
+    {
+        const char* p = std::find(data + file.size() * k / chunkCount, dataEnd, '\n');
+        bounds[k] = std::max(bounds[k - 1], p == dataEnd ? dataEnd : p + 1);
+    }
+
+    std::vector<ObjChunk> chunks(chunkCount);
+    parallelChunks(0, chunkCount, chunkCount, [&](int chunk, long, long) {
+        parseObjChunk(bounds[chunk], bounds[chunk + 1], chunks[chunk]);
+    });
+
+    // MTL files in the order of their mtllib lines, as tinyobj numbers them
+    std::map<std::string, int> materialMap;
+    for (auto& chunk : chunks)
+    {
+        for (auto& library : chunk._mtlLibraries)
+        {
+            std::ifstream mtl(objFilePath + "/" + library);
+            if (!mtl)
+            {
+                std::cout << "Parallel OBJ parser: material file " << library << " not found" << std::endl;
+                continue;
+            }
+            std::string warning, error;
+            tinyobj::LoadMtl(&materialMap, &result._materials, &mtl, &warning, &error);
+        }
+    }
+
+    // serial fix-up: vertex and triangle offsets, the material each chunk
+    // starts with, and the shape starts in global triangle indices
+    size_t vertexCount = 0;
+    size_t triangleCount = 0;
+    int currentMaterial = -1;
+    std::vector<int> startMaterial(chunkCount);
+    std::vector<size_t> shapeStarts = {0};
+    std::vector<std::vector<int>> materialIDs(chunkCount);
+    for (int k = 0; k < chunkCount; k++)
+    {
+        ObjChunk& chunk = chunks[k];
+        chunk._vertexOffset = vertexCount;
+        chunk._triangleOffset = triangleCount;
+        startMaterial[k] = currentMaterial;
+        materialIDs[k].resize(chunk._materialNames.size());
+        for (size_t m = 0; m < chunk._materialNames.size(); m++)
+        {
+            auto found = materialMap.find(chunk._materialNames[m]);
+            materialIDs[k][m] = found != materialMap.end() ? found->second : -1;
+        }
+        if (!materialIDs[k].empty())
+        {
+            currentMaterial = materialIDs[k].back();
+        }
+        for (size_t start : chunk._shapeStarts)
+        {
+            shapeStarts.push_back(triangleCount + start);
+        }
+        vertexCount += chunk._vertices.size();
+        triangleCount += chunk._materials.size();
+    }
+
+    // a shape starts at every o or g line that is followed by triangles
+    for (size_t start : shapeStarts)
+    {
+        if (start < triangleCount && (result._shapeOffsets.empty() || result._shapeOffsets.back() != start))
+        {
+            result._shapeOffsets.push_back(start);
+        }
+    }
+
+    std::vector<Vec3> vertices(vertexCount);
+    if (indexed)
+    {
+        result._indices.resize(3 * triangleCount);
+    }
+    else
+    {
+        result._triangles.resize(triangleCount);
+    }
+    std::atomic<bool> invalidIndex(false);
+    result._materialIDs.resize(triangleCount);
+    parallelChunks(0, chunkCount, chunkCount, [&](int k, long, long) {
+        const ObjChunk& chunk = chunks[k];
+        std::copy(chunk._vertices.begin(), chunk._vertices.end(), vertices.begin() + chunk._vertexOffset);
+    });
+    parallelChunks(0, chunkCount, chunkCount, [&](int k, long, long) {
+        const ObjChunk& chunk = chunks[k];
+        for (size_t t = 0; t < chunk._materials.size(); t++)
+        {
+            Vec3 corner[3];
+            for (int c = 0; c < 3; c++)
+            {
+                long index = chunk._corners[3 * t + c];
+                index = index >= 0 ? index : static_cast<long>(chunk._vertexOffset) - 1 - index - kObjRelativeBias;
+                bool valid = index >= 0 && index < static_cast<long>(vertexCount);
+                if (indexed)
+                {
+                    result._indices[3 * (chunk._triangleOffset + t) + c] = static_cast<uint32_t>(valid ? index : vertexCount);
+                    if (!valid)
+                    {
+                        invalidIndex = true;
+                    }
+                }
+                else
+                {
+                    corner[c] = valid ? vertices[index] : Vec3(0, 0, 0);
+                }
+            }
+            if (!indexed)
+            {
+                result._triangles[chunk._triangleOffset + t] = Triangle(corner[0], corner[1], corner[2]);
+            }
+            int material = chunk._materials[t];
+            result._materialIDs[chunk._triangleOffset + t] = material >= 0 ? materialIDs[k][material] : startMaterial[k];
+        }
+    });
+    if (indexed)
+    {
+        result._vertices = std::move(vertices);
+        if (invalidIndex)
+        {
+            result._vertices.push_back(Vec3(0, 0, 0));
+        }
+    }
+    return true;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+#include "SampleScheduler.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <vector>
+
+// Persistent-worker launch of a megakernel chunk. The static launch gives
+// every pixel of the tile one work-item that loops over the chunk's samples,
+// so a group whose paths reach the detector after two bounces idles while a
+// neighbour bounces ten times. Here a fixed number of work-groups stays
+// resident and every work-item pulls batches of consecutive paths from a
+// global atomic counter until the chunk is used up. Work-items fetch on their
+// own rather than once per group, which needs no barrier; a batch of a few
+// dozen paths keeps the atomic traffic negligible. Every group adds the rays
+// it traced to its slot of the worker statistics, see reportWorkerBalance.
+
+struct PersistentConfig
+{
+    int _groups = 0;            // 0 starts four groups per compute unit
+    int _groupSize = 64;        // clamped to the device maximum
+    int _batchSize = 32;        // paths per fetch
+};
+
+// The per-device state of the persistent launch, kept for the whole run.
+class PersistentWork
+{
+    size_t _groups;
+    size_t _groupSize;
+    std::vector<uint64_t> _workerRays;
+
+    public:
+
+    sycl::buffer<uint64_t, 1> _workCounter;
+    sycl::buffer<uint64_t, 1> _workerBuffer;
+
+    PersistentWork(const sycl::device& device, const PersistentConfig& config)
+        : _groups(config._groups > 0 ? config._groups : 4 * device.get_info<sycl::info::device::max_compute_units>()),
+          _groupSize(std::min<size_t>(std::max(config._groupSize, 1), device.get_info<sycl::info::device::max_work_group_size>())),
+          _workerRays(std::max<size_t>(_groups, 1), 0),
+          _workCounter(sycl::range<1>(1)),
+          _workerBuffer(_workerRays.data(), sycl::range<1>(_workerRays.size()))
+    {
+        _groups = _workerRays.size();
+        if (_groupSize != static_cast<size_t>(config._groupSize))
+        {
+            std::cout << "[INFO] Persistent work-group size " << config._groupSize << " changed to " << _groupSize
+                      << ", the device allows 1 to " << device.get_info<sycl::info::device::max_work_group_size>() << std::endl;
+        }
+    }
+
+    PersistentWork(const PersistentWork&) = delete;
+    PersistentWork& operator=(const PersistentWork&) = delete;
+
+    size_t groups() const
+    {
+        return _groups;
+    }
+
+    size_t groupSize() const
+    {
+        return _groupSize;
+    }
+
+    // rays traced by every group so far
+    std::vector<uint64_t> workerRays()
+    {
+        sycl::host_accessor rays(_workerBuffer);
+        return std::vector<uint64_t>(&rays[0], &rays[0] + _groups);
+    }
+};
+
+// Submits the chunk as work.groups() resident groups. bindTracer(cgh) binds the
+// scene and record buffers and returns trace(i, j, s), which follows sample s
+// of pixel (i, j) and returns the rays it traced.
+template <typename BindTracer>
+sycl::event submitPersistentChunk(sycl::queue& queue, const PersistentConfig& config, const SampleChunk& chunk, PersistentWork& work,
+                                  sycl::buffer<uint64_t, 1>& rayBuffer, BindTracer bindTracer)
+{
+    // the accessors order the reset after the previous chunk's kernel
+    queue.submit([&](sycl::handler& cgh) {
+        sycl::accessor next_acc(work._workCounter, cgh, sycl::write_only);
+        cgh.single_task([=]() {
+            next_acc[0] = 0;
+        });
+    });
+
+    return queue.submit([&](sycl::handler& cgh) {
+        auto trace = bindTracer(cgh);
+        sycl::accessor next_acc(work._workCounter, cgh, sycl::read_write);
+        sycl::accessor worker_acc(work._workerBuffer, cgh, sycl::read_write);
+        sycl::accessor ray_acc(rayBuffer, cgh, sycl::read_write);
+
+        int chunkX = chunk._x;
+        int chunkY = chunk._y;
+        uint64_t chunkWidth = chunk._width;
+        uint64_t chunkPixels = chunkWidth * chunk._height;
+        uint64_t pathCount = chunkPixels * (chunk._sampleEnd - chunk._sampleBegin);
+        int sampleBegin = chunk._sampleBegin;
+        uint64_t batch = std::max(config._batchSize, 1);
+        size_t groupSize = work.groupSize();
+        cgh.parallel_for(sycl::nd_range<1>(sycl::range<1>(work.groups() * groupSize), sycl::range<1>(groupSize)), [=](sycl::nd_item<1> item) {
+            auto next = sycl::atomic_ref<
+                uint64_t,
+                sycl::ext::oneapi::detail::memory_order::relaxed,
+                sycl::ext::oneapi::detail::memory_scope::device,
+                sycl::access::address_space::global_space>(next_acc[0]);
+            uint64_t rays = 0;
+            for (uint64_t first = next.fetch_add(batch); first < pathCount; first = next.fetch_add(batch))
+            {
+                uint64_t last = sycl::min(first + batch, pathCount);
+                for (uint64_t p = first; p < last; p++)
+                {
+                    // path p is sample p / pixels of pixel p % pixels, so a batch
+                    // holds neighbouring camera rays of one sample
+                    uint64_t pixel = p % chunkPixels;
+                    rays += trace(chunkX + static_cast<int>(pixel % chunkWidth), chunkY + static_cast<int>(pixel / chunkWidth),
+                                  sampleBegin + static_cast<int>(p / chunkPixels));
+                }
+            }
+
+            auto worker_counter = sycl::atomic_ref<
+                uint64_t,
+                sycl::ext::oneapi::detail::memory_order::relaxed,
+                sycl::ext::oneapi::detail::memory_scope::device,
+                sycl::access::address_space::global_space>(worker_acc[item.get_group_linear_id()]);
+            worker_counter.fetch_add(rays);
+            auto ray_counter = sycl::atomic_ref<
+                uint64_t,
+                sycl::ext::oneapi::detail::memory_order::relaxed,
+                sycl::ext::oneapi::detail::memory_scope::device,
+                sycl::access::address_space::global_space>(ray_acc[0]);
+            ray_counter.fetch_add(rays);
+        });
+    });
+}
+
+// Reports the rays every worker group traced. With balanced workers the group
+// that traced the most rays is close to the mean.
+inline void reportWorkerBalance(const std::string& label, const std::vector<uint64_t>& workerRays)
+{
+    if (workerRays.empty())
+    {
+        return;
+    }
+    auto range = std::minmax_element(workerRays.begin(), workerRays.end());
+    double mean = std::accumulate(workerRays.begin(), workerRays.end(), 0.0) / workerRays.size();
+    std::cout << "[INFO] " << label << ": " << workerRays.size() << " workers, rays per worker min " << *range.first
+              << ", mean " << std::fixed << std::setprecision(1) << mean << ", max " << *range.second << ", balance (mean / max) "
+              << (*range.second > 0 ? 100.0 * mean / *range.second : 100.0) << "%" << std::defaultfloat << std::endl;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "GeometryList.hpp"
+#include <vector>
+
+// Precomputed triangle data for intersection only, stored in BVH leaf order.
+struct TrianglePrimitive
+{
+    Vec3 _v1;
+    Vec3 _e1;
+    Vec3 _e2;
+    Vec3 _normal;
+};
+
+
+// Flattened copy of the objects: a leaf slot indexes the triangle and its
+// material directly instead of going through Object, Geometry* and the
+// GeometryType switch.
+class PrimitiveList
+{
+    TrianglePrimitive* _triangles = nullptr;
+    int* _materialIndices = nullptr;
+    size_t _size = 0;
+
+    public:
+
+    PrimitiveList() = default;
+
+    void setPrimitives(size_t size, TrianglePrimitive* triangles, int* materialIndices)
+    {
+        _size = size;
+        _triangles = triangles;
+        _materialIndices = materialIndices;
+    }
+
+    inline bool isFlat() const
+    {
+        return _triangles != nullptr;
+    }
+
+    inline size_t getSize() const
+    {
+        return _size;
+    }
+
+    inline Intersection getIntersection(const Ray& ray, long index) const
+    {
+        const TrianglePrimitive& tri = _triangles[index];
+        return intersectTriangle(tri._v1, tri._e1, tri._e2, tri._normal, ray);
+    }
+
+    inline int getMaterialIndex(long index) const
+    {
+        return _materialIndices[index];
+    }
+};
+
+
+// Walks the objects once at scene build time. Returns false when a geometry
+// has no flattened form, the scene then keeps the Geometry dispatch.
+template <typename ObjectType>
+bool flattenPrimitives(const GeometryList& geometryList, const ObjectType* objects, size_t objectCount,
+                       std::vector<TrianglePrimitive>& triangles, std::vector<int>& materialIndices)
+{
+    triangles.resize(objectCount);
+    materialIndices.resize(objectCount);
+    for (size_t i = 0; i < objectCount; i++)
+    {
+        Geometry* geometry = geometryList.getGeometry(objects[i]._geometryIndex);
+        switch (geometry->_type)
+        {
+        case GeometryType::TRIANGLE:
+        {
+            const Triangle* tri = static_cast<const Triangle*>(geometry);
+            triangles[i]._v1 = tri->_v1;
+            triangles[i]._e1 = tri->getEdge1();
+            triangles[i]._e2 = tri->getEdge2();
+            triangles[i]._normal = tri->getNormal();
+            break;
+        }
+        case GeometryType::INDEXED_TRIANGLE:
+        {
+            const IndexedTriangle* tri = static_cast<const IndexedTriangle*>(geometry);
+            triangles[i]._v1 = tri->getVertex(0);
+            triangles[i]._e1 = tri->getVertex(1) - tri->getVertex(0);
+            triangles[i]._e2 = tri->getVertex(2) - tri->getVertex(0);
+            triangles[i]._normal = crossProduct(triangles[i]._e1, triangles[i]._e2).normalized();
+            break;
+        }
+        default:
+            return false;
+        }
+        materialIndices[i] = static_cast<int>(objects[i]._materialIndex);
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "Geometry.hpp"
+#include "common.hpp"
+
+// Parallelogram _origin + s * _edge1 + t * _edge2 with s, t in [0, 1], one
+// quad replaces the two triangles of a flat panel. One-sided like a
+// triangle, the front face is the one crossProduct(_edge1, _edge2) points to.
+class Quad : public Geometry
+{
+    public:
+
+        Vec3 _origin, _edge1, _edge2;
+
+        Quad()
+            : Geometry(GeometryType::QUAD){}
+        Quad(const Vec3& origin, const Vec3& edge1, const Vec3& edge2)
+            : Geometry(GeometryType::QUAD), _origin(origin), _edge1(edge1), _edge2(edge2) {}
+
+    Vec3 getNormal() const
+    {
+        return crossProduct(_edge1, _edge2).normalized();
+    }
+
+    // intersectTriangle with the u + v <= 1 test replaced by v <= 1
+    Intersection getIntersection_virtual(const Ray& ray) const
+    {
+        Intersection intersection;
+        Vec3 normal = getNormal();
+        if (dotProduct(normal, ray.direction) > -MyEPSILON)
+        {
+            return intersection;
+        }
+
+        Vec3 pvec = crossProduct(ray.direction, _edge2);
+        myComputeType det = dotProduct(_edge1, pvec);
+        if (sycl::fabs(det) < MyEPSILON * 10)
+        {
+            return intersection;
+        }
+        myComputeType inv_det = 1.0f / det;
+        Vec3 tvec = ray.origin - _origin;
+        myComputeType u = dotProduct(tvec, pvec) * inv_det;
+        if (u < -MyEPSILON || u > 1 + MyEPSILON)
+        {
+            return intersection;
+        }
+        Vec3 qvec = crossProduct(tvec, _edge1);
+        myComputeType v = dotProduct(ray.direction, qvec) * inv_det;
+        if (v < -MyEPSILON || v > 1 + MyEPSILON)
+        {
+            return intersection;
+        }
+        myComputeType t_tmp = dotProduct(_edge2, qvec) * inv_det;
+        if (t_tmp < -MyEPSILON)
+        {
+            return intersection;
+        }
+
+        intersection._hit = true;
+        intersection._position = ray.origin + ray.direction * t_tmp;
+        intersection._normal = normal;
+        intersection._distance = t_tmp;
+        return intersection;
+    }
+
+    myComputeType getArea_virtual() const
+    {
+        return crossProduct(_edge1, _edge2).length();
+    }
+
+    SamplingRecord Sample_virtual(RNG &rng)
+    {
+        SamplingRecord record;
+        record.pdf = 1.0f / getArea_virtual();
+        myComputeType x = get_random_float(rng);
+        myComputeType y = get_random_float(rng);
+        record.pos._position = _origin + _edge1 * x + _edge2 * y;
+        record.pos._normal = getNormal();
+        return record;
+    }
+
+    Bounds3 getBounds_virtual() const
+    {
+        return Union(Bounds3(_origin, _origin + _edge1 + _edge2), Bounds3(_origin + _edge1, _origin + _edge2));
+    }
+};
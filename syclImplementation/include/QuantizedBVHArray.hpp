@@ -0,0 +1,141 @@
+#pragma once
+
+#include "CompactBVHArray.hpp"
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+class ObjectList;
+
+// Compact node whose box is quantized inside the decoded box of its parent.
+// Minima count steps up from the parent minimum and maxima count steps down
+// from the parent maximum, so 0 always reproduces the parent face exactly.
+// With uint8_t the node is 12 bytes, with uint16_t 20 bytes. Decoding costs a
+// few multiplies per box, so the layout pays off once the binary nodes no
+// longer fit in cache; on smaller scenes the compact layout is faster.
+template <typename QuantType>
+struct QuantizedBVHNode
+{
+    uint32_t _offset = 0;        // leaf: first object, inner node: right child
+    QuantType _qMin[3] = {0, 0, 0};
+    QuantType _qMax[3] = {0, 0, 0};
+    uint8_t _objectCount = 0;    // 0 marks an inner node
+    uint8_t _axis = 0;
+
+    static constexpr myComputeType kQuantSteps = static_cast<myComputeType>(std::numeric_limits<QuantType>::max());
+};
+
+
+template <typename QuantType>
+inline Bounds3 decodeQuantizedBounds(const QuantizedBVHNode<QuantType>& node, const Bounds3& parent)
+{
+    Vec3 step = (parent.pMax - parent.pMin) * (1.0f / QuantizedBVHNode<QuantType>::kQuantSteps);
+    Bounds3 bounds;
+    bounds.pMin = Vec3(parent.pMin.x + node._qMin[0] * step.x,
+                       parent.pMin.y + node._qMin[1] * step.y,
+                       parent.pMin.z + node._qMin[2] * step.z);
+    bounds.pMax = Vec3(parent.pMax.x - node._qMax[0] * step.x,
+                       parent.pMax.y - node._qMax[1] * step.y,
+                       parent.pMax.z - node._qMax[2] * step.z);
+    return bounds;
+}
+
+// Rounds outward and keeps a small margin so a fused or reordered decode on
+// the device still covers the exact box.
+template <typename QuantType>
+void encodeQuantizedBounds(QuantizedBVHNode<QuantType>& node, const Bounds3& bounds, const Bounds3& parent)
+{
+    const myComputeType steps = QuantizedBVHNode<QuantType>::kQuantSteps;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        myComputeType extent = parent.pMax[axis] - parent.pMin[axis];
+        myComputeType step = extent * (1.0f / steps);
+        myComputeType margin = extent * 1e-5f;
+        if (step <= 0)
+        {
+            node._qMin[axis] = 0;
+            node._qMax[axis] = 0;
+            continue;
+        }
+
+        long qMin = static_cast<long>(std::floor((bounds.pMin[axis] - parent.pMin[axis]) / step));
+        qMin = std::min(std::max(qMin, 0L), static_cast<long>(steps));
+        while (qMin > 0 && parent.pMin[axis] + qMin * step > bounds.pMin[axis] - margin)
+        {
+            qMin--;
+        }
+
+        long qMax = static_cast<long>(std::floor((parent.pMax[axis] - bounds.pMax[axis]) / step));
+        qMax = std::min(std::max(qMax, 0L), static_cast<long>(steps));
+        while (qMax > 0 && parent.pMax[axis] - qMax * step < bounds.pMax[axis] + margin)
+        {
+            qMax--;
+        }
+
+        node._qMin[axis] = static_cast<QuantType>(qMin);
+        node._qMax[axis] = static_cast<QuantType>(qMax);
+    }
+}
+
+
+template <typename QuantType>
+class QuantizedBVHArray
+{
+    long _arraySize = 0;
+    QuantizedBVHNode<QuantType>* _array = nullptr;
+    Bounds3 _rootBounds;
+
+    public:
+
+    // the compact tree's shape, so one deferred child per level
+    static constexpr int kStackSize = kMaxBVHDepth;
+
+    QuantizedBVHArray() = default;
+
+    void setQuantizedBVHArray(size_t arraySize, QuantizedBVHNode<QuantType>* array, const Bounds3& rootBounds)
+    {
+        _arraySize = arraySize;
+        _array = array;
+        _rootBounds = rootBounds;
+    }
+
+    long getArraySize() const
+    {
+        return _arraySize;
+    }
+
+    Intersection Intersect(const Ray& ray, const ObjectList* objects) const;
+};
+
+
+template <typename QuantType>
+void quantizeCompactNode(const std::vector<CompactBVHNode>& compact, uint32_t index, const Bounds3& parentBounds,
+                         std::vector<QuantizedBVHNode<QuantType>>& nodes)
+{
+    const CompactBVHNode& source = compact[index];
+    QuantizedBVHNode<QuantType>& node = nodes[index];
+    node._offset = source._offset;
+    node._objectCount = static_cast<uint8_t>(source._objectCount);
+    node._axis = static_cast<uint8_t>(source._axis);
+    encodeQuantizedBounds(node, source._bounds, parentBounds);
+
+    if (source._objectCount == 0)
+    {
+        // children are encoded against the decoded box, not the exact one
+        Bounds3 decoded = decodeQuantizedBounds(node, parentBounds);
+        quantizeCompactNode(compact, index + 1, decoded, nodes);
+        quantizeCompactNode(compact, source._offset, decoded, nodes);
+    }
+}
+
+// Same topology and node order as the compact layout, only the boxes change.
+template <typename QuantType>
+std::vector<QuantizedBVHNode<QuantType>> quantizeBVH(const std::vector<CompactBVHNode>& compact)
+{
+    std::vector<QuantizedBVHNode<QuantType>> nodes(compact.size());
+    if (!compact.empty())
+    {
+        quantizeCompactNode(compact, 0, compact[0]._bounds, nodes);
+    }
+    return nodes;
+}
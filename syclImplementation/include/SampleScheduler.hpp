@@ -0,0 +1,252 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Splits the megakernel's (pixel x sample) space into chunks of one pixel
+// tile and one sample range, each submitted as its own kernel. Sample ranges
+// are the outer loop, so every pixel has received samples when a run is
+// cancelled part way. The kernel seeds its RNG from the global pixel and
+// sample index only, so the records do not depend on the chunking.
+
+struct SampleChunkConfig
+{
+    int _tileWidth = 0;                     // 0 covers the whole image
+    int _tileHeight = 0;
+    int _samplesPerChunk = 0;               // 0 derives it from _pathsPerChunk
+    uint64_t _pathsPerChunk = 1ULL << 24;
+    int _chunksInFlight = 2;                // submitted ahead of the one waited for
+    double _progressSeconds = 5;            // 0 reports after every chunk
+};
+
+struct SampleChunk
+{
+    int _x = 0;
+    int _y = 0;
+    int _width = 0;
+    int _height = 0;
+    int _sampleBegin = 0;
+    int _sampleEnd = 0;
+};
+
+// set by SIGINT while a scheduler runs
+inline std::atomic<bool> sampleSchedulerCancelled(false);
+
+inline void sampleSchedulerInterrupt(int)
+{
+    sampleSchedulerCancelled = true;
+    // a second Ctrl-C terminates as usual
+    std::signal(SIGINT, SIG_DFL);
+}
+
+
+class SampleScheduler
+{
+    int _imageWidth;
+    int _imageHeight;
+    int _ssp;
+    SampleChunkConfig _config;
+    int _tilesX = 1;
+    int _tilesY = 1;
+    int _samplePasses = 1;
+
+    public:
+
+    SampleScheduler(int imageWidth, int imageHeight, int ssp, const SampleChunkConfig& config = SampleChunkConfig())
+        : _imageWidth(imageWidth), _imageHeight(imageHeight), _ssp(ssp), _config(config)
+    {
+        if (_config._tileWidth <= 0 || _config._tileWidth > _imageWidth) _config._tileWidth = _imageWidth;
+        if (_config._tileHeight <= 0 || _config._tileHeight > _imageHeight) _config._tileHeight = _imageHeight;
+        if (_config._samplesPerChunk <= 0)
+        {
+            uint64_t tilePixels = std::max<uint64_t>(static_cast<uint64_t>(_config._tileWidth) * _config._tileHeight, 1);
+            _config._samplesPerChunk = static_cast<int>(std::min<uint64_t>(std::max<uint64_t>(_config._pathsPerChunk / tilePixels, 1), std::max(_ssp, 1)));
+        }
+        _tilesX = (_imageWidth + _config._tileWidth - 1) / std::max(_config._tileWidth, 1);
+        _tilesY = (_imageHeight + _config._tileHeight - 1) / std::max(_config._tileHeight, 1);
+        _samplePasses = (_ssp + _config._samplesPerChunk - 1) / _config._samplesPerChunk;
+    }
+
+    size_t chunkCount() const
+    {
+        return static_cast<size_t>(_tilesX) * _tilesY * _samplePasses;
+    }
+
+    const SampleChunkConfig& config() const
+    {
+        return _config;
+    }
+
+    // the most paths one chunk traces, which bounds the records it writes
+    uint64_t maxChunkPaths() const
+    {
+        return static_cast<uint64_t>(_config._tileWidth) * _config._tileHeight * _config._samplesPerChunk;
+    }
+
+    SampleChunk chunk(size_t k) const
+    {
+        size_t tileCount = static_cast<size_t>(_tilesX) * _tilesY;
+        int pass = static_cast<int>(k / tileCount);
+        int tile = static_cast<int>(k % tileCount);
+        SampleChunk chunk;
+        chunk._x = (tile % _tilesX) * _config._tileWidth;
+        chunk._y = (tile / _tilesX) * _config._tileHeight;
+        chunk._width = std::min(_config._tileWidth, _imageWidth - chunk._x);
+        chunk._height = std::min(_config._tileHeight, _imageHeight - chunk._y);
+        chunk._sampleBegin = pass * _config._samplesPerChunk;
+        chunk._sampleEnd = std::min(chunk._sampleBegin + _config._samplesPerChunk, _ssp);
+        return chunk;
+    }
+
+    // Submits every chunk through submitChunk(const SampleChunk&), which
+    // returns its sycl::event, and reports progress as they complete. SIGINT
+    // stops further submissions; the chunks already queued still finish.
+    // Returns the number of completed chunks.
+    template <typename Submit>
+    size_t run(Submit submitChunk)
+    {
+        size_t total = chunkCount();
+        reportStart(1);
+        sampleSchedulerCancelled = false;
+        auto previousHandler = std::signal(SIGINT, sampleSchedulerInterrupt);
+        auto startTime = std::chrono::high_resolution_clock::now();
+        auto lastReport = startTime;
+        std::deque<sycl::event> inFlight;
+        size_t submitted = 0;
+        size_t completed = 0;
+        uint64_t completedPaths = 0;
+        while (completed < submitted || (submitted < total && !sampleSchedulerCancelled))
+        {
+            while (submitted < total && !sampleSchedulerCancelled && inFlight.size() <= static_cast<size_t>(std::max(_config._chunksInFlight, 0)))
+            {
+                inFlight.push_back(submitChunk(chunk(submitted)));
+                submitted++;
+            }
+            inFlight.front().wait_and_throw();
+            inFlight.pop_front();
+            completedPaths += chunkPaths(chunk(completed));
+            completed++;
+            reportProgress(completed, completedPaths, startTime, lastReport);
+        }
+        std::signal(SIGINT, previousHandler == SIG_ERR ? SIG_DFL : previousHandler);
+        reportEnd(completed);
+        return completed;
+    }
+
+    // Hands the chunks to workerCount host threads, one per device. A worker
+    // takes the next chunk as soon as work(worker, chunk) has run its last one
+    // to completion, so faster devices take more chunks. Cancellation as in
+    // run. Returns the number of chunks every worker completed.
+    template <typename Work>
+    std::vector<size_t> runDynamic(size_t workerCount, Work work)
+    {
+        size_t total = chunkCount();
+        reportStart(workerCount);
+        sampleSchedulerCancelled = false;
+        auto previousHandler = std::signal(SIGINT, sampleSchedulerInterrupt);
+        auto startTime = std::chrono::high_resolution_clock::now();
+        auto lastReport = startTime;
+        std::atomic<size_t> next(0);
+        std::mutex progressMutex;
+        std::exception_ptr error;
+        std::vector<size_t> workerChunks(workerCount, 0);
+        size_t completed = 0;
+        uint64_t completedPaths = 0;
+
+        std::vector<std::thread> workers;
+        workers.reserve(workerCount);
+        for (size_t w = 0; w < workerCount; w++)
+        {
+            workers.emplace_back([&, w]() {
+                try
+                {
+                    size_t k = 0;
+                    while (!sampleSchedulerCancelled && (k = next++) < total)
+                    {
+                        SampleChunk current = chunk(k);
+                        work(w, current);
+                        std::lock_guard<std::mutex> lock(progressMutex);
+                        workerChunks[w]++;
+                        completed++;
+                        completedPaths += chunkPaths(current);
+                        reportProgress(completed, completedPaths, startTime, lastReport);
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(progressMutex);
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                    sampleSchedulerCancelled = true;
+                }
+            });
+        }
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+        std::signal(SIGINT, previousHandler == SIG_ERR ? SIG_DFL : previousHandler);
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        reportEnd(completed);
+        return workerChunks;
+    }
+
+    private:
+
+    static uint64_t chunkPaths(const SampleChunk& chunk)
+    {
+        return static_cast<uint64_t>(chunk._width) * chunk._height * (chunk._sampleEnd - chunk._sampleBegin);
+    }
+
+    void reportStart(size_t workerCount)
+    {
+        std::cout << "[INFO] Sample scheduler: " << chunkCount() << " chunks of " << _config._tileWidth << "x" << _config._tileHeight
+                  << " pixels and " << _config._samplesPerChunk << " samples";
+        if (workerCount > 1)
+        {
+            std::cout << " on " << workerCount << " devices";
+        }
+        std::cout << std::endl;
+    }
+
+    void reportProgress(size_t completed, uint64_t completedPaths, std::chrono::high_resolution_clock::time_point startTime,
+                        std::chrono::high_resolution_clock::time_point& lastReport) const
+    {
+        size_t total = chunkCount();
+        auto now = std::chrono::high_resolution_clock::now();
+        if (completed != total && std::chrono::duration<double>(now - lastReport).count() < _config._progressSeconds)
+        {
+            return;
+        }
+        double elapsed = std::chrono::duration<double>(now - startTime).count();
+        double fraction = static_cast<double>(completed) / total;
+        std::cout << "[INFO] Progress: " << completed << "/" << total << " chunks (" << std::fixed << std::setprecision(1)
+                  << 100.0 * fraction << "%), " << completedPaths / std::max(elapsed, 1e-9) / 1e6 << " Mpaths/s, "
+                  << elapsed << " s elapsed, " << elapsed / fraction - elapsed << " s left" << std::defaultfloat << std::endl;
+        lastReport = now;
+    }
+
+    void reportEnd(size_t completed) const
+    {
+        if (completed < chunkCount())
+        {
+            std::cout << "[INFO] Sample scheduler cancelled after " << completed << " of " << chunkCount() << " chunks" << std::endl;
+        }
+    }
+};
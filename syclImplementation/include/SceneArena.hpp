@@ -0,0 +1,167 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+
+// Single USM allocation the scene arrays are carved from. The arrays are
+// reserved by name with their final sizes, the arena is allocated once and
+// every reserved block is handed out by take(). Arrays that are only known
+// after the build (SBVH references, derived BVH layouts) keep their own
+// allocations. The arena is moved to device memory as a whole.
+
+class SceneArena
+{
+    struct Block
+    {
+        std::string _name;
+        size_t _offset = 0;
+        size_t _bytes = 0;
+        bool _taken = false;
+    };
+
+    sycl::queue* _queue = nullptr;
+    char* _data = nullptr;
+    size_t _capacity = 0;
+    size_t _reserved = 0;
+    bool _device = false;
+    bool _hugePages = false;
+    std::vector<Block> _blocks;
+
+    public:
+
+    static constexpr size_t kAlignment = 64;             // every block starts on a cache line
+    static constexpr size_t kHugePageSize = 2 << 20;
+
+    SceneArena() = default;
+    SceneArena(const SceneArena&) = delete;
+    SceneArena& operator=(const SceneArena&) = delete;
+
+    template <typename T>
+    void reserve(const std::string& name, size_t count)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        Block block;
+        block._name = name;
+        block._offset = (_reserved + kAlignment - 1) & ~(kAlignment - 1);
+        block._bytes = sizeof(T) * count;
+        _reserved = block._offset + block._bytes;
+        _blocks.push_back(block);
+    }
+
+    // One shared allocation for everything reserved so far. With hugePages on
+    // a CPU device the allocation is aligned to 2 MB and advised as huge-page
+    // backed, other devices ignore the request.
+    bool allocate(sycl::queue& queue, bool hugePages)
+    {
+        release();
+        _queue = &queue;
+        if (_reserved == 0)
+        {
+            return false;
+        }
+        _hugePages = hugePages && queue.get_device().is_cpu();
+        size_t alignment = _hugePages ? kHugePageSize : kAlignment;
+        _capacity = (_reserved + alignment - 1) / alignment * alignment;
+        _data = static_cast<char*>(sycl::aligned_alloc_shared(alignment, _capacity, queue));
+        if (_data == nullptr)
+        {
+            _capacity = 0;
+            return false;
+        }
+        if (_hugePages && madvise(_data, _capacity, MADV_HUGEPAGE) != 0)
+        {
+            _hugePages = false;
+        }
+        std::cout << "[INFO] Scene arena: " << std::fixed << std::setprecision(2) << _capacity / 1048576.0
+                  << " MB in one shared allocation for " << _blocks.size() << " arrays"
+                  << (_hugePages ? ", huge pages" : "") << std::defaultfloat << std::endl;
+        return true;
+    }
+
+    // The block reserved under name, once, if its size still matches.
+    template <typename T>
+    T* take(const std::string& name, size_t count)
+    {
+        for (auto& block : _blocks)
+        {
+            if (_data != nullptr && !block._taken && block._name == name && block._bytes == sizeof(T) * count)
+            {
+                block._taken = true;
+                return reinterpret_cast<T*>(_data + block._offset);
+            }
+        }
+        return nullptr;
+    }
+
+    bool contains(const void* pointer) const
+    {
+        const char* bytes = static_cast<const char*>(pointer);
+        return _data != nullptr && bytes >= _data && bytes < _data + _capacity;
+    }
+
+    // Queues a copy of the whole arena into device memory and returns the old
+    // shared allocation, which the caller frees once the queue has drained.
+    // Pointers into the arena are translated with rebase().
+    void* moveToDevice()
+    {
+        if (_data == nullptr || _device)
+        {
+            return nullptr;
+        }
+        char* deviceData = static_cast<char*>(sycl::aligned_alloc_device(kAlignment, _capacity, *_queue));
+        _queue->memcpy(deviceData, _data, _capacity);
+        char* sharedData = _data;
+        _data = deviceData;
+        _device = true;
+        return sharedData;
+    }
+
+    template <typename T>
+    void rebase(T*& pointer, const void* oldData) const
+    {
+        const char* bytes = reinterpret_cast<const char*>(pointer);
+        const char* oldBytes = static_cast<const char*>(oldData);
+        if (pointer != nullptr && bytes >= oldBytes && bytes < oldBytes + _capacity)
+        {
+            pointer = reinterpret_cast<T*>(_data + (bytes - oldBytes));
+        }
+    }
+
+    size_t capacity() const
+    {
+        return _capacity;
+    }
+
+    void release()
+    {
+        if (_data != nullptr)
+        {
+            sycl::free(_data, *_queue);
+        }
+        _data = nullptr;
+        _capacity = 0;
+        _device = false;
+        _hugePages = false;
+    }
+
+    // forgets the reservations, e.g. before sizing a new scene
+    void clear()
+    {
+        release();
+        _blocks.clear();
+        _reserved = 0;
+    }
+
+    ~SceneArena()
+    {
+        release();
+    }
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include "sycl_obj_loader.hpp"
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Procedural counterpart of pythonScripts/scenGen.py: boxes, floors and walls
+// are added in memory and handed to ObjectListContent without writing or
+// parsing an OBJ. Random placement draws from a std::mt19937 seeded by the
+// caller, so a seed always reproduces the same scene. Boxes become analytic
+// Box primitives by default, or 12 triangles each like the exported OBJ.
+
+// The randomized Cornell box of scenGen.py; sizes in scene units.
+struct CornellBoxConfig
+{
+    Vec3 _roomSize = Vec3(512, 512, 512);
+    myComputeType _wallWidth = 7;
+    Vec3 _shortBlockSize = Vec3(160, 160, 165);          // width, height, depth
+    myComputeType _tallWidthJitter = 0.3f;               // tall block: up to 30% wider,
+    myComputeType _tallDepthJitter = 0.2f;               // 20% deeper than the short one
+    myComputeType _tallHeight = 330;
+    myComputeType _tallHeightJitter = 0.1f;              // +-10%
+    myComputeType _blockGap = 5;                         // minimum z gap between the blocks
+    myComputeType _blockZLimit = 265;                    // both blocks stay within |z| <= this
+    bool _backdrop = true;                               // ground plate and far wall around the room
+};
+
+
+class SceneBuilder
+{
+    std::vector<Triangle> _triangles;
+    std::vector<int> _materialIDs;
+    std::vector<size_t> _shapeOffsets;
+    std::vector<MaterialInfo> _materials;
+    std::map<std::string, int> _materialIndices;
+    AnalyticGeometry _analytic;
+    bool _analyticBoxes = true;
+    std::mt19937 _rng;
+
+    public:
+
+    SceneBuilder(uint32_t seed = 0, bool analyticBoxes = true) : _analyticBoxes(analyticBoxes), _rng(seed)
+    {
+    }
+
+    // starts the next scene, the materials are kept
+    void clear(uint32_t seed)
+    {
+        _triangles.clear();
+        _materialIDs.clear();
+        _shapeOffsets.clear();
+        _analytic = AnalyticGeometry();
+        _rng.seed(seed);
+    }
+
+    // The materials of scenGen.py, emission is the OBJ ambient term as in
+    // OBJ_Loader.
+    void addDefaultMaterials()
+    {
+        addMaterial("white", MaterialInfo(Vec3(0), Vec3(0), Vec3(0.725f, 0.71f, 0.68f)));
+        addMaterial("red", MaterialInfo(Vec3(0), Vec3(0), Vec3(0.63f, 0.065f, 0.05f)));
+        addMaterial("green", MaterialInfo(Vec3(0), Vec3(0), Vec3(0.14f, 0.45f, 0.091f)));
+        addMaterial("blue", MaterialInfo(Vec3(0), Vec3(0), Vec3(0, 0, 1)));
+    }
+
+    // adding a name twice replaces the material
+    int addMaterial(const std::string& name, const MaterialInfo& material)
+    {
+        auto found = _materialIndices.find(name);
+        if (found != _materialIndices.end())
+        {
+            _materials[found->second] = material;
+            return found->second;
+        }
+        _materials.push_back(material);
+        _materialIndices[name] = static_cast<int>(_materials.size()) - 1;
+        return _materialIndices[name];
+    }
+
+    int materialIndex(const std::string& name) const
+    {
+        auto found = _materialIndices.find(name);
+        if (found == _materialIndices.end())
+        {
+            throw std::runtime_error("SceneBuilder: unknown material " + name);
+        }
+        return found->second;
+    }
+
+    myComputeType uniform(myComputeType lo, myComputeType hi)
+    {
+        return std::uniform_real_distribution<myComputeType>(lo, hi)(_rng);
+    }
+
+    Vec3 uniform(const Vec3& lo, const Vec3& hi)
+    {
+        return Vec3(uniform(lo.x, hi.x), uniform(lo.y, hi.y), uniform(lo.z, hi.z));
+    }
+
+    // size and center as in scenGenLib.create_box_with_material
+    void addBox(const Vec3& size, const Vec3& center, const std::string& material)
+    {
+        int materialID = materialIndex(material);
+        Vec3 lo = center - size * 0.5f;
+        Vec3 hi = center + size * 0.5f;
+        if (_analyticBoxes)
+        {
+            _analytic._boxes.push_back(Box(lo, hi));
+            _analytic._boxMaterialIDs.push_back(materialID);
+            return;
+        }
+
+        // two outward facing triangles per face, the normal is edge1 x edge2
+        Vec3 dx(hi.x - lo.x, 0, 0), dy(0, hi.y - lo.y, 0), dz(0, 0, hi.z - lo.z);
+        _shapeOffsets.push_back(_triangles.size());
+        addQuadTriangles(lo, dz, dy, materialID);
+        addQuadTriangles(Vec3(hi.x, lo.y, lo.z), dy, dz, materialID);
+        addQuadTriangles(lo, dx, dz, materialID);
+        addQuadTriangles(Vec3(lo.x, hi.y, lo.z), dz, dx, materialID);
+        addQuadTriangles(lo, dy, dx, materialID);
+        addQuadTriangles(Vec3(lo.x, lo.y, hi.z), dx, dy, materialID);
+    }
+
+    // horizontal slab whose top face lies at height top
+    void addFloor(myComputeType width, myComputeType depth, myComputeType thickness, myComputeType top,
+                  const std::string& material, const Vec3& center = Vec3(0))
+    {
+        addBox(Vec3(width, thickness, depth), Vec3(center.x, top - thickness * 0.5f, center.z), material);
+    }
+
+    // vertical slab standing on bottom, normal along z
+    void addWall(myComputeType width, myComputeType height, myComputeType thickness, myComputeType bottom,
+                 const std::string& material, const Vec3& center = Vec3(0))
+    {
+        addBox(Vec3(width, height, thickness), Vec3(center.x, bottom + height * 0.5f, center.z), material);
+    }
+
+    // count boxes with sizes and centers drawn uniformly from the given ranges
+    void addRandomBoxes(size_t count, const Vec3& minSize, const Vec3& maxSize, const Vec3& minCenter, const Vec3& maxCenter,
+                        const std::string& material)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            Vec3 size = uniform(minSize, maxSize);
+            addBox(size, uniform(minCenter, maxCenter), material);
+        }
+    }
+
+    // same room and block placement as scenGen.py
+    void addCornellBox(const CornellBoxConfig& config = CornellBoxConfig())
+    {
+        const Vec3& room = config._roomSize;
+        myComputeType wall = config._wallWidth;
+        addBox(Vec3(room.x, wall, room.z), Vec3(0, 0.5f * wall, 0), "white");
+        addBox(Vec3(room.x, wall, room.z), Vec3(0, room.y + 0.5f * wall, 0), "white");
+        addBox(Vec3(room.x, room.y + wall, wall), Vec3(0, room.y / 2 + 0.5f * wall, -room.z / 2), "white");
+        addBox(Vec3(wall, room.y + wall, room.z), Vec3(-room.x / 2, room.y / 2 + 0.5f * wall, 0), "red");
+        addBox(Vec3(wall, room.y + wall, room.z), Vec3(room.x / 2, room.y / 2 + 0.5f * wall, 0), "green");
+        if (config._backdrop)
+        {
+            addBox(Vec3(room.x * 5, 1, room.z * 5), Vec3(0), "white");
+            addBox(Vec3(room.x * 5, room.y * 5, 1), Vec3(0, room.y * 5 / 2, -room.z / 2 - 300), "white");
+        }
+
+        const Vec3& shortBlock = config._shortBlockSize;
+        myComputeType tallWidth = shortBlock.x * (1 + uniform(0, config._tallWidthJitter));
+        myComputeType tallDepth = shortBlock.z * (1 + uniform(0, config._tallDepthJitter));
+        myComputeType tallHeight = config._tallHeight * (1 + uniform(-config._tallHeightJitter, config._tallHeightJitter));
+        myComputeType blockX = uniform(-room.x / 2 + tallWidth / 2, room.x / 2 - tallWidth / 2);
+        myComputeType zLimit = config._blockZLimit;
+        myComputeType shortZ = uniform(-zLimit + 0.5f * shortBlock.z, zLimit - config._blockGap - tallDepth - 0.5f * shortBlock.z);
+        myComputeType tallZ = uniform(shortZ + 0.5f * shortBlock.z + config._blockGap + 0.5f * tallDepth, zLimit - 0.5f * tallDepth);
+        addBox(Vec3(tallWidth, tallHeight, tallDepth), Vec3(blockX, tallHeight / 2 + 0.5f * wall, tallZ), "white");
+        addBox(shortBlock, Vec3(blockX, shortBlock.y / 2 + 0.5f * wall, shortZ), "white");
+    }
+
+    // the detector plate, as OBJ_Loader::addCamera adds it to a loaded scene
+    void addCamera(const Camera& camera)
+    {
+        int materialID = addMaterial("camera detector", MaterialInfo(Vec3(47.7688f, 38.5664f, 31.0928f), Vec3(47.7688f, 38.5664f, 31.0928f),
+                                                                     Vec3(47.7688f, 38.5664f, 31.0928f)));
+        auto detector = camera.generateDetector(camera.detectorWidth, camera.detectorHeight);
+        _shapeOffsets.push_back(_triangles.size());
+        _triangles.push_back(detector.first);
+        _triangles.push_back(detector.second);
+        _materialIDs.push_back(materialID);
+        _materialIDs.push_back(materialID);
+    }
+
+    // what OBJ_Loader::outputTrangleResult returns for the same scene
+    Triangle_OBJ_result result() const
+    {
+        Triangle_OBJ_result result;
+        result.Triangles = _triangles;
+        result.MaterialsInfoList = _materials;
+        result.materialIDs = _materialIDs;
+        result.shapeOffsets = _shapeOffsets;
+        result.Analytic = _analytic;
+        return result;
+    }
+
+    // Fills a fresh ObjectListContent, one per scene.
+    void build(ObjectListContent& content, const BVHBuildConfig& bvhConfig = BVHBuildConfig())
+    {
+        content.addObject(_triangles, _materials, _materialIDs, bvhConfig, &_analytic);
+    }
+
+    private:
+
+    void addQuadTriangles(const Vec3& origin, const Vec3& edge1, const Vec3& edge2, int materialID)
+    {
+        _triangles.push_back(Triangle(origin, origin + edge1, origin + edge1 + edge2));
+        _triangles.push_back(Triangle(origin, origin + edge1 + edge2, origin + edge2));
+        _materialIDs.push_back(materialID);
+        _materialIDs.push_back(materialID);
+    }
+};
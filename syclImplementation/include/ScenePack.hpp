@@ -0,0 +1,344 @@
+#pragma once
+
+#include "BVHArray.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary scene pack: the loaded triangles, the material table, the objects
+// in BVH order and the binary BVH nodes, written after a first load and
+// memory-mapped on later runs so neither the OBJ parse nor the BVH build is
+// repeated. A pack is only used when its key matches, the key hashes the
+// source OBJ/MTL bytes and the build parameters that shape the tree.
+
+constexpr uint32_t kScenePackVersion = 2;     // 2: BVH depth capped at kMaxBVHDepth
+
+enum class ScenePackSection : uint32_t
+{
+    TRIANGLES,
+    MATERIALS,
+    OBJECTS,
+    BVH_NODES,
+    BUILD_INFO
+};
+
+struct ScenePackBuildInfo
+{
+    myComputeType _sahCost = 0;
+};
+
+struct ScenePackHeader
+{
+    char _magic[8] = {'L', 'D', 'R', 'P', 'A', 'C', 'K', 0};
+    uint32_t _version = kScenePackVersion;
+    uint32_t _sectionCount = 0;
+    uint64_t _key = 0;
+};
+
+struct ScenePackEntry
+{
+    uint32_t _id = 0;
+    uint32_t _elementSize = 0;  // guards against a pack written with another myComputeType
+    uint64_t _offset = 0;       // from the start of the file, 64 byte aligned
+    uint64_t _count = 0;
+};
+
+
+// Read-only mapping of a whole file, unmapped on destruction.
+class MappedFile
+{
+    int _fd = -1;
+    void* _data = nullptr;
+    size_t _size = 0;
+
+    public:
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path)
+    {
+        close();
+        _fd = ::open(path.c_str(), O_RDONLY);
+        if (_fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (fstat(_fd, &info) != 0 || info.st_size == 0)
+        {
+            close();
+            return false;
+        }
+        _size = static_cast<size_t>(info.st_size);
+        _data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (_data == MAP_FAILED)
+        {
+            _data = nullptr;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (_data != nullptr)
+        {
+            munmap(_data, _size);
+        }
+        if (_fd >= 0)
+        {
+            ::close(_fd);
+        }
+        _fd = -1;
+        _data = nullptr;
+        _size = 0;
+    }
+
+    const char* data() const
+    {
+        return static_cast<const char*>(_data);
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    ~MappedFile()
+    {
+        close();
+    }
+};
+
+
+// 64-bit FNV-1a over everything that decides the content of a pack.
+class ScenePackKey
+{
+    uint64_t _hash = 14695981039346656037ULL;
+
+    public:
+
+    ScenePackKey()
+    {
+        addValue(kScenePackVersion);
+    }
+
+    void add(const void* data, size_t size)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++)
+        {
+            _hash ^= bytes[i];
+            _hash *= 1099511628211ULL;
+        }
+    }
+
+    template <typename T>
+    void addValue(const T& value)
+    {
+        add(&value, sizeof(T));
+    }
+
+    // the OBJ bytes, then every MTL file named by an mtllib line
+    bool addObjFile(const std::string& objFilePath, const std::string& objFile)
+    {
+        MappedFile obj;
+        if (!obj.open(objFilePath + objFile))
+        {
+            return false;
+        }
+        add(obj.data(), obj.size());
+
+        const std::string keyword = "mtllib";
+        const char* end = obj.data() + obj.size();
+        const char* cursor = obj.data();
+        std::boyer_moore_horspool_searcher<std::string::const_iterator> searcher(keyword.begin(), keyword.end());
+        while ((cursor = std::search(cursor, end, searcher)) != end)
+        {
+            bool lineStart = cursor == obj.data() || cursor[-1] == '\n';
+            cursor += keyword.size();
+            if (!lineStart)
+            {
+                continue;
+            }
+            const char* lineEnd = std::find(cursor, end, '\n');
+            std::istringstream names(std::string(cursor, lineEnd));
+            std::string name;
+            while (names >> name)
+            {
+                MappedFile mtl;
+                if (mtl.open(objFilePath + "/" + name))
+                {
+                    add(mtl.data(), mtl.size());
+                }
+                add(name.data(), name.size());
+            }
+            cursor = lineEnd;
+        }
+        return true;
+    }
+
+    // layout, leaf size and thread count only affect what is derived after loading
+    void addBuildConfig(const BVHBuildConfig& config)
+    {
+        addValue(config._method);
+        addValue(config._binCount);
+        addValue(config._leafCost);
+        addValue(config._traversalCost);
+        addValue(config._spatialSplitBudget);
+        addValue(config._spatialSplitAlpha);
+        addValue(sizeof(myComputeType));
+    }
+
+    uint64_t value() const
+    {
+        return _hash;
+    }
+};
+
+inline std::string scenePackPath(const std::string& cacheDir, const std::string& modelName, uint64_t key)
+{
+    std::string stem = modelName.substr(modelName.find_last_of('/') + 1);
+    stem = stem.substr(0, stem.find_last_of('.'));
+    std::ostringstream path;
+    path << cacheDir << "/" << stem << "." << std::hex << std::setw(16) << std::setfill('0') << key << ".lpack";
+    return path.str();
+}
+
+
+// Mapped pack, valid while the object lives. Sections point straight into
+// the mapping.
+class ScenePack
+{
+    MappedFile _file;
+    const ScenePackHeader* _header = nullptr;
+    const ScenePackEntry* _entries = nullptr;
+
+    public:
+
+    // false when the file is missing, truncated or written for another key
+    bool open(const std::string& path, uint64_t key)
+    {
+        _header = nullptr;
+        _entries = nullptr;
+        if (!_file.open(path) || _file.size() < sizeof(ScenePackHeader))
+        {
+            return false;
+        }
+        const ScenePackHeader* header = reinterpret_cast<const ScenePackHeader*>(_file.data());
+        if (std::memcmp(header->_magic, ScenePackHeader()._magic, sizeof(header->_magic)) != 0
+            || header->_version != kScenePackVersion || header->_key != key
+            || _file.size() < sizeof(ScenePackHeader) + header->_sectionCount * sizeof(ScenePackEntry))
+        {
+            return false;
+        }
+        const ScenePackEntry* entries = reinterpret_cast<const ScenePackEntry*>(_file.data() + sizeof(ScenePackHeader));
+        for (uint32_t i = 0; i < header->_sectionCount; i++)
+        {
+            if (entries[i]._offset + entries[i]._count * entries[i]._elementSize > _file.size())
+            {
+                return false;
+            }
+        }
+        _header = header;
+        _entries = entries;
+        return true;
+    }
+
+    template <typename T>
+    const T* section(ScenePackSection id, size_t& count) const
+    {
+        count = 0;
+        for (uint32_t i = 0; _header != nullptr && i < _header->_sectionCount; i++)
+        {
+            if (_entries[i]._id == static_cast<uint32_t>(id) && _entries[i]._elementSize == sizeof(T))
+            {
+                count = static_cast<size_t>(_entries[i]._count);
+                return reinterpret_cast<const T*>(_file.data() + _entries[i]._offset);
+            }
+        }
+        return nullptr;
+    }
+};
+
+
+// Collects the sections of a pack and writes them in one go. The file is
+// written under a temporary name and renamed, so a concurrent run never maps
+// a partial pack.
+class ScenePackWriter
+{
+    struct PendingSection
+    {
+        ScenePackEntry _entry;
+        const void* _data;
+    };
+    std::vector<PendingSection> _sections;
+
+    public:
+
+    template <typename T>
+    void addSection(ScenePackSection id, const T* data, size_t count)
+    {
+        PendingSection section;
+        section._entry._id = static_cast<uint32_t>(id);
+        section._entry._elementSize = sizeof(T);
+        section._entry._count = count;
+        section._data = data;
+        _sections.push_back(section);
+    }
+
+    bool write(const std::string& path, uint64_t key)
+    {
+        ScenePackHeader header;
+        header._key = key;
+        header._sectionCount = static_cast<uint32_t>(_sections.size());
+
+        uint64_t offset = sizeof(ScenePackHeader) + _sections.size() * sizeof(ScenePackEntry);
+        for (auto& section : _sections)
+        {
+            offset = (offset + 63) & ~uint64_t(63);
+            section._entry._offset = offset;
+            offset += section._entry._count * section._entry._elementSize;
+        }
+
+        std::string tempPath = path + ".tmp" + std::to_string(getpid());
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            return false;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (auto& section : _sections)
+        {
+            out.write(reinterpret_cast<const char*>(&section._entry), sizeof(ScenePackEntry));
+        }
+        const char padding[64] = {};
+        for (auto& section : _sections)
+        {
+            uint64_t position = static_cast<uint64_t>(out.tellp());
+            out.write(padding, section._entry._offset - position);
+            out.write(static_cast<const char*>(section._data), section._entry._count * section._entry._elementSize);
+        }
+        out.close();
+        if (!out)
+        {
+            std::remove(tempPath.c_str());
+            return false;
+        }
+        return std::rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+};
@@ -0,0 +1,500 @@
+#pragma once
+
+#include "BVHArray.hpp"
+#include "Geometry.hpp"
+#include <algorithm>
+#include <vector>
+
+// Spatial split BVH (Stich et al. 2009). Besides the binned object split a
+// node may cut its references with an axis-aligned plane; a reference that
+// straddles the plane is clipped into both children. The tree keeps the
+// BVHArray node format, one reference per leaf, with leaves numbered by
+// reference slot instead of object.
+
+inline bool isEmptyBounds(const Bounds3& bounds)
+{
+    return bounds.pMin.x > bounds.pMax.x || bounds.pMin.y > bounds.pMax.y || bounds.pMin.z > bounds.pMax.z;
+}
+
+inline myComputeType referenceArea(const Bounds3& bounds)
+{
+    return isEmptyBounds(bounds) ? 0 : bounds.SurfaceArea();
+}
+
+inline void setAxis(Vec3& v, int axis, myComputeType value)
+{
+    if (axis == 0) v.x = value;
+    else if (axis == 1) v.y = value;
+    else v.z = value;
+}
+
+// Bounds of the part of a geometry inside lo <= p[axis] <= hi, kept inside the
+// reference's current bounds since it may already be clipped on other axes.
+// Geometry without a clipping rule falls back to the slab of its box.
+inline Bounds3 clipReferenceBounds(const Geometry* geometry, const Bounds3& bounds, int axis,
+                                   myComputeType lo, myComputeType hi)
+{
+    lo = std::max(lo, bounds.pMin[axis]);
+    hi = std::min(hi, bounds.pMax[axis]);
+    Bounds3 clipped;
+    if (lo > hi)
+    {
+        return clipped;
+    }
+
+    Vec3 v[3];
+    bool clipTriangle = true;
+    switch (geometry->_type)
+    {
+    case GeometryType::TRIANGLE:
+    {
+        const Triangle* tri = static_cast<const Triangle*>(geometry);
+        v[0] = tri->_v1;
+        v[1] = tri->_v2;
+        v[2] = tri->_v3;
+        break;
+    }
+    case GeometryType::INDEXED_TRIANGLE:
+    {
+        const IndexedTriangle* tri = static_cast<const IndexedTriangle*>(geometry);
+        v[0] = tri->getVertex(0);
+        v[1] = tri->getVertex(1);
+        v[2] = tri->getVertex(2);
+        break;
+    }
+    default:
+        clipTriangle = false;
+        clipped = bounds;
+        break;
+    }
+
+    for (int i = 0; clipTriangle && i < 3; i++)
+    {
+        const Vec3& a = v[i];
+        const Vec3& b = v[(i + 1) % 3];
+        if (a[axis] >= lo && a[axis] <= hi)
+        {
+            clipped = Union(clipped, a);
+        }
+        for (myComputeType plane : {lo, hi})
+        {
+            if ((a[axis] - plane) * (b[axis] - plane) < 0)
+            {
+                Vec3 p = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+                setAxis(p, axis, plane);
+                clipped = Union(clipped, p);
+            }
+        }
+    }
+
+    if (isEmptyBounds(clipped))
+    {
+        return clipped;
+    }
+    clipped.pMin = Vec3(std::max(clipped.pMin.x, bounds.pMin.x), std::max(clipped.pMin.y, bounds.pMin.y), std::max(clipped.pMin.z, bounds.pMin.z));
+    clipped.pMax = Vec3(std::min(clipped.pMax.x, bounds.pMax.x), std::min(clipped.pMax.y, bounds.pMax.y), std::min(clipped.pMax.z, bounds.pMax.z));
+    setAxis(clipped.pMin, axis, std::max(clipped.pMin[axis], lo));
+    setAxis(clipped.pMax, axis, std::min(clipped.pMax[axis], hi));
+    return clipped;
+}
+
+
+struct SpatialSplitCandidate
+{
+    myComputeType _cost = std::numeric_limits<myComputeType>::max();
+    int _axis = -1;
+    int _bin = 0;                      // object split: last bin on the left side
+    myComputeType _position = 0;       // spatial split: plane position
+    Bounds3 _centroidBounds;
+    Bounds3 _leftBounds;
+    Bounds3 _rightBounds;
+};
+
+
+class SpatialSplitBuilder
+{
+    const std::vector<Geometry*>& _geometries;
+    const BVHBuildConfig& _config;
+    long _referenceBudget = 0;
+    long _referenceCount = 0;
+    myComputeType _minOverlapArea = 0;
+    std::vector<BVHNode>& _nodes;
+    std::vector<long>& _references;
+
+    public:
+
+    SpatialSplitBuilder(const std::vector<Geometry*>& geometries, const BVHBuildConfig& config,
+                        std::vector<BVHNode>& nodes, std::vector<long>& references)
+        : _geometries(geometries), _config(config), _nodes(nodes), _references(references)
+    {
+    }
+
+    long build(std::vector<BVHBuildPrimitive>& refs)
+    {
+        _referenceCount = static_cast<long>(refs.size());
+        _referenceBudget = static_cast<long>(refs.size() * (1.0f + std::max(_config._spatialSplitBudget, 0.0f)));
+        Bounds3 rootBounds;
+        for (auto& ref : refs)
+        {
+            rootBounds = Union(rootBounds, ref._bounds);
+        }
+        _minOverlapArea = _config._spatialSplitAlpha * referenceArea(rootBounds);
+        _nodes.reserve(2 * _referenceBudget);
+        _references.reserve(_referenceBudget);
+        return buildNode(refs, 0);
+    }
+
+    private:
+
+    int binCount() const
+    {
+        return std::max(_config._binCount, 2);
+    }
+
+    long buildNode(std::vector<BVHBuildPrimitive>& refs, int depth)
+    {
+        long nodeIndex = static_cast<long>(_nodes.size());
+        _nodes.emplace_back();
+
+        if (refs.size() == 1)
+        {
+            _nodes[nodeIndex]._objectIndex = static_cast<long>(_references.size());
+            _nodes[nodeIndex]._bounds = refs[0]._bounds;
+            _references.push_back(refs[0]._objectIndex);
+            return nodeIndex;
+        }
+
+        Bounds3 bounds;
+        Bounds3 centroidBounds;
+        for (auto& ref : refs)
+        {
+            bounds = Union(bounds, ref._bounds);
+            centroidBounds = Union(centroidBounds, ref._centroid);
+        }
+
+        // close to kMaxBVHDepth the references are halved, which ends the
+        // recursion in time; a candidate without an axis splits at the median
+        bool depthBudgetSpent = bvhDepthBudgetSpent(depth, static_cast<long>(refs.size()));
+        SpatialSplitCandidate objectSplit;
+        objectSplit._centroidBounds = centroidBounds;
+        if (!depthBudgetSpent)
+        {
+            objectSplit = findObjectSplit(refs, centroidBounds);
+        }
+        std::vector<BVHBuildPrimitive> leftRefs;
+        std::vector<BVHBuildPrimitive> rightRefs;
+
+        // spatial splits only pay off where the object split children overlap
+        bool split = false;
+        if (!depthBudgetSpent && _referenceCount < _referenceBudget && overlapArea(objectSplit) > _minOverlapArea)
+        {
+            SpatialSplitCandidate spatialSplit = findSpatialSplit(refs, bounds);
+            if (spatialSplit._cost < objectSplit._cost)
+            {
+                split = performSpatialSplit(refs, spatialSplit, leftRefs, rightRefs);
+            }
+        }
+        if (!split)
+        {
+            performObjectSplit(refs, objectSplit, leftRefs, rightRefs);
+        }
+        std::vector<BVHBuildPrimitive>().swap(refs);
+
+        long leftIndex = buildNode(leftRefs, depth + 1);
+        long rightIndex = buildNode(rightRefs, depth + 1);
+        _nodes[nodeIndex]._leftIndex = leftIndex;
+        _nodes[nodeIndex]._rightIndex = rightIndex;
+        _nodes[nodeIndex]._bounds = Union(_nodes[leftIndex]._bounds, _nodes[rightIndex]._bounds);
+        return nodeIndex;
+    }
+
+    static myComputeType overlapArea(const SpatialSplitCandidate& candidate)
+    {
+        if (candidate._axis < 0)
+        {
+            return 0;
+        }
+        const Bounds3& l = candidate._leftBounds;
+        const Bounds3& r = candidate._rightBounds;
+        Bounds3 overlap;
+        overlap.pMin = Vec3(std::max(l.pMin.x, r.pMin.x), std::max(l.pMin.y, r.pMin.y), std::max(l.pMin.z, r.pMin.z));
+        overlap.pMax = Vec3(std::min(l.pMax.x, r.pMax.x), std::min(l.pMax.y, r.pMax.y), std::min(l.pMax.z, r.pMax.z));
+        return referenceArea(overlap);
+    }
+
+    int objectBin(const BVHBuildPrimitive& ref, const Bounds3& centroidBounds, int axis) const
+    {
+        myComputeType extent = centroidBounds.pMax[axis] - centroidBounds.pMin[axis];
+        int bin = static_cast<int>(binCount() * ((ref._centroid[axis] - centroidBounds.pMin[axis]) / extent));
+        return std::min(std::max(bin, 0), binCount() - 1);
+    }
+
+    SpatialSplitCandidate findObjectSplit(const std::vector<BVHBuildPrimitive>& refs, const Bounds3& centroidBounds) const
+    {
+        SpatialSplitCandidate best;
+        best._centroidBounds = centroidBounds;
+        const int bins = binCount();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (centroidBounds.pMax[axis] <= centroidBounds.pMin[axis])
+            {
+                continue;
+            }
+            std::vector<Bounds3> binBounds(bins);
+            std::vector<long> binCounts(bins, 0);
+            for (auto& ref : refs)
+            {
+                int bin = objectBin(ref, centroidBounds, axis);
+                binBounds[bin] = Union(binBounds[bin], ref._bounds);
+                binCounts[bin]++;
+            }
+
+            std::vector<Bounds3> rightBounds(bins);
+            std::vector<long> rightCounts(bins, 0);
+            for (int bin = bins - 1; bin > 0; bin--)
+            {
+                rightBounds[bin - 1] = bin == bins - 1 ? binBounds[bin] : Union(rightBounds[bin], binBounds[bin]);
+                rightCounts[bin - 1] = (bin == bins - 1 ? 0 : rightCounts[bin]) + binCounts[bin];
+            }
+
+            Bounds3 leftBounds;
+            long leftCount = 0;
+            for (int bin = 0; bin < bins - 1; bin++)
+            {
+                leftBounds = Union(leftBounds, binBounds[bin]);
+                leftCount += binCounts[bin];
+                if (leftCount == 0 || rightCounts[bin] == 0)
+                {
+                    continue;
+                }
+                myComputeType cost = _config._leafCost * (leftCount * referenceArea(leftBounds) + rightCounts[bin] * referenceArea(rightBounds[bin]));
+                if (cost < best._cost)
+                {
+                    best._cost = cost;
+                    best._axis = axis;
+                    best._bin = bin;
+                    best._leftBounds = leftBounds;
+                    best._rightBounds = rightBounds[bin];
+                }
+            }
+        }
+        return best;
+    }
+
+    SpatialSplitCandidate findSpatialSplit(const std::vector<BVHBuildPrimitive>& refs, const Bounds3& bounds) const
+    {
+        SpatialSplitCandidate best;
+        const int bins = binCount();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            myComputeType origin = bounds.pMin[axis];
+            myComputeType width = (bounds.pMax[axis] - origin) / bins;
+            if (width <= 0)
+            {
+                continue;
+            }
+
+            std::vector<Bounds3> binBounds(bins);
+            std::vector<long> entries(bins, 0);
+            std::vector<long> exits(bins, 0);
+            for (auto& ref : refs)
+            {
+                int first = std::min(std::max(static_cast<int>((ref._bounds.pMin[axis] - origin) / width), 0), bins - 1);
+                int last = std::min(std::max(static_cast<int>((ref._bounds.pMax[axis] - origin) / width), first), bins - 1);
+                for (int bin = first; bin <= last; bin++)
+                {
+                    myComputeType lo = origin + bin * width;
+                    myComputeType hi = bin == bins - 1 ? bounds.pMax[axis] : lo + width;
+                    Bounds3 clipped = clipReferenceBounds(_geometries[ref._objectIndex], ref._bounds, axis, lo, hi);
+                    if (!isEmptyBounds(clipped))
+                    {
+                        binBounds[bin] = Union(binBounds[bin], clipped);
+                    }
+                }
+                entries[first]++;
+                exits[last]++;
+            }
+
+            std::vector<Bounds3> rightBounds(bins);
+            std::vector<long> rightCounts(bins, 0);
+            for (int bin = bins - 1; bin > 0; bin--)
+            {
+                rightBounds[bin - 1] = bin == bins - 1 ? binBounds[bin] : Union(rightBounds[bin], binBounds[bin]);
+                rightCounts[bin - 1] = (bin == bins - 1 ? 0 : rightCounts[bin]) + exits[bin];
+            }
+
+            Bounds3 leftBounds;
+            long leftCount = 0;
+            for (int bin = 0; bin < bins - 1; bin++)
+            {
+                leftBounds = Union(leftBounds, binBounds[bin]);
+                leftCount += entries[bin];
+                if (leftCount == 0 || rightCounts[bin] == 0)
+                {
+                    continue;
+                }
+                myComputeType cost = _config._leafCost * (leftCount * referenceArea(leftBounds) + rightCounts[bin] * referenceArea(rightBounds[bin]));
+                if (cost < best._cost)
+                {
+                    best._cost = cost;
+                    best._axis = axis;
+                    best._position = origin + (bin + 1) * width;
+                    best._leftBounds = leftBounds;
+                    best._rightBounds = rightBounds[bin];
+                }
+            }
+        }
+        return best;
+    }
+
+    void performObjectSplit(std::vector<BVHBuildPrimitive>& refs, const SpatialSplitCandidate& split,
+                            std::vector<BVHBuildPrimitive>& leftRefs, std::vector<BVHBuildPrimitive>& rightRefs) const
+    {
+        if (split._axis >= 0)
+        {
+            for (auto& ref : refs)
+            {
+                (objectBin(ref, split._centroidBounds, split._axis) <= split._bin ? leftRefs : rightRefs).push_back(ref);
+            }
+            if (!leftRefs.empty() && !rightRefs.empty())
+            {
+                return;
+            }
+            leftRefs.clear();
+            rightRefs.clear();
+        }
+
+        // coincident centroids: halve the references along the widest axis
+        int axis = split._centroidBounds.maxExtent();
+        auto mid = refs.begin() + refs.size() / 2;
+        std::nth_element(refs.begin(), mid, refs.end(), [axis](const BVHBuildPrimitive& a, const BVHBuildPrimitive& b) {
+            return a._centroid[axis] < b._centroid[axis];
+        });
+        leftRefs.assign(refs.begin(), mid);
+        rightRefs.assign(mid, refs.end());
+    }
+
+    // Straddling references are clipped into both sides unless moving them
+    // entirely to one side is cheaper (reference unsplitting) or the
+    // reference budget is spent.
+    bool performSpatialSplit(const std::vector<BVHBuildPrimitive>& refs, const SpatialSplitCandidate& split,
+                             std::vector<BVHBuildPrimitive>& leftRefs, std::vector<BVHBuildPrimitive>& rightRefs)
+    {
+        const int axis = split._axis;
+        const myComputeType position = split._position;
+        Bounds3 leftBounds;
+        Bounds3 rightBounds;
+        std::vector<const BVHBuildPrimitive*> straddling;
+        std::vector<Bounds3> leftParts;
+        std::vector<Bounds3> rightParts;
+
+        for (auto& ref : refs)
+        {
+            if (ref._bounds.pMax[axis] <= position)
+            {
+                leftRefs.push_back(ref);
+                leftBounds = Union(leftBounds, ref._bounds);
+                continue;
+            }
+            if (ref._bounds.pMin[axis] >= position)
+            {
+                rightRefs.push_back(ref);
+                rightBounds = Union(rightBounds, ref._bounds);
+                continue;
+            }
+            const Geometry* geometry = _geometries[ref._objectIndex];
+            Bounds3 leftPart = clipReferenceBounds(geometry, ref._bounds, axis, ref._bounds.pMin[axis], position);
+            Bounds3 rightPart = clipReferenceBounds(geometry, ref._bounds, axis, position, ref._bounds.pMax[axis]);
+            // the box straddles the plane but the geometry itself does not
+            if (isEmptyBounds(leftPart))
+            {
+                rightRefs.push_back(ref);
+                rightBounds = Union(rightBounds, ref._bounds);
+                continue;
+            }
+            if (isEmptyBounds(rightPart))
+            {
+                leftRefs.push_back(ref);
+                leftBounds = Union(leftBounds, ref._bounds);
+                continue;
+            }
+            straddling.push_back(&ref);
+            leftParts.push_back(leftPart);
+            rightParts.push_back(rightPart);
+            leftBounds = Union(leftBounds, leftPart);
+            rightBounds = Union(rightBounds, rightPart);
+        }
+
+        long leftCount = static_cast<long>(leftRefs.size() + straddling.size());
+        long rightCount = static_cast<long>(rightRefs.size() + straddling.size());
+        long added = 0;
+        for (size_t i = 0; i < straddling.size(); i++)
+        {
+            const BVHBuildPrimitive& ref = *straddling[i];
+            myComputeType splitCost = referenceArea(leftBounds) * leftCount + referenceArea(rightBounds) * rightCount;
+            myComputeType leftCost = referenceArea(Union(leftBounds, ref._bounds)) * leftCount + referenceArea(rightBounds) * (rightCount - 1);
+            myComputeType rightCost = referenceArea(leftBounds) * (leftCount - 1) + referenceArea(Union(rightBounds, ref._bounds)) * rightCount;
+            bool budgetLeft = _referenceCount + added < _referenceBudget;
+
+            if (budgetLeft && splitCost <= leftCost && splitCost <= rightCost)
+            {
+                BVHBuildPrimitive leftRef = ref;
+                leftRef._bounds = leftParts[i];
+                leftRef._centroid = leftParts[i].Centroid();
+                BVHBuildPrimitive rightRef = ref;
+                rightRef._bounds = rightParts[i];
+                rightRef._centroid = rightParts[i].Centroid();
+                leftRefs.push_back(leftRef);
+                rightRefs.push_back(rightRef);
+                added++;
+            }
+            else if (leftCost <= rightCost)
+            {
+                leftRefs.push_back(ref);
+                leftBounds = Union(leftBounds, ref._bounds);
+                rightCount--;
+            }
+            else
+            {
+                rightRefs.push_back(ref);
+                rightBounds = Union(rightBounds, ref._bounds);
+                leftCount--;
+            }
+        }
+
+        // each side must shrink, otherwise the recursion would not end
+        if (leftRefs.empty() || rightRefs.empty() || leftRefs.size() >= refs.size() || rightRefs.size() >= refs.size())
+        {
+            leftRefs.clear();
+            rightRefs.clear();
+            return false;
+        }
+        _referenceCount += added;
+        return true;
+    }
+};
+
+
+// Builds the tree into nodes and returns, per leaf slot, the object it refers
+// to. A spatially split object owns several slots.
+inline void buildSpatialSplitBVH(const std::vector<Geometry*>& geometries, const BVHBuildConfig& config,
+                          std::vector<BVHNode>& nodes, std::vector<long>& references)
+{
+    nodes.clear();
+    references.clear();
+    if (geometries.empty())
+    {
+        return;
+    }
+
+    std::vector<BVHBuildPrimitive> refs(geometries.size());
+    for (size_t i = 0; i < geometries.size(); i++)
+    {
+        refs[i]._bounds = geometries[i]->getBounds();
+        refs[i]._centroid = refs[i]._bounds.Centroid();
+        refs[i]._objectIndex = static_cast<long>(i);
+    }
+
+    SpatialSplitBuilder builder(geometries, config, nodes, references);
+    builder.build(refs);
+}
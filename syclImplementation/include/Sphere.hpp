@@ -0,0 +1,66 @@
+#pragma once
+#include "Geometry.hpp"
+#include "common.hpp"
+
+// Sphere with outward normals. Only the near intersection counts, so like
+// the closed meshes a ray starting inside leaves it without a hit.
+class Sphere : public Geometry
+{
+    public:
+
+        Vec3 _center;
+        myComputeType _radius = 0;
+
+        Sphere()
+            : Geometry(GeometryType::SPHERE){}
+        Sphere(const Vec3& center, myComputeType radius) : Geometry(GeometryType::SPHERE), _center(center), _radius(radius) {}
+
+    Intersection getIntersection_virtual(const Ray& ray) const
+    {
+        Intersection intersection;
+        Vec3 offset = ray.origin - _center;
+        myComputeType a = dotProduct(ray.direction, ray.direction);
+        myComputeType halfB = dotProduct(offset, ray.direction);
+        myComputeType c = dotProduct(offset, offset) - _radius * _radius;
+        myComputeType discriminant = halfB * halfB - a * c;
+        if (discriminant < 0 || c < 0)
+        {
+            return intersection;
+        }
+        myComputeType t_tmp = (-halfB - sycl::sqrt(discriminant)) / a;
+        if (t_tmp < -MyEPSILON)
+        {
+            return intersection;
+        }
+
+        intersection._hit = true;
+        intersection._position = ray.origin + ray.direction * t_tmp;
+        intersection._normal = (intersection._position - _center) / _radius;
+        intersection._distance = t_tmp;
+        return intersection;
+    }
+
+    myComputeType getArea_virtual() const
+    {
+        return 4.0f * M_PI * _radius * _radius;
+    }
+
+    SamplingRecord Sample_virtual(RNG &rng)
+    {
+        myComputeType z = 1.0f - 2.0f * get_random_float(rng);
+        myComputeType r = sycl::sqrt(sycl::fmax((myComputeType)0.0f, 1.0f - z * z));
+        myComputeType phi = 2.0f * M_PI * get_random_float(rng);
+        Vec3 normal(r * sycl::cos(phi), r * sycl::sin(phi), z);
+
+        SamplingRecord record;
+        record.pdf = 1.0f / getArea_virtual();
+        record.pos._position = _center + normal * _radius;
+        record.pos._normal = normal;
+        return record;
+    }
+
+    Bounds3 getBounds_virtual() const
+    {
+        return Bounds3(_center - Vec3(_radius), _center + Vec3(_radius));
+    }
+};
@@ -44,6 +44,10 @@ class Triangle : public Geometry
     {
          return Union(Bounds3(_v1, _v2), _v3); 
     }
+
+    const Vec3& getEdge1() const { return e1; }
+    const Vec3& getEdge2() const { return e2; }
+    const Vec3& getNormal() const { return normal; }
     
 
     private:
@@ -55,7 +59,8 @@ class Triangle : public Geometry
 };
 
 
-Intersection Triangle::getIntersection_virtual(const Ray& ray) const 
+// Shared by Triangle and the flattened primitive store so both report identical hits.
+inline Intersection intersectTriangle(const Vec3& v1, const Vec3& e1, const Vec3& e2, const Vec3& normal, const Ray& ray)
 {
     Intersection intersection;
 
@@ -78,7 +83,7 @@ Intersection Triangle::getIntersection_virtual(const Ray& ray) const
     }
 
     myComputeType inv_det = 1.0f / det;
-    Vec3 tvec = ray.origin - _v1;
+    Vec3 tvec = ray.origin - v1;
     u = dotProduct(tvec, pvec) * inv_det;
 
     // Adding numerical tolerance to avoid false rejections
@@ -116,6 +121,12 @@ Intersection Triangle::getIntersection_virtual(const Ray& ray) const
 }
 
 
+inline Intersection Triangle::getIntersection_virtual(const Ray& ray) const 
+{
+    return intersectTriangle(_v1, e1, e2, normal, ray);
+}
+
+
 #include <iostream>
 
 inline std::ostream& operator<<(std::ostream& os, const Triangle& tri)
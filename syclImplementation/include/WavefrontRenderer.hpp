@@ -0,0 +1,351 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+#include "syclScene.hpp"
+#include "Camera.hpp"
+#include "FileProcessor.hpp"
+#include "LinearBVH.hpp"
+#include <oneapi/dpl/execution>
+#include <oneapi/dpl/algorithm>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Wavefront alternative to the megakernel in Test.cpp, where every work-item
+// runs doRendering for its samples and lanes idle once their paths end. Here
+// a bounce is split into four kernels over a queue of live paths in device
+// memory:
+//   generate  tops the queue up with new camera paths
+//   extend    finds the closest hit of every queued ray
+//   shade     syclScene::shade; survivors are compacted into the other queue,
+//             paths that reached an emitter are listed for recording
+//   record    writes the CollisionRecords of the listed paths
+// Every path keeps the RNG the megakernel seeds for its pixel and sample, so
+// both engines produce the same records, only in a different order.
+//
+// After the first bounce the survivors point in random directions. With
+// _reorder set they are sorted by direction octant and the Morton code of
+// their origin cell before the queue is topped up, so neighbouring
+// work-items traverse the same part of the BVH. Camera rays are coherent
+// already and stay in pixel order behind them. _profile times every extend;
+// when the queue holds all paths at once, iteration k traces depth k.
+
+struct WavefrontPath
+{
+    Vec3 _origin;
+    Vec3 _direction;
+    RNG _rng;
+    resultRecordStructure _result;
+    int _pixelX = 0;
+    int _pixelY = 0;
+    int _depth = 0;
+};
+
+// the values the megakernel captures
+struct WavefrontSettings
+{
+    int _imageWidth = 0;
+    int _imageHeight = 0;
+    int _ssp = 0;
+    unsigned int _seed = 0;
+    int _widthUnit = 1;
+    int _heightUnit = 1;
+    myComputeType _delayMean = 0;
+    myComputeType _delayStd = 0;
+    bool _reorder = false;
+    int _reorderBits = 10;          // Morton bits per axis of the origin grid, at most 20
+    Bounds3 _sceneBounds;           // extent of the origin grid
+    bool _profile = false;          // waits for every extend to time it
+};
+
+struct WavefrontBatch
+{
+    size_t _rays = 0;
+    size_t _sortedRays = 0;
+    double _sortSeconds = 0;
+    double _extendSeconds = 0;
+};
+
+struct WavefrontStats
+{
+    uint64_t _paths = 0;
+    uint64_t _rays = 0;         // extend work-items, one per bounce of every path
+    int _iterations = 0;
+    double _seconds = 0;
+    std::vector<WavefrontBatch> _batches;       // one per iteration when profiling
+};
+
+
+// direction octant above the Morton code of the origin cell
+inline uint64_t rayReorderKey(const Vec3& origin, const Vec3& direction, const Bounds3& bounds, int bits)
+{
+    const myComputeType scale = static_cast<myComputeType>((1 << bits) - 1);
+    Vec3 extent = bounds.Diagonal();
+    myComputeType x = extent.x > 0 ? (origin.x - bounds.pMin.x) / extent.x : 0.5f;
+    myComputeType y = extent.y > 0 ? (origin.y - bounds.pMin.y) / extent.y : 0.5f;
+    myComputeType z = extent.z > 0 ? (origin.z - bounds.pMin.z) / extent.z : 0.5f;
+    uint64_t qx = static_cast<uint64_t>(sycl::fmin(sycl::fmax(x * scale, (myComputeType)0), scale));
+    uint64_t qy = static_cast<uint64_t>(sycl::fmin(sycl::fmax(y * scale, (myComputeType)0), scale));
+    uint64_t qz = static_cast<uint64_t>(sycl::fmin(sycl::fmax(z * scale, (myComputeType)0), scale));
+    uint64_t octant = (direction.x < 0 ? 1 : 0) | (direction.y < 0 ? 2 : 0) | (direction.z < 0 ? 4 : 0);
+    return octant << (3 * bits) | (expandMortonBits(qx) << 2) | (expandMortonBits(qy) << 1) | expandMortonBits(qz);
+}
+
+
+class WavefrontRenderer
+{
+    sycl::queue& _queue;
+    size_t _capacity;
+    WavefrontPath* _paths[2] = {nullptr, nullptr};
+    Intersection* _hits = nullptr;
+    unsigned int* _finished = nullptr;      // queue positions of the paths to record
+    unsigned int* _counters = nullptr;      // [0] survivors, [1] finished paths of the current bounce
+    uint64_t* _sortKeys = nullptr;          // allocated with the first reorder
+    unsigned int* _sortOrder = nullptr;
+
+    public:
+
+    // capacity is the number of paths in flight; both queues and the hit
+    // array are sized for it once
+    WavefrontRenderer(sycl::queue& queue, size_t capacity = 1 << 20) : _queue(queue), _capacity(std::max(capacity, size_t(1)))
+    {
+        _paths[0] = sycl::malloc_device<WavefrontPath>(_capacity, _queue);
+        _paths[1] = sycl::malloc_device<WavefrontPath>(_capacity, _queue);
+        _hits = sycl::malloc_device<Intersection>(_capacity, _queue);
+        _finished = sycl::malloc_device<unsigned int>(_capacity, _queue);
+        _counters = sycl::malloc_shared<unsigned int>(2, _queue);
+    }
+
+    WavefrontRenderer(const WavefrontRenderer&) = delete;
+    WavefrontRenderer& operator=(const WavefrontRenderer&) = delete;
+
+    ~WavefrontRenderer()
+    {
+        sycl::free(_paths[0], _queue);
+        sycl::free(_paths[1], _queue);
+        sycl::free(_hits, _queue);
+        sycl::free(_finished, _queue);
+        sycl::free(_counters, _queue);
+        if (_sortKeys != nullptr)
+        {
+            sycl::free(_sortKeys, _queue);
+            sycl::free(_sortOrder, _queue);
+        }
+    }
+
+    // Traces imageWidth * imageHeight * ssp paths and appends their records to
+    // collision_buf, counting them in counter_buf as the megakernel does.
+    WavefrontStats render(sycl::buffer<syclScene, 1>& scenebuf, sycl::buffer<Camera, 1>& camerabuf, const WavefrontSettings& settings,
+                          sycl::buffer<CollisionRecord>& collision_buf, sycl::buffer<int, 1>& counter_buf)
+    {
+        WavefrontStats stats;
+        stats._paths = static_cast<uint64_t>(settings._imageWidth) * settings._imageHeight * settings._ssp;
+        auto startTime = std::chrono::high_resolution_clock::now();
+
+        uint64_t issued = 0;
+        size_t active = 0;
+        int current = 0;
+        // the last bounce's record still reads its queue and the finished list,
+        // which the next reorder, generate and shade overwrite
+        sycl::event recorded;
+        while (active > 0 || issued < stats._paths)
+        {
+            WavefrontBatch batch;
+            if (settings._reorder && active > 1)
+            {
+                auto sortStart = std::chrono::high_resolution_clock::now();
+                reorder(settings, _paths[current], _paths[1 - current], active, recorded);
+                current = 1 - current;
+                batch._sortedRays = active;
+                batch._sortSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - sortStart).count();
+            }
+
+            // the queue is out of order and USM is not tracked, so the
+            // kernels of one bounce are chained through their events
+            size_t fresh = static_cast<size_t>(std::min<uint64_t>(_capacity - active, stats._paths - issued));
+            sycl::event ready = recorded;
+            if (fresh > 0)
+            {
+                ready = generate(camerabuf, settings, _paths[current] + active, issued, fresh, recorded);
+            }
+            issued += fresh;
+            size_t count = active + fresh;
+
+            _counters[0] = 0;
+            _counters[1] = 0;
+            std::chrono::high_resolution_clock::time_point extendStart;
+            if (settings._profile)
+            {
+                ready.wait();
+                extendStart = std::chrono::high_resolution_clock::now();
+            }
+            sycl::event extended = extend(scenebuf, _paths[current], count, ready);
+            if (settings._profile)
+            {
+                extended.wait();
+                batch._rays = count;
+                batch._extendSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - extendStart).count();
+                stats._batches.push_back(batch);
+            }
+            shade(scenebuf, _paths[current], _paths[1 - current], count, extended);
+            _queue.wait_and_throw();
+
+            size_t finished = _counters[1];
+            if (finished > 0)
+            {
+                recorded = record(camerabuf, settings, _paths[current], finished, collision_buf, counter_buf);
+            }
+            stats._rays += count;
+            stats._iterations++;
+            active = _counters[0];
+            current = 1 - current;
+        }
+        _queue.wait_and_throw();
+        auto endTime = std::chrono::high_resolution_clock::now();
+        stats._seconds = std::chrono::duration<double>(endTime - startTime).count();
+        return stats;
+    }
+
+    private:
+
+    // sorts the first count paths by rayReorderKey into sorted
+    void reorder(const WavefrontSettings& settings, const WavefrontPath* paths, WavefrontPath* sorted, size_t count, sycl::event dependency)
+    {
+        if (_sortKeys == nullptr)
+        {
+            _sortKeys = sycl::malloc_device<uint64_t>(_capacity, _queue);
+            _sortOrder = sycl::malloc_device<unsigned int>(_capacity, _queue);
+        }
+        uint64_t* keys = _sortKeys;
+        unsigned int* order = _sortOrder;
+        Bounds3 bounds = settings._sceneBounds;
+        int bits = std::min(std::max(settings._reorderBits, 1), 20);
+        _queue.submit([&](sycl::handler& cgh) {
+            cgh.depends_on(dependency);
+            cgh.parallel_for(sycl::range<1>(count), [=](sycl::id<1> index) {
+                const WavefrontPath& path = paths[index[0]];
+                keys[index[0]] = rayReorderKey(path._origin, path._direction, bounds, bits);
+                order[index[0]] = static_cast<unsigned int>(index[0]);
+            });
+        }).wait();
+
+        oneapi::dpl::sort_by_key(oneapi::dpl::execution::make_device_policy(_queue), keys, keys + count, order);
+
+        _queue.parallel_for(sycl::range<1>(count), [=](sycl::id<1> index) {
+            sorted[index[0]] = paths[order[index[0]]];
+        }).wait();
+    }
+
+    sycl::event generate(sycl::buffer<Camera, 1>& camerabuf, const WavefrontSettings& settings, WavefrontPath* paths, uint64_t first, size_t count,
+                         sycl::event dependency)
+    {
+        WavefrontSettings s = settings;
+        return _queue.submit([&](sycl::handler& cgh) {
+            cgh.depends_on(dependency);
+            auto cameraAcc = camerabuf.template get_access<sycl::access::mode::read>(cgh);
+            cgh.parallel_for(sycl::range<1>(count), [=](sycl::id<1> index) {
+                // path p is sample p / (width * height) of pixel p % (width * height)
+                uint64_t p = first + index[0];
+                int i = static_cast<int>(p % s._imageWidth);
+                int j = static_cast<int>(p / s._imageWidth % s._imageHeight);
+                int sample = static_cast<int>(p / (static_cast<uint64_t>(s._imageWidth) * s._imageHeight));
+
+                WavefrontPath path;
+                path._rng = RNG(s._seed + i + j * s._imageWidth + sample * s._ssp);
+                path._direction = cameraAcc[0].getRayDirection(i, j, path._rng);
+                path._origin = cameraAcc[0].getPosition();
+                path._result._emission_delay = sample_delay_distance(s._delayMean, s._delayStd, path._rng);
+                path._pixelX = i;
+                path._pixelY = j;
+                paths[index[0]] = path;
+            });
+        });
+    }
+
+    sycl::event extend(sycl::buffer<syclScene, 1>& scenebuf, WavefrontPath* paths, size_t count, sycl::event dependency)
+    {
+        Intersection* hits = _hits;
+        return _queue.submit([&](sycl::handler& cgh) {
+            cgh.depends_on(dependency);
+            auto sceneAcc = scenebuf.template get_access<sycl::access::mode::read>(cgh);
+            cgh.parallel_for(sycl::range<1>(count), [=](sycl::id<1> index) {
+                const WavefrontPath& path = paths[index[0]];
+                hits[index[0]] = sceneAcc[0].castRay(Ray(path._origin, path._direction));
+            });
+        });
+    }
+
+    sycl::event shade(sycl::buffer<syclScene, 1>& scenebuf, WavefrontPath* paths, WavefrontPath* nextPaths, size_t count, sycl::event dependency)
+    {
+        const Intersection* hits = _hits;
+        unsigned int* finished = _finished;
+        unsigned int* counters = _counters;
+        return _queue.submit([&](sycl::handler& cgh) {
+            cgh.depends_on(dependency);
+            auto sceneAcc = scenebuf.template get_access<sycl::access::mode::read>(cgh);
+            cgh.parallel_for(sycl::range<1>(count), [=](sycl::id<1> index) {
+                WavefrontPath path = paths[index[0]];
+                Ray ray(path._origin, path._direction);
+                path._result._rayCount++;
+                PathEvent event = sceneAcc[0].shade(hits[index[0]], ray, path._rng, path._result);
+                if (event == PathEvent::EMITTED)
+                {
+                    paths[index[0]] = path;
+                    auto finishedCounter = sycl::atomic_ref<
+                        unsigned int,
+                        sycl::ext::oneapi::detail::memory_order::relaxed,
+                        sycl::ext::oneapi::detail::memory_scope::device,
+                        sycl::access::address_space::global_space>(counters[1]);
+                    finished[finishedCounter.fetch_add(1u)] = static_cast<unsigned int>(index[0]);
+                }
+                else if (event == PathEvent::SCATTERED && ++path._depth < syclScene::kMaxDepth)
+                {
+                    path._origin = ray.origin;
+                    path._direction = ray.direction;
+                    auto survivorCounter = sycl::atomic_ref<
+                        unsigned int,
+                        sycl::ext::oneapi::detail::memory_order::relaxed,
+                        sycl::ext::oneapi::detail::memory_scope::device,
+                        sycl::access::address_space::global_space>(counters[0]);
+                    nextPaths[survivorCounter.fetch_add(1u)] = path;
+                }
+            });
+        });
+    }
+
+    // same fields as the megakernel writes for a path that reached an emitter
+    sycl::event record(sycl::buffer<Camera, 1>& camerabuf, const WavefrontSettings& settings, const WavefrontPath* paths, size_t count,
+                       sycl::buffer<CollisionRecord>& collision_buf, sycl::buffer<int, 1>& counter_buf)
+    {
+        const unsigned int* finished = _finished;
+        int widthUnit = settings._widthUnit;
+        int heightUnit = settings._heightUnit;
+        size_t recordCapacity = collision_buf.size();
+        return _queue.submit([&](sycl::handler& cgh) {
+            auto cameraAcc = camerabuf.template get_access<sycl::access::mode::read>(cgh);
+            sycl::accessor counter_acc(counter_buf, cgh, sycl::read_write);
+            sycl::accessor collision_acc(collision_buf, cgh, sycl::write_only);
+            cgh.parallel_for(sycl::range<1>(count), [=](sycl::id<1> index) {
+                const WavefrontPath& path = paths[finished[index[0]]];
+                auto v_counter = sycl::atomic_ref<
+                    int,
+                    sycl::ext::oneapi::detail::memory_order::relaxed,
+                    sycl::ext::oneapi::detail::memory_scope::device,
+                    sycl::access::address_space::global_space>(counter_acc[0]);
+                int idx = v_counter.fetch_add(1);
+                if (static_cast<size_t>(idx) >= recordCapacity)
+                {
+                    return;
+                }
+                collision_acc[idx].collisionCount = path._result._collisionCount;
+                collision_acc[idx].distance = path._result._travelDistance;
+                collision_acc[idx].collisionLocation = path._result._position;
+                collision_acc[idx].collisionDirection = cameraAcc[0].toCameraBase(path._result._direction);
+                collision_acc[idx].camera_x = path._pixelX / widthUnit;
+                collision_acc[idx].camera_y = path._pixelY / heightUnit;
+                collision_acc[idx].emission_delay = 0;
+            });
+        });
+    }
+};
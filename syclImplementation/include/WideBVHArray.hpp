@@ -0,0 +1,166 @@
+#pragma once
+
+#include "BVHArray.hpp"
+#include <algorithm>
+#include <vector>
+
+class ObjectList;
+
+// Collapsed BVH node with Width children. The child boxes are stored as
+// structure of arrays so one visit tests every lane with the same instructions.
+template <int Width>
+struct WideBVHNode
+{
+    myComputeType _minX[Width];
+    myComputeType _minY[Width];
+    myComputeType _minZ[Width];
+    myComputeType _maxX[Width];
+    myComputeType _maxY[Width];
+    myComputeType _maxZ[Width];
+    // >= 0 inner node, kEmptyChild unused lane, otherwise encoded object index
+    int _child[Width];
+
+    static constexpr int kEmptyChild = -1;
+    static int encodeLeaf(long objectIndex) { return -static_cast<int>(objectIndex) - 2; }
+    static bool isLeaf(int child) { return child <= -2; }
+    static long leafObject(int child) { return -static_cast<long>(child) - 2; }
+
+    WideBVHNode()
+    {
+        Bounds3 empty;
+        for (int lane = 0; lane < Width; lane++)
+        {
+            setLane(lane, empty, kEmptyChild);
+        }
+    }
+
+    void setLane(int lane, const Bounds3& bounds, int child)
+    {
+        _minX[lane] = bounds.pMin.x;
+        _minY[lane] = bounds.pMin.y;
+        _minZ[lane] = bounds.pMin.z;
+        _maxX[lane] = bounds.pMax.x;
+        _maxY[lane] = bounds.pMax.y;
+        _maxZ[lane] = bounds.pMax.z;
+        _child[lane] = child;
+    }
+};
+
+
+template <int Width>
+class WideBVHArray
+{
+    long _arraySize = 0;
+    WideBVHNode<Width>* _array = nullptr;
+
+    public:
+
+    // enough for typical trees; a collapsed tree that could need more is
+    // traversed in the binary layout instead, see wideStackDepth
+    static constexpr int kStackSize = 128;
+
+    WideBVHArray() = default;
+
+    void setWideBVHArray(size_t arraySize, WideBVHNode<Width>* array)
+    {
+        _arraySize = arraySize;
+        _array = array;
+    }
+
+    long getArraySize() const
+    {
+        return _arraySize;
+    }
+
+    Intersection Intersect(const Ray& ray, const ObjectList* objects) const;
+};
+
+
+// Pulls up to Width binary subtrees into one wide node, always opening the
+// inner child with the largest surface area first.
+template <int Width>
+int collapseWideNode(const BVHArray& bvh, long binaryIndex, std::vector<WideBVHNode<Width>>& nodes)
+{
+    int wideIndex = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+
+    long lanes[Width];
+    int laneCount = 0;
+    const BVHNode* root = bvh.getNode(binaryIndex);
+    if (root->_objectIndex >= 0)
+    {
+        lanes[laneCount++] = binaryIndex;
+    }
+    else
+    {
+        lanes[laneCount++] = root->_leftIndex;
+        lanes[laneCount++] = root->_rightIndex;
+    }
+
+    while (laneCount < Width)
+    {
+        int openLane = -1;
+        myComputeType openArea = -1;
+        for (int lane = 0; lane < laneCount; lane++)
+        {
+            const BVHNode* node = bvh.getNode(lanes[lane]);
+            if (node->_objectIndex < 0 && node->_bounds.SurfaceArea() > openArea)
+            {
+                openArea = node->_bounds.SurfaceArea();
+                openLane = lane;
+            }
+        }
+        if (openLane < 0)
+        {
+            break;
+        }
+        const BVHNode* node = bvh.getNode(lanes[openLane]);
+        lanes[openLane] = node->_leftIndex;
+        lanes[laneCount++] = node->_rightIndex;
+    }
+
+    for (int lane = 0; lane < laneCount; lane++)
+    {
+        const BVHNode* node = bvh.getNode(lanes[lane]);
+        int child = node->_objectIndex >= 0
+            ? WideBVHNode<Width>::encodeLeaf(node->_objectIndex)
+            : collapseWideNode<Width>(bvh, lanes[lane], nodes);
+        nodes[wideIndex].setLane(lane, node->_bounds, child);
+    }
+    return wideIndex;
+}
+
+// Most stack entries a traversal can hold below wide node index: its inner
+// children are pushed together and any of them may be popped first.
+template <int Width>
+int wideStackDepth(const std::vector<WideBVHNode<Width>>& nodes, int index = 0)
+{
+    if (nodes.empty())
+    {
+        return 0;
+    }
+    int innerCount = 0;
+    int deepest = 0;
+    for (int lane = 0; lane < Width; lane++)
+    {
+        int child = nodes[index]._child[lane];
+        if (child >= 0)
+        {
+            innerCount++;
+            deepest = std::max(deepest, wideStackDepth<Width>(nodes, child));
+        }
+    }
+    return innerCount == 0 ? 0 : std::max(innerCount, innerCount - 1 + deepest);
+}
+
+template <int Width>
+std::vector<WideBVHNode<Width>> collapseBVH(const BVHArray& bvh)
+{
+    std::vector<WideBVHNode<Width>> nodes;
+    if (bvh.getNode(0) != nullptr)
+    {
+        nodes.reserve(bvh.getArraySize() / (Width - 1) + 1);
+        collapseWideNode<Width>(bvh, 0, nodes);
+    }
+    return nodes;
+}
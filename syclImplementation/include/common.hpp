@@ -21,13 +21,13 @@ inline myComputeType clamp(myComputeType val, myComputeType low, myComputeType h
     else return val;
 }
 
-myComputeType get_random_float(RNG &rng)
+inline myComputeType get_random_float(RNG &rng)
 {
     oneapi::dpl::uniform_real_distribution<myComputeType> distribution(0.f, 1.f);
     return distribution(rng);
 }
 
-float sample_delay_distance( myComputeType mean_m, myComputeType std_m, RNG &rng) 
+inline float sample_delay_distance( myComputeType mean_m, myComputeType std_m, RNG &rng) 
 {
 
 
@@ -13,6 +13,16 @@
 
 
 
+// How a path continues after one bounce, see syclScene::shade.
+enum class PathEvent
+{
+    MISSED,
+    ABSORBED,
+    EMITTED,
+    SCATTERED
+};
+
+
 class syclScene
 {
 
@@ -22,6 +32,8 @@ class syclScene
         //BVHArray* _bvh = nullptr;
 
     public:
+
+        static constexpr int kMaxDepth = 10;    // bounces per path
         
         ~syclScene()
         {
@@ -49,6 +61,10 @@ class syclScene
             float emitArea = 0;
             for (size_t i = 0; i < objectsListSize; i++)
             {
+                if (_sceneObject.isSplitCopy(i))
+                {
+                    continue;
+                }
                 const Material* curMaterial = _sceneObject.getMaterial(i);
                 if (curMaterial->getEmission())
                 {
@@ -62,6 +78,10 @@ class syclScene
 
             for (size_t i = 0; i < objectsListSize; i++)
             {
+                if (_sceneObject.isSplitCopy(i))
+                {
+                    continue;
+                }
                 const Material* curMaterial = _sceneObject.getMaterial(i);
                 if (curMaterial->getEmission())
                 {
@@ -85,70 +105,78 @@ class syclScene
         resultRecordStructure doRendering(const Ray &initialRay, RNG &rng) const
         {
 
-            int maxDepth = 10;
-            int depth = 0;
             resultRecordStructure result;
-            Ray temRay = initialRay;
-            Ray &currentRay = temRay;
+            Ray currentRay = initialRay;
             result._collisionCount = 0;
             result._hit = false;
             result._travelDistance = 0;
     
             
-            for (depth = 0; depth < maxDepth; ++depth)
+            for (int depth = 0; depth < kMaxDepth; ++depth)
             {
-
-                
                 Intersection intersection = castRay(currentRay);
-
-                if (!intersection._hit)
+                result._rayCount++;
+                if (shade(intersection, currentRay, rng, result) != PathEvent::SCATTERED)
                 {
-                    result._hit = false;
                     return result;
                 }
+            }
 
-                if(get_random_float(rng) > 0.9)
-                {
-                    result._hit = false;
-                    return result;
-                }
+            return result;
+        } 
 
+        // One bounce of doRendering once the closest hit of ray is known:
+        // ends the path on a miss, by Russian roulette or on an emitter (the
+        // only case that sets result._hit), otherwise replaces ray with the
+        // scattered one. The wavefront engine calls it between its extend and
+        // record stages.
+        PathEvent shade(const Intersection &intersection, Ray &ray, RNG &rng, resultRecordStructure &result) const
+        {
+            if (!intersection._hit)
+            {
+                result._hit = false;
+                return PathEvent::MISSED;
+            }
 
-                result._travelDistance = result._travelDistance + (intersection._position - currentRay.origin).length();
-                result._collisionCount++;
-                
-                auto intersectionID = intersection._objectIndex;
-                const Material* intersectionMaterial = _sceneObject.getMaterial(intersectionID);
+            if(get_random_float(rng) > 0.9)
+            {
+                result._hit = false;
+                return PathEvent::ABSORBED;
+            }
 
-                if (intersectionMaterial->getEmission())
-                {
 
-                    result._hit = true;
-                    result._position = intersection._position;
-                    result._direction = currentRay.direction;
-                    
-                    return result;
-                }
-     
+            result._travelDistance = result._travelDistance + (intersection._position - ray.origin).length();
+            result._collisionCount++;
+            
+            auto intersectionID = intersection._objectIndex;
+            const Material* intersectionMaterial = _sceneObject.getMaterial(intersectionID);
 
-                const float EPSILON = 1e-5f;
-                Vec3 normal = intersection._normal.normalized();
-                // Vec3 offset = normal * EPSILON;
+            if (intersectionMaterial->getEmission())
+            {
 
-                // // Avoid biasing into the surface for transmission rays
-                // if (dotProduct(currentRay.direction, normal) > 0.0f) {
-                //     offset = -offset;
-                // }
+                result._hit = true;
+                result._position = intersection._position;
+                result._direction = ray.direction;
+                
+                return PathEvent::EMITTED;
+            }
+ 
 
-                // Vec3 safeOrigin = intersection._position + offset;
+            Vec3 normal = Vec3(intersection._normal).normalized();
+            // Vec3 offset = normal * EPSILON;
 
-                Vec3 safeOrigin = intersection._position ;
-                Vec3 newDirection = intersectionMaterial->sample(currentRay.direction, normal, rng);
-                currentRay = Ray(safeOrigin, newDirection);           
-            }
+            // // Avoid biasing into the surface for transmission rays
+            // if (dotProduct(ray.direction, normal) > 0.0f) {
+            //     offset = -offset;
+            // }
 
-            return result;
-        } 
+            // Vec3 safeOrigin = intersection._position + offset;
+
+            Vec3 safeOrigin = intersection._position ;
+            Vec3 newDirection = intersectionMaterial->sample(ray.direction, normal, rng);
+            ray = Ray(safeOrigin, newDirection);
+            return PathEvent::SCATTERED;
+        }
 
 
         void commit()
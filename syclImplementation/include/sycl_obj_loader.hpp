@@ -8,6 +8,13 @@
 #include <iostream>
 #include <memory>
 #include "ObjectList.hpp"
+#include "ParallelObjParser.hpp"
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
 
 
 
@@ -17,6 +24,11 @@ struct Triangle_OBJ_result{
     std::vector<Triangle> Triangles;
     std::vector<MaterialInfo> MaterialsInfoList;
     std::vector<int> materialIDs;
+    std::vector<size_t> shapeOffsets;   // first triangle of every shape, for findTranslatedInstances
+    // filled instead of Triangles when the loader uses indexed storage
+    std::vector<Vec3> Vertices;
+    std::vector<IndexedTriangle> IndexedTriangles;
+    AnalyticGeometry Analytic;          // boxes, quads and spheres of a .scene file
 };
 
 
@@ -29,9 +41,27 @@ class OBJ_Loader
     std::vector<Triangle> _gloabalTranglesResult;
     std::vector<MaterialInfo> _globalMaterialsInfoList;
     std::vector<int> _globalMaterialIDs;
+    std::vector<size_t> _globalShapeOffsets;
+    std::vector<Vec3> _globalVertices;
+    std::vector<IndexedTriangle> _globalIndexedTriangles;
+    AnalyticGeometry _globalAnalytic;
+    bool _indexedStorage = false;
 
     public:
 
+    // Indexed storage keeps the OBJ vertex buffer and 32-bit index triplets
+    // instead of full triangles, for scenes that do not fit otherwise. Set it
+    // before the first file is added.
+    void setIndexedStorage(bool indexed)
+    {
+        _indexedStorage = indexed;
+    }
+
+    size_t triangleCount() const
+    {
+        return _indexedStorage ? _globalIndexedTriangles.size() : _gloabalTranglesResult.size();
+    }
+
 
     Triangle_OBJ_result outputTrangleResult()
     {
@@ -39,6 +69,10 @@ class OBJ_Loader
         result.Triangles = _gloabalTranglesResult;
         result.MaterialsInfoList = _globalMaterialsInfoList;
         result.materialIDs = _globalMaterialIDs;
+        result.shapeOffsets = _globalShapeOffsets;
+        result.Vertices = _globalVertices;
+        result.IndexedTriangles = _globalIndexedTriangles;
+        result.Analytic = _globalAnalytic;
         return result;
     } 
     
@@ -54,75 +88,281 @@ class OBJ_Loader
             MaterialInfo camereMat = MaterialInfo(emissionVec,specularVec,diffuseVec);
             _globalMaterialsInfoList.push_back(camereMat);
             auto camTri = camera->generateDetector(camera->detectorWidth,camera->detectorHeight);
-            _gloabalTranglesResult.push_back(camTri.first);
-            _gloabalTranglesResult.push_back(camTri.second);
+            _globalShapeOffsets.push_back(triangleCount());
+            if (_indexedStorage)
+            {
+                for (const Triangle& tri : {camTri.first, camTri.second})
+                {
+                    uint32_t first = static_cast<uint32_t>(_globalVertices.size());
+                    _globalVertices.push_back(tri._v1);
+                    _globalVertices.push_back(tri._v2);
+                    _globalVertices.push_back(tri._v3);
+                    _globalIndexedTriangles.push_back(IndexedTriangle(first, first + 1, first + 2));
+                }
+            }
+            else
+            {
+                _gloabalTranglesResult.push_back(camTri.first);
+                _gloabalTranglesResult.push_back(camTri.second);
+            }
             _globalMaterialIDs.push_back(camearMaterailIndex);
             _globalMaterialIDs.push_back(camearMaterailIndex);
             // std::cout << camearMaterailIndex << std::endl;
         }
     }
 
+    // Vertices are converted once for the whole file, then every shape writes
+    // its triangles and material IDs at its own offset of the preallocated
+    // output, so the shapes are converted in parallel.
     void addTriangleObjectFile(std::string objFilePath, std::string objFile)
     {
 
         std::shared_ptr<tinyobj::ObjReader> readerPtr;
 
-        int previousIDSize = _globalMaterialIDs.size();
+        // the file's material IDs count from its first material in the global list
+        int materialOffset = static_cast<int>(_globalMaterialsInfoList.size());
+        auto parseStart = std::chrono::high_resolution_clock::now();
         readerPtr = loadObjFile(objFilePath, objFile);   
+        auto parseEnd = std::chrono::high_resolution_clock::now();
         
         loadMaterial(readerPtr);
 
-        auto& attrib = readerPtr->GetAttrib();
-        auto& shapes = readerPtr->GetShapes();
+        const auto& attrib = readerPtr->GetAttrib();
+        const auto& shapes = readerPtr->GetShapes();
 
-        
-        std::cout << "Load triangle size "<<shapes.size() << "  "<<std::endl;
+        std::vector<Vec3> vertices(attrib.vertices.size() / 3);
+        for (size_t i = 0; i < vertices.size(); i++)
+        {
+            vertices[i] = Vec3(attrib.vertices[3 * i], attrib.vertices[3 * i + 1], attrib.vertices[3 * i + 2]);
+        }
 
-        for (size_t i = 0; i<shapes.size(); i++) 
+        size_t vertexOffset = _globalVertices.size();
+        if (_indexedStorage)
         {
-            tinyobj::shape_t shape = shapes[i];
-            std::cout << shape.name << std::endl;
-            std::vector<Vec3> vertices;
+            reserveIndexedVertices(vertices.size());
+            _globalVertices.insert(_globalVertices.end(), vertices.begin(), vertices.end());
+        }
 
-            for (size_t i = 0;i<attrib.vertices.size();i+=3)
-            {
-                float vx = attrib.vertices[i];
-                float vy = attrib.vertices[i+1];
-                float vz = attrib.vertices[i+2];
-                vertices.push_back(Vec3(vx,vy,vz));
-            }
+        // first triangle of every shape in the global output
+        size_t firstTriangle = triangleCount();
+        std::vector<size_t> shapeTriangleOffsets(shapes.size() + 1);
+        shapeTriangleOffsets[0] = firstTriangle;
+        for (size_t i = 0; i < shapes.size(); i++)
+        {
+            _globalShapeOffsets.push_back(shapeTriangleOffsets[i]);
+            shapeTriangleOffsets[i + 1] = shapeTriangleOffsets[i] + shapes[i].mesh.indices.size() / 3;
+        }
+        std::cout << "[INFO] OBJ shapes: " << shapes.size() << ", triangles: " << shapeTriangleOffsets[shapes.size()] - firstTriangle << std::endl;
+        if (_indexedStorage)
+        {
+            _globalIndexedTriangles.resize(shapeTriangleOffsets[shapes.size()]);
+        }
+        else
+        {
+            _gloabalTranglesResult.resize(shapeTriangleOffsets[shapes.size()]);
+        }
+        _globalMaterialIDs.resize(shapeTriangleOffsets[shapes.size()]);
 
-            for (size_t i = 0; i < shape.mesh.indices.size(); i += 3)
+        int chunkCount = hostChunkCount(static_cast<long>(shapes.size()), hostThreadCount());
+        parallelChunks(0, static_cast<long>(shapes.size()), chunkCount, [&](int chunk, long begin, long end) {
+            for (long s = begin; s < end; s++)
             {
-                unsigned int index1 = shape.mesh.indices[i].vertex_index;
-                unsigned int index2 = shape.mesh.indices[i + 1].vertex_index;
-                unsigned int index3 = shape.mesh.indices[i + 2].vertex_index;
-
-                Triangle tri(vertices[index1], vertices[index2], vertices[index3]);
-                _gloabalTranglesResult.push_back(tri);
-                if( shape.name == "detector")
+                const tinyobj::shape_t& shape = shapes[s];
+                int* materialIDs = &_globalMaterialIDs[shapeTriangleOffsets[s]];
+                size_t triangleCount = shape.mesh.indices.size() / 3;
+                for (size_t t = 0; t < triangleCount; t++)
                 {
-                    std::cout << vertices[index1] << " " << vertices[index1] << " " << vertices[index1] <<std::endl;  
+                    const auto& indices = shape.mesh.indices;
+                    if (_indexedStorage)
+                    {
+                        _globalIndexedTriangles[shapeTriangleOffsets[s] + t] = IndexedTriangle(
+                            static_cast<uint32_t>(vertexOffset + indices[3 * t].vertex_index),
+                            static_cast<uint32_t>(vertexOffset + indices[3 * t + 1].vertex_index),
+                            static_cast<uint32_t>(vertexOffset + indices[3 * t + 2].vertex_index));
+                    }
+                    else
+                    {
+                        const Vec3& v1 = vertices[indices[3 * t].vertex_index];
+                        const Vec3& v2 = vertices[indices[3 * t + 1].vertex_index];
+                        const Vec3& v3 = vertices[indices[3 * t + 2].vertex_index];
+                        _gloabalTranglesResult[shapeTriangleOffsets[s] + t] = Triangle(v1, v2, v3);
+                    }
+                    int materialID = t < shape.mesh.material_ids.size() ? shape.mesh.material_ids[t] : -1;
+                    materialIDs[t] = materialID < 0 ? materialID : materialOffset + materialID;
                 }
             }
+        });
+
+        auto convertEnd = std::chrono::high_resolution_clock::now();
+        size_t loadedTriangles = triangleCount() - firstTriangle;
+        double parseMs = std::chrono::duration_cast<std::chrono::microseconds>(parseEnd - parseStart).count() / 1000.0;
+        double convertMs = std::chrono::duration_cast<std::chrono::microseconds>(convertEnd - parseEnd).count() / 1000.0;
+        std::cout << "Loaded " << objFilePath + objFile << " have " << triangleCount() << " Triangles in total."<<std::endl;
+        std::cout << "[INFO] OBJ load time: " << parseMs << " ms parse, " << convertMs << " ms conversion with "
+                  << chunkCount << " threads, " << (parseMs + convertMs) / std::max(loadedTriangles, size_t(1)) * 1e6
+                  << " ms per million triangles" << std::endl;
+    }
 
+    // Same outputs as addTriangleObjectFile from the parallel parser in
+    // ParallelObjParser.hpp, falls back to tinyobjloader when the file cannot
+    // be mapped.
+    void addTriangleObjectFileParallel(std::string objFilePath, std::string objFile, int threadCount = 0)
+    {
+        auto parseStart = std::chrono::high_resolution_clock::now();
+        ParsedObj parsed;
+        if (!parseObjParallel(objFilePath, objFile, threadCount, _indexedStorage, parsed))
+        {
+            std::cout << "Parallel OBJ parser could not map " << objFilePath + objFile << ", using tinyobjloader" << std::endl;
+            addTriangleObjectFile(objFilePath, objFile);
+            return;
+        }
 
-            
-        
-            for (auto &id : shape.mesh.material_ids)
+        int materialOffset = static_cast<int>(_globalMaterialsInfoList.size());
+        size_t firstTriangle = triangleCount();
+        loadMaterials(parsed._materials);
+        for (size_t offset : parsed._shapeOffsets)
+        {
+            _globalShapeOffsets.push_back(firstTriangle + offset);
+        }
+        if (_indexedStorage)
+        {
+            uint32_t vertexOffset = static_cast<uint32_t>(_globalVertices.size());
+            reserveIndexedVertices(parsed._vertices.size());
+            _globalVertices.insert(_globalVertices.end(), parsed._vertices.begin(), parsed._vertices.end());
+            _globalIndexedTriangles.reserve(_globalIndexedTriangles.size() + parsed._indices.size() / 3);
+            for (size_t t = 0; t < parsed._indices.size(); t += 3)
             {
+                _globalIndexedTriangles.push_back(IndexedTriangle(vertexOffset + parsed._indices[t], vertexOffset + parsed._indices[t + 1],
+                                                                  vertexOffset + parsed._indices[t + 2]));
+            }
+        }
+        else
+        {
+            _gloabalTranglesResult.insert(_gloabalTranglesResult.end(), parsed._triangles.begin(), parsed._triangles.end());
+        }
+        _globalMaterialIDs.reserve(_globalMaterialIDs.size() + parsed._materialIDs.size());
+        for (int id : parsed._materialIDs)
+        {
+            _globalMaterialIDs.push_back(id < 0 ? id : materialOffset + id);
+        }
+        auto parseEnd = std::chrono::high_resolution_clock::now();
+
+        double loadMs = std::chrono::duration_cast<std::chrono::microseconds>(parseEnd - parseStart).count() / 1000.0;
+        std::cout << "Loaded " << objFilePath + objFile << " have " << triangleCount() << " Triangles in total."<<std::endl;
+        std::cout << "[INFO] Parallel OBJ load time: " << loadMs << " ms with " << hostThreadCount(threadCount) << " threads, "
+                  << loadMs / std::max(parsed._materialIDs.size(), size_t(1)) * 1e6 << " ms per million triangles" << std::endl;
+    }
+
+    // Scene description: one statement per line, # starts a comment.
+    //   mtllib file.mtl                              materials for the lines below
+    //   obj mesh.obj                                 triangle mesh, loaded like a plain OBJ
+    //   box minX minY minZ maxX maxY maxZ material   axis-aligned box
+    //   quad ox oy oz ux uy uz vx vy vz material     parallelogram o + s*u + t*v
+    //   sphere cx cy cz radius material
+    // Paths are relative to the directory objFilePath. Primitives with an unknown material
+    // are skipped.
+    void addSceneDescription(std::string objFilePath, std::string sceneFile, int threadCount = 0)
+    {
+        std::ifstream scene(objFilePath + sceneFile);
+        if (!scene)
+        {
+            std::cerr << "Scene description " << objFilePath + sceneFile << " not found" << std::endl;
+            return;
+        }
 
-                _globalMaterialIDs.push_back(previousIDSize + id);
+        std::map<std::string, int> materialIndices;
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(scene, line))
+        {
+            lineNumber++;
+            std::istringstream fields(line.substr(0, line.find('#')));
+            std::string keyword, name;
+            if (!(fields >> keyword))
+            {
+                continue;
+            }
+            if (keyword == "mtllib" || keyword == "obj")
+            {
+                fields >> name;
+                if (keyword == "obj")
+                {
+                    addTriangleObjectFileParallel(objFilePath, "/" + name, threadCount);
+                    continue;
+                }
+                std::ifstream mtl(objFilePath + "/" + name);
+                if (!mtl)
+                {
+                    std::cerr << "Scene description: material file " << name << " not found" << std::endl;
+                    continue;
+                }
+                std::map<std::string, int> fileIndices;
+                std::vector<tinyobj::material_t> materials;
+                std::string warning, error;
+                tinyobj::LoadMtl(&fileIndices, &materials, &mtl, &warning, &error);
+                int materialOffset = static_cast<int>(_globalMaterialsInfoList.size());
+                loadMaterials(materials);
+                for (const auto& entry : fileIndices)
+                {
+                    materialIndices[entry.first] = materialOffset + entry.second;
+                }
+                continue;
             }
 
+            int valueCount = keyword == "box" ? 6 : keyword == "quad" ? 9 : keyword == "sphere" ? 4 : 0;
+            if (valueCount == 0)
+            {
+                std::cerr << "Scene description: unknown statement " << keyword << " on line " << lineNumber << std::endl;
+                continue;
+            }
+            float values[9];
+            for (int k = 0; k < valueCount; k++)
+            {
+                fields >> values[k];
+            }
+            fields >> name;
+            auto material = materialIndices.find(name);
+            if (!fields || material == materialIndices.end())
+            {
+                std::cerr << "Scene description: skipping " << keyword << " on line " << lineNumber
+                          << (fields ? ", unknown material " + name : ", malformed") << std::endl;
+                continue;
+            }
+            if (keyword == "box")
+            {
+                _globalAnalytic._boxes.push_back(Box(Vec3(values[0], values[1], values[2]), Vec3(values[3], values[4], values[5])));
+                _globalAnalytic._boxMaterialIDs.push_back(material->second);
+            }
+            else if (keyword == "quad")
+            {
+                _globalAnalytic._quads.push_back(Quad(Vec3(values[0], values[1], values[2]), Vec3(values[3], values[4], values[5]),
+                                                      Vec3(values[6], values[7], values[8])));
+                _globalAnalytic._quadMaterialIDs.push_back(material->second);
+            }
+            else
+            {
+                _globalAnalytic._spheres.push_back(Sphere(Vec3(values[0], values[1], values[2]), values[3]));
+                _globalAnalytic._sphereMaterialIDs.push_back(material->second);
+            }
         }
-        std::cout << "Loaded " << objFilePath + objFile << " have " << _gloabalTranglesResult.size() << " Triangles in total."<<std::endl;
+        std::cout << "Loaded " << objFilePath + sceneFile << ": " << triangleCount() << " triangles, "
+                  << _globalAnalytic._boxes.size() << " boxes, " << _globalAnalytic._quads.size() << " quads, "
+                  << _globalAnalytic._spheres.size() << " spheres" << std::endl;
     }
 
     std::shared_ptr<ObjectList> outputSyclObj(sycl::queue& queue);
 
     private:
 
+    void reserveIndexedVertices(size_t vertexCount)
+    {
+        if (_globalVertices.size() + vertexCount > std::numeric_limits<uint32_t>::max())
+        {
+            throw std::runtime_error("Indexed storage holds at most 2^32 - 1 vertices");
+        }
+        _globalVertices.reserve(_globalVertices.size() + vertexCount);
+    }
+
     std::shared_ptr<tinyobj::ObjReader> loadObjFile(std::string objFilePath, std::string objFile)
     {
         std::string inputfile = objFilePath + objFile;
@@ -150,7 +390,11 @@ class OBJ_Loader
 
     void loadMaterial(std::shared_ptr<tinyobj::ObjReader> readerPtr)
     {
-        auto materials = readerPtr->GetMaterials();
+        loadMaterials(readerPtr->GetMaterials());
+    }
+
+    void loadMaterials(const std::vector<tinyobj::material_t>& materials)
+    {
         std::cout << " load material size " <<materials.size() << std::endl;
         for(size_t i = 0; i< materials.size();i++)
         {
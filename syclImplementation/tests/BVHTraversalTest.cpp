@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <tiny_obj_loader.h>
+#include <sycl/sycl.hpp>
+#include "Vec.hpp"
+#include "syclScene.hpp"
+
+// Checks every BVH layout and build method against a brute-force closest hit
+// on the models given on the command line and on a deliberately deep tree,
+// the two-level BVH against the flat scene, and refitted trees against trees
+// built from scratch. Returns the number of failed checks.
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static const std::vector<std::pair<std::string, BVHBuildMethod>> kMethods = {
+    {"middle", BVHBuildMethod::MIDDLE}, {"sah", BVHBuildMethod::SAH}, {"sbvh", BVHBuildMethod::SBVH}, {"lbvh", BVHBuildMethod::LBVH}};
+
+static const std::vector<std::pair<std::string, BVHLayout>> kLayouts = {
+    {"binary", BVHLayout::BINARY}, {"bvh4", BVHLayout::WIDE4}, {"bvh8", BVHLayout::WIDE8},
+    {"compact", BVHLayout::COMPACT}, {"quantized8", BVHLayout::QUANTIZED8}, {"quantized16", BVHLayout::QUANTIZED16},
+    {"block8", BVHLayout::BLOCK8}, {"unordered", BVHLayout::BINARY_UNORDERED}};
+
+static Intersection bruteForce(const ObjectList& objects, const Ray& ray)
+{
+    Intersection closest;
+    for (size_t i = 0; i < objects.getObjectsListSize(); i++)
+    {
+        Intersection hit = objects.getIntersection(ray, i);
+        if (hit._hit && (!closest._hit || hit._distance < closest._distance))
+        {
+            closest = hit;
+        }
+    }
+    return closest;
+}
+
+// Rays from random points inside the bounds in uniformly random directions.
+static std::vector<Ray> randomRays(const Bounds3& bounds, int count)
+{
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::normal_distribution<float> gauss;
+    std::vector<Ray> rays;
+    for (int i = 0; i < count; i++)
+    {
+        Vec3 origin = bounds.pMin + Vec3(unit(rng), unit(rng), unit(rng)) * bounds.Diagonal();
+        rays.emplace_back(origin, Vec3(gauss(rng), gauss(rng), gauss(rng)).normalized());
+    }
+    return rays;
+}
+
+// Closest hits of scene against brute force over reference, which holds the
+// same triangles as a flat scene.
+static void compareHits(const std::string& name, const ObjectList& scene, const ObjectList& reference, const std::vector<Ray>& rays)
+{
+    int differing = 0;
+    int hits = 0;
+    for (const Ray& ray : rays)
+    {
+        Intersection traversed = scene.Intersect(ray);
+        Intersection expected = bruteForce(reference, ray);
+        hits += expected._hit;
+        if (traversed._hit != expected._hit
+            || (expected._hit && std::fabs(traversed._distance - expected._distance) > 1e-3f * expected._distance))
+        {
+            differing++;
+        }
+    }
+    check(hits > 0, name + ": no ray hits the scene");
+    check(differing == 0, name + ": " + std::to_string(differing) + " of " + std::to_string(rays.size()) + " rays differ from brute force");
+}
+
+static int bvhDepth(const ObjectListContent& content)
+{
+    BVHArray bvh;
+    bvh.setBVHArray(content._bvhSize, content._bvhResource);
+    return bvh.depth();
+}
+
+static void testLayouts(const std::string& name, std::vector<Triangle> triangles, std::vector<MaterialInfo> materials,
+                        std::vector<int> materialIDs, const std::vector<Ray>& rays, int binCount = 12)
+{
+    sycl::queue queue;
+    for (auto& method : kMethods)
+    {
+        for (auto& layout : kLayouts)
+        {
+            BVHBuildConfig config;
+            config._method = method.second;
+            config._layout = layout.second;
+            config._binCount = binCount;
+            std::string what = name + " " + method.first + "/" + layout.first;
+            ObjectListContent content(queue);
+            try
+            {
+                content.addObject(triangles, materials, materialIDs, config);
+            }
+            catch (const std::exception& e)
+            {
+                check(false, what + ": " + e.what());
+                continue;
+            }
+            check(bvhDepth(content) <= kMaxBVHDepth, what + ": BVH is " + std::to_string(bvhDepth(content)) + " levels deep");
+            ObjectList objects;
+            objects.setObjects(content);
+            compareHits(what, objects, objects, rays);
+        }
+    }
+}
+
+// Leaves larger than a block span several of them and most leaves end in a
+// partly filled block, whose empty lanes must never report a hit.
+static void testTriangleBlocks(const std::string& name, std::vector<Triangle> triangles, std::vector<MaterialInfo> materials,
+                               std::vector<int> materialIDs, const std::vector<Ray>& rays)
+{
+    sycl::queue queue;
+    for (int maxLeafSize : {1, 3, 8, 13, 20})
+    {
+        BVHBuildConfig config;
+        config._layout = BVHLayout::BLOCK8;
+        config._maxLeafSize = maxLeafSize;
+        ObjectListContent content(queue);
+        content.addObject(triangles, materials, materialIDs, config);
+        check(content._bvhLayout == BVHLayout::BLOCK8, name + ": triangle blocks were not used");
+        ObjectList objects;
+        objects.setObjects(content);
+        compareHits(name + " block8 leaf size " + std::to_string(maxLeafSize), objects, objects, rays);
+    }
+}
+
+// Every triangle moved by its own random offset of up to scale times the
+// scene diagonal.
+static std::vector<Triangle> moveTriangles(const std::vector<Triangle>& triangles, const Bounds3& bounds, float scale, int seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> offset(-scale, scale);
+    std::vector<Triangle> moved;
+    for (auto& triangle : triangles)
+    {
+        Vec3 delta = Vec3(offset(rng), offset(rng), offset(rng)) * bounds.Diagonal();
+        moved.emplace_back(triangle._v1 + delta, triangle._v2 + delta, triangle._v3 + delta);
+    }
+    return moved;
+}
+
+// Moves the triangles of content through updateTriangles and compares the
+// hits with a tree built from scratch over the moved triangles. Returns true
+// when updateTriangles rebuilt the BVH.
+static bool updateAndCompare(const std::string& name, ObjectListContent& content, std::vector<Triangle> moved,
+                             std::vector<MaterialInfo> materials, std::vector<int> materialIDs, const BVHBuildConfig& config,
+                             const std::vector<Ray>& rays)
+{
+    bool rebuilt = content.updateTriangles(moved);
+    ObjectListContent fresh(content._myQueue);
+    fresh.addObject(moved, materials, materialIDs, config);
+    ObjectList objects, reference;
+    objects.setObjects(content);
+    reference.setObjects(fresh);
+    compareHits(name, objects, reference, rays);
+    return rebuilt;
+}
+
+// A refit has to stay correct however far the triangles move, so it is first
+// checked with the rebuild trigger turned off. With the default threshold a
+// small motion refits and shuffling the triangles rebuilds.
+static void testRefit(const std::string& name, std::vector<Triangle> triangles, std::vector<MaterialInfo> materials,
+                      std::vector<int> materialIDs, const Bounds3& bounds, const std::vector<Ray>& rays)
+{
+    std::vector<Triangle> nudged = moveTriangles(triangles, bounds, 0.002f, 3);
+    std::vector<Triangle> shuffled = triangles;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(5));
+
+    sycl::queue queue;
+    for (auto& method : {kMethods[1], kMethods[2]})
+    {
+        for (auto& layout : kLayouts)
+        {
+            BVHBuildConfig config;
+            config._method = method.second;
+            config._layout = layout.second;
+            std::string what = name + " " + method.first + "/" + layout.first;
+
+            BVHBuildConfig refitOnly = config;
+            refitOnly._refitRebuildThreshold = 1e30f;
+            ObjectListContent refitted(queue);
+            refitted.addObject(triangles, materials, materialIDs, refitOnly);
+            check(!updateAndCompare(what + " refitted", refitted, nudged, materials, materialIDs, config, rays), what + ": refit rebuilt");
+            check(!updateAndCompare(what + " refitted after shuffle", refitted, shuffled, materials, materialIDs, config, rays),
+                  what + ": refit rebuilt");
+
+            ObjectListContent content(queue);
+            content.addObject(triangles, materials, materialIDs, config);
+            // refitted SBVH leaves bound whole triangles instead of the clipped
+            // references, which alone can raise the cost past the threshold
+            bool rebuilt = updateAndCompare(what + " nudged", content, nudged, materials, materialIDs, config, rays);
+            check(method.second == BVHBuildMethod::SBVH || !rebuilt, what + ": a small motion rebuilt the BVH instead of refitting it");
+            check(updateAndCompare(what + " shuffled", content, shuffled, materials, materialIDs, config, rays),
+                  what + ": shuffling the triangles did not trigger a rebuild");
+        }
+    }
+}
+
+static void testInstances(const std::string& name, std::vector<MeshInfo>& meshes, std::vector<InstanceInfo>& instances,
+                          std::vector<Triangle> triangles, std::vector<MaterialInfo> materials, std::vector<int> materialIDs,
+                          const std::vector<Ray>& rays, int binCount = 12)
+{
+    sycl::queue queue;
+    ObjectListContent flat(queue);
+    flat.addObject(triangles, materials, materialIDs);
+    ObjectList reference;
+    reference.setObjects(flat);
+    for (auto& method : {kMethods[0], kMethods[1]})
+    {
+        BVHBuildConfig config;
+        config._method = method.second;
+        config._binCount = binCount;
+        std::string what = name + " instanced " + method.first;
+        ObjectListContent content(queue);
+        try
+        {
+            content.addInstancedObject(meshes, instances, materials, config);
+        }
+        catch (const std::exception& e)
+        {
+            check(false, what + ": " + e.what());
+            continue;
+        }
+        ObjectList objects;
+        objects.setObjects(content);
+        compareHits(what, objects, reference, rays);
+    }
+}
+
+static void testModel(const std::string& model)
+{
+    size_t pos = model.find_last_of('/');
+    OBJ_Loader loader;
+    loader.addTriangleObjectFile(model.substr(0, pos), model.substr(pos));
+    Triangle_OBJ_result scene = loader.outputTrangleResult();
+    check(!scene.Triangles.empty(), model + ": no triangles loaded");
+    if (scene.Triangles.empty())
+    {
+        return;
+    }
+
+    Bounds3 bounds;
+    for (auto& triangle : scene.Triangles)
+    {
+        bounds = Union(bounds, triangle.getBounds_virtual());
+    }
+    std::vector<Ray> rays = randomRays(bounds, 2000);
+    testLayouts(model, scene.Triangles, scene.MaterialsInfoList, scene.materialIDs, rays);
+    testTriangleBlocks(model, scene.Triangles, scene.MaterialsInfoList, scene.materialIDs, rays);
+    testRefit(model, scene.Triangles, scene.MaterialsInfoList, scene.materialIDs, bounds, rays);
+
+    std::vector<MeshInfo> meshes;
+    std::vector<InstanceInfo> instances;
+    findTranslatedInstances(scene.Triangles, scene.materialIDs, scene.shapeOffsets, meshes, instances);
+    testInstances(model, meshes, instances, scene.Triangles, scene.MaterialsInfoList, scene.materialIDs, rays);
+}
+
+// 240 parallel triangles at x = -2^k, k = -120..119. With two SAH bins every
+// split peels one triangle off the near end, which without the depth cap
+// builds a 120-level tree that overflows the traversal stacks: every one of
+// these rays used to miss.
+static void testDeepTree()
+{
+    const int count = 240;
+    std::vector<Triangle> triangles;
+    for (int i = 0; i < count; i++)
+    {
+        float x = std::ldexp(1.0f, i - count / 2);
+        triangles.emplace_back(Vec3(-x, -1, -1), Vec3(-x, 1, -1), Vec3(-x, 0, 1));
+    }
+    std::vector<int> materialIDs(count, 0);
+    std::vector<MaterialInfo> materials(1, MaterialInfo(Vec3(0, 0, 0), Vec3(0, 0, 0), Vec3(0.5, 0.5, 0.5)));
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> offset(-0.1f, 0.1f);
+    std::vector<Ray> rays;
+    for (int i = 0; i < 4000; i++)
+    {
+        rays.emplace_back(Vec3(0, offset(rng), offset(rng)), Vec3(-1, 0, 0));
+    }
+    testLayouts("deep tree", triangles, materials, materialIDs, rays, 2);
+
+    // the same planes as instances of one triangle, which makes the top level deep
+    std::vector<MeshInfo> meshes(1);
+    meshes[0]._triangles.emplace_back(Vec3(0, -1, -1), Vec3(0, 1, -1), Vec3(0, 0, 1));
+    meshes[0]._materialIDs.push_back(0);
+    std::vector<InstanceInfo> instances(count);
+    for (int i = 0; i < count; i++)
+    {
+        instances[i]._mesh = 0;
+        instances[i]._transform = AffineTransform::translate(Vec3(-std::ldexp(1.0f, i - count / 2), 0, 0));
+    }
+    testInstances("deep tree", meshes, instances, triangles, materials, materialIDs, rays, 2);
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> models(argv + 1, argv + argc);
+    for (auto& model : models)
+    {
+        testModel(model);
+    }
+    testDeepTree();
+
+    std::cout << (failures == 0 ? "[INFO] All BVH traversal checks passed" : "[INFO] BVH traversal checks failed") << std::endl;
+    return failures;
+}
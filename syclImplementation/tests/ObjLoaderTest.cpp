@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <tiny_obj_loader.h>
+#include <sycl/sycl.hpp>
+#include "Vec.hpp"
+#include "sycl_obj_loader.hpp"
+
+// Checks the OBJ loaders against each other on the models given on the
+// command line, and the material IDs of a scene made of several OBJ files.
+// Returns the number of failed checks.
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static void splitPath(const std::string& model, std::string& ModelDir, std::string& ModelName)
+{
+    size_t pos = model.find_last_of('/');
+    ModelDir = model.substr(0, pos);
+    ModelName = model.substr(pos);
+}
+
+static bool sameVertex(const Vec3& a, const Vec3& b)
+{
+    return (a - b).length() <= 1e-5f * (1 + a.length());
+}
+
+// The parallel parser has to produce the triangles and material IDs of
+// tinyobjloader, in the same order.
+static void testParallelParser(const std::string& model)
+{
+    std::string ModelDir, ModelName;
+    splitPath(model, ModelDir, ModelName);
+
+    OBJ_Loader serialLoader;
+    serialLoader.addTriangleObjectFile(ModelDir, ModelName);
+    Triangle_OBJ_result serial = serialLoader.outputTrangleResult();
+
+    OBJ_Loader parallelLoader;
+    parallelLoader.addTriangleObjectFileParallel(ModelDir, ModelName, 4);
+    Triangle_OBJ_result parallel = parallelLoader.outputTrangleResult();
+
+    check(!serial.Triangles.empty(), model + ": no triangles loaded");
+    check(serial.Triangles.size() == parallel.Triangles.size(), model + ": triangle count differs");
+    check(serial.materialIDs == parallel.materialIDs, model + ": material IDs differ");
+    check(serial.MaterialsInfoList.size() == parallel.MaterialsInfoList.size(), model + ": material count differs");
+    size_t differing = 0;
+    for (size_t i = 0; i < std::min(serial.Triangles.size(), parallel.Triangles.size()); i++)
+    {
+        if (!sameVertex(serial.Triangles[i]._v1, parallel.Triangles[i]._v1) || !sameVertex(serial.Triangles[i]._v2, parallel.Triangles[i]._v2)
+            || !sameVertex(serial.Triangles[i]._v3, parallel.Triangles[i]._v3))
+        {
+            differing++;
+        }
+    }
+    check(differing == 0, model + ": " + std::to_string(differing) + " triangles differ");
+}
+
+static void writeFile(const std::filesystem::path& path, const std::string& text)
+{
+    std::ofstream file(path);
+    file << text;
+}
+
+// A scene description with two obj lines: the second file's material IDs
+// have to point past the first file's materials, not past its triangles.
+static void testSceneMaterialOffsets()
+{
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "lidar_obj_loader_test";
+    std::filesystem::create_directories(dir);
+    writeFile(dir / "first.mtl", "newmtl red\nKd 1 0 0\nnewmtl green\nKd 0 1 0\n");
+    writeFile(dir / "second.mtl", "newmtl blue\nKd 0 0 1\n");
+    writeFile(dir / "first.obj", "mtllib first.mtl\n"
+                                 "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+                                 "usemtl red\nf 1 2 3\nf 1 3 4\n"
+                                 "usemtl green\nf 3 2 1\nf 4 3 1\n");
+    writeFile(dir / "second.obj", "mtllib second.mtl\n"
+                                  "v 0 0 1\nv 1 0 1\nv 1 1 1\n"
+                                  "usemtl blue\nf 1 2 3\nf 3 2 1\n");
+    writeFile(dir / "two.scene", "obj first.obj\nobj second.obj\n");
+
+    OBJ_Loader loader;
+    loader.addSceneDescription(dir.string(), "/two.scene");
+    Triangle_OBJ_result scene = loader.outputTrangleResult();
+    check(scene.MaterialsInfoList.size() == 3, "two obj lines: material count is " + std::to_string(scene.MaterialsInfoList.size()));
+    check(scene.materialIDs == std::vector<int>({0, 0, 1, 1, 2, 2}), "two obj lines: unexpected material IDs");
+    for (int id : scene.materialIDs)
+    {
+        check(id < static_cast<int>(scene.MaterialsInfoList.size()), "two obj lines: material ID " + std::to_string(id) + " out of range");
+    }
+
+    // the same two files added one after the other through tinyobjloader
+    OBJ_Loader serialLoader;
+    serialLoader.addTriangleObjectFile(dir.string(), "/first.obj");
+    serialLoader.addTriangleObjectFile(dir.string(), "/second.obj");
+    Triangle_OBJ_result serial = serialLoader.outputTrangleResult();
+    check(serial.materialIDs == scene.materialIDs, "two obj files: tinyobjloader material IDs differ");
+
+    std::filesystem::remove_all(dir);
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> models(argv + 1, argv + argc);
+    for (auto& model : models)
+    {
+        testParallelParser(model);
+    }
+    testSceneMaterialOffsets();
+
+    std::cout << (failures == 0 ? "[INFO] All OBJ loader checks passed" : "[INFO] OBJ loader checks failed") << std::endl;
+    return failures;
+}